@@ -35,6 +35,14 @@ void nsleep(size_t us) {
 	}
 }
 
+// period is in femtoseconds, split so the product can not overflow
+uint64_t hpet_nanoseconds() {
+	uint64_t period = hpet_regs->capabilities >> 32;
+	uint64_t counter = hpet_regs->counter_value;
+
+	return (counter / 1000000) * period + (counter % 1000000) * period / 1000000;
+}
+
 void hpet_init() {
 	hpet_table = acpi_find_sdt("HPET");
 	hpet_regs = (struct hpet_regs*)(hpet_table->address + HIGH_VMA);
@@ -31,4 +31,5 @@ struct hpet_regs {
 
 void msleep(size_t ms);
 void usleep(size_t us);
+uint64_t hpet_nanoseconds();
 void hpet_init();
@@ -1,18 +1,23 @@
-#include <int/idt.h> 
 #include <sched/sched.h>
+#include <sched/smp.h>
 #include <int/apic.h>
+#include <drivers/hpet.h>
 #include <lib/cpu.h>
 #include <time.h>
 #include <debug.h>
 #include <limine.h>
 
-#define PIT_FREQ 1000
-
 struct timespec clock_realtime;
 struct timespec clock_monotonic;
 
+static struct timespec clock_boot;
+static char clock_lock;
+
 typeof(timer_list) timer_list;
 
+static char timer_lock;
+static uint64_t timer_next = -1;
+
 static volatile struct limine_boot_time_request limine_boot_time_request = {
 	.id = LIMINE_BOOT_TIME_REQUEST,
 	.revision = 0
@@ -51,49 +56,102 @@ struct timespec timespec_sub(struct timespec a, struct timespec b) {
 	return ret;
 }
 
-void pit_handler(struct registers*, void*) {
-	struct timespec interval = { .tv_sec = 0, .tv_nsec = TIMER_HZ / PIT_FREQ };
+static uint64_t timespec_to_ns(struct timespec timespec) {
+	return timespec.tv_sec * TIMER_HZ + timespec.tv_nsec;
+}
 
-	clock_realtime = timespec_add(clock_realtime, interval);
-	clock_monotonic = timespec_add(clock_monotonic, interval);
+static struct timespec ns_to_timespec(uint64_t ns) {
+	return (struct timespec) { .tv_sec = ns / TIMER_HZ, .tv_nsec = ns % TIMER_HZ };
+}
 
-	for(size_t i = 0; i < timer_list.length; i++) {
-		struct timer *timer = timer_list.data[i];
+// nothing ticks anymore, the clocks are the boot time plus the hpet counter whenever some core passes by
+void clock_update(uint64_t now) {
+	if(__atomic_test_and_set(&clock_lock, __ATOMIC_ACQUIRE)) {
+		return;
+	}
 
-		timer->timespec = timespec_sub(timer->timespec, interval);
+	clock_realtime = timespec_add(clock_boot, ns_to_timespec(now));
+	clock_monotonic = clock_realtime;
 
-		if(timer->timespec.tv_nsec == 0 && timer->timespec.tv_sec == 0) {
-			for(size_t j = 0; j < timer->triggers.length; j++) {
-				struct event_trigger *trigger = timer->triggers.data[j];
+	spinrelease(&clock_lock);
+}
 
-				trigger->agent_task = CURRENT_TASK;
-				trigger->agent_thread = CURRENT_THREAD;
+// the first deadline in timer_list or -1, read by the scheduler under its queue lock so it can not take timer_lock
+uint64_t timer_next_deadline() {
+	return __atomic_load_n(&timer_next, __ATOMIC_RELAXED);
+}
 
-				event_fire(trigger);
-			}
-			
-			VECTOR_REMOVE_BY_INDEX(timer_list, i);
+static void timer_update_next() {
+	uint64_t next = -1;
+
+	for(size_t i = 0; i < timer_list.length; i++) {
+		if(timer_list.data[i]->deadline < next) {
+			next = timer_list.data[i]->deadline;
 		}
 	}
+
+	__atomic_store_n(&timer_next, next, __ATOMIC_RELAXED);
 }
 
-void pit_init() {
-	int divisor = 1193182 / PIT_FREQ;
+// the bsp keeps the timers, it has to rearm if the new one is due before whatever it waits for
+void timer_add(struct timer *timer, struct timespec *timespec) {
+	timer->deadline = hpet_nanoseconds() + timespec_to_ns(*timespec);
+
+	uint64_t rflags = interrupts_save();
+	spinlock(&timer_lock);
+
+	VECTOR_PUSH(timer_list, timer);
+
+	bool earliest = timer->deadline < timer_next_deadline();
+	timer_update_next();
 
-	if((1193182 % PIT_FREQ) > (PIT_FREQ / 2)) { // round up
-		divisor++;
+	spinrelease(&timer_lock);
+	interrupts_restore(rflags);
+
+	if(earliest) {
+		xapic_send_ipi(cpu_local_list.data[0]->apic_id, 32);
 	}
+}
+
+// fires on the bsp from the scheduler, triggers are fired without the lock as they take run queue locks
+void timer_expire(uint64_t now) {
+	for(;;) {
+		struct timer *timer = NULL;
+
+		spinlock(&timer_lock);
+
+		for(size_t i = 0; i < timer_list.length; i++) {
+			if(timer_list.data[i]->deadline <= now) {
+				timer = timer_list.data[i];
+				VECTOR_REMOVE_BY_INDEX(timer_list, i);
+				break;
+			}
+		}
+
+		timer_update_next();
 
-	outb(0x43, (0b010 << 1) | (0b11 << 4)); // channel 0, lobyte/hibyte, rate generator
-	outb(0x40, divisor & 0xff);
-	outb(0x40, divisor >> 8 & 0xff);
+		spinrelease(&timer_lock);
 
-	int vector = idt_alloc_vector(pit_handler, NULL);
+		if(timer == NULL) {
+			return;
+		}
+
+		for(size_t j = 0; j < timer->triggers.length; j++) {
+			struct event_trigger *trigger = timer->triggers.data[j];
 
-	ioapic_set_irq_redirection(xapic_read(XAPIC_ID_REG_OFF), vector, 0, false);
+			trigger->agent_task = CURRENT_TASK;
+			trigger->agent_thread = CURRENT_THREAD;
+
+			event_fire(trigger);
+		}
+	}
+}
 
+// the pit itself is left unprogrammed, it only hands over the boot time
+void pit_init() {
 	int64_t epoch = limine_boot_time_request.response->boot_time;
 
-	clock_realtime = (struct timespec) { .tv_sec = epoch, .tv_nsec = 0 };
-	clock_monotonic = (struct timespec) { .tv_sec = epoch, .tv_nsec = 0 };
+	clock_boot = (struct timespec) { .tv_sec = epoch, .tv_nsec = 0 };
+
+	clock_update(hpet_nanoseconds());
 }
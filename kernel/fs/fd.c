@@ -53,7 +53,7 @@ static int user_lookup_at(int dirfd, const char *path, int lookup_flags, mode_t
 
 	VECTOR(const char*) subpath_list = { 0 };
 
-	char *str = alloc(strlen(path));
+	char *str = alloc(strlen(path) + 1);
 	strcpy(str, path);
 
 	while(*str == '/') *str++ = 0;
@@ -1077,7 +1077,7 @@ void syscall_symlinkat(struct registers *regs) {
 		return;
 	}
 
-	char *path = alloc(strlen(target));
+	char *path = alloc(strlen(target) + 1);
 	strcpy(path, target);
 
 	link_node->symlink = path;
@@ -48,7 +48,8 @@ int initramfs() {
 
 		*ramfs_handle = (struct ramfs_handle) {
 			.inode = ramfs_inode_cnt++,
-			.buffer = (void*)((uintptr_t)ustar_header + 512)
+			.buffer = (void*)((uintptr_t)ustar_header + 512),
+			.length = octal_to_decimal(ustar_header->size)
 		};
 
 		hash_table_push(&ramfs_node_list, &ramfs_handle->inode, ramfs_handle, sizeof(ramfs_handle->inode));
@@ -71,6 +72,7 @@ int initramfs() {
 		asset->read = ramfs_read;
 		asset->write = ramfs_write;
 		asset->resize = ramfs_resize;
+		asset->pagecache = pagecache_create(asset, &ramfs_pagecache_ops);
 		asset->event = alloc(sizeof(struct event));
 		asset->trigger = alloc(sizeof(struct event_trigger));
 		asset->trigger->event = asset->event;
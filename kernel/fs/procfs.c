@@ -0,0 +1,253 @@
+#include <fs/procfs.h>
+#include <mm/pmm.h>
+#include <mm/slab.h>
+#include <mm/vmalloc.h>
+#include <mm/thp.h>
+#include <mm/filemap.h>
+#include <mm/pagecache.h>
+#include <mm/reclaim.h>
+#include <mm/ksm.h>
+#include <mm/swap.h>
+#include <sched/sched.h>
+#include <drivers/hpet.h>
+#include <string.h>
+#include <stdarg.h>
+#include <debug.h>
+#include <cpu.h>
+
+#define PROCFS_BUFFER_SIZE 0x1000
+#define PROCFS_LINE_MAX 256
+
+void procfs_print(struct procfs_buffer *buffer, const char *format, ...) {
+	char line[PROCFS_LINE_MAX];
+
+	va_list arg;
+	va_start(arg, format);
+
+	size_t length = vsprint(line, format, arg);
+
+	va_end(arg);
+
+	if(buffer->length + length > buffer->capacity) {
+		while(buffer->length + length > buffer->capacity) {
+			buffer->capacity *= 2;
+		}
+
+		buffer->data = realloc(buffer->data, buffer->capacity);
+	}
+
+	memcpy8((void*)buffer->data + buffer->length, (void*)line, length);
+	buffer->length += length;
+}
+
+static ssize_t procfs_read(struct asset *asset, void*, off_t offset, off_t cnt, void *buf) {
+	struct procfs_entry *entry = asset->something;
+
+	// the contents are regenerated on every read so they are never stale
+	struct procfs_buffer buffer = {
+		.data = alloc(PROCFS_BUFFER_SIZE),
+		.length = 0,
+		.capacity = PROCFS_BUFFER_SIZE
+	};
+
+	entry->generate(&buffer);
+
+	if(offset >= buffer.length) {
+		free(buffer.data);
+		return 0;
+	}
+
+	if(offset + cnt > buffer.length) {
+		cnt = buffer.length - offset;
+	}
+
+	memcpy8(buf, (void*)buffer.data + offset, cnt);
+	free(buffer.data);
+
+	return cnt;
+}
+
+void procfs_create(const char *name, void (*generate)(struct procfs_buffer *buffer)) {
+	struct asset *asset = vfs_default_asset(S_IFREG | S_IRUSR | S_IRGRP | S_IROTH);
+	struct procfs_entry *entry = alloc(sizeof(struct procfs_entry));
+
+	entry->generate = generate;
+
+	asset->read = procfs_read;
+	asset->something = entry;
+
+	char *path = alloc(MAX_PATH_LENGTH);
+	sprint(path, "/proc/%s", name);
+
+	vfs_create_node_deep(NULL, asset, NULL, path);
+}
+
+static void procfs_meminfo(struct procfs_buffer *buffer) {
+	size_t region_cnt = pmm_get_region_stats(NULL, 0);
+	struct pmm_region_stats *regions = alloc(sizeof(struct pmm_region_stats) * region_cnt);
+
+	region_cnt = pmm_get_region_stats(regions, region_cnt);
+
+	size_t total_pages = 0, free_pages = 0;
+	for(size_t i = 0; i < region_cnt; i++) {
+		total_pages += regions[i].pages;
+		free_pages += regions[i].free_pages;
+	}
+
+	struct pmm_cache_stats cache_stats;
+	pmm_get_cache_stats(&cache_stats);
+
+	size_t cache_cnt = slab_get_stats(NULL, 0);
+	struct slab_cache_stats *caches = alloc(sizeof(struct slab_cache_stats) * cache_cnt);
+
+	cache_cnt = slab_get_stats(caches, cache_cnt);
+
+	size_t slab_pages = 0;
+	for(size_t i = 0; i < cache_cnt; i++) {
+		slab_pages += caches[i].slabs * caches[i].pages_per_slab;
+	}
+
+	struct vmalloc_stats vmalloc_stats;
+	vmalloc_get_stats(&vmalloc_stats);
+
+	struct thp_stats thp_stats;
+	thp_get_stats(&thp_stats);
+
+	struct pagecache_stats pagecache_stats;
+	pagecache_get_stats(&pagecache_stats);
+
+	struct swap_stats swap_stats;
+	swap_get_stats(&swap_stats);
+
+	procfs_print(buffer, "MemTotal: %d kB\n", total_pages * 4);
+	procfs_print(buffer, "MemFree: %d kB\n", free_pages * 4);
+	procfs_print(buffer, "MemUsed: %d kB\n", (total_pages - free_pages) * 4);
+	procfs_print(buffer, "PerCpuCached: %d kB\n", cache_stats.cached * 4);
+	procfs_print(buffer, "PerCpuZeroed: %d kB\n", cache_stats.zeroed * 4);
+	procfs_print(buffer, "Cached: %d kB\n", pagecache_stats.pages * 4);
+	procfs_print(buffer, "Dirty: %d kB\n", pagecache_stats.dirty * 4);
+	procfs_print(buffer, "Active(file): %d kB\n", pagecache_stats.active * 4);
+	procfs_print(buffer, "Inactive(file): %d kB\n", pagecache_stats.inactive * 4);
+	procfs_print(buffer, "SwapTotal: %d kB\n", swap_stats.slots * 4);
+	procfs_print(buffer, "SwapFree: %d kB\n", (swap_stats.slots - swap_stats.used) * 4);
+	procfs_print(buffer, "Slab: %d kB\n", slab_pages * 4);
+	procfs_print(buffer, "VmallocUsed: %d kB\n", vmalloc_stats.pages * 4);
+	procfs_print(buffer, "VmallocAreas: %d\n", vmalloc_stats.areas);
+	procfs_print(buffer, "AnonHugePages: %d kB\n", thp_stats.mapped * (VMM_HUGE_PAGE_SIZE / 1024));
+	procfs_print(buffer, "ThpFaults: %d\n", thp_stats.faults);
+	procfs_print(buffer, "ThpFallbacks: %d\n", thp_stats.fallbacks);
+	procfs_print(buffer, "ThpSplits: %d\n", thp_stats.splits);
+	procfs_print(buffer, "ThpCollapses: %d\n", thp_stats.collapses);
+	procfs_print(buffer, "ThpCopies: %d\n", thp_stats.copies);
+
+	for(size_t i = 0; i < region_cnt; i++) {
+		procfs_print(buffer, "Region %x: %d pages, %d free, %d used\n", regions[i].base, regions[i].pages,
+			regions[i].free_pages, regions[i].pages - regions[i].free_pages);
+	}
+
+	free(regions);
+	free(caches);
+}
+
+static void procfs_slabinfo(struct procfs_buffer *buffer) {
+	size_t cache_cnt = slab_get_stats(NULL, 0);
+	struct slab_cache_stats *caches = alloc(sizeof(struct slab_cache_stats) * cache_cnt);
+
+	cache_cnt = slab_get_stats(caches, cache_cnt);
+
+	procfs_print(buffer, "# name active_objs num_objs objsize pagesperslab slabs cached_objs overhead_bytes\n");
+
+	for(size_t i = 0; i < cache_cnt; i++) {
+		struct slab_cache_stats *cache = &caches[i];
+
+		procfs_print(buffer, "%s %d %d %d %d %d %d %d\n", cache->name ? cache->name : "unnamed",
+			cache->active_objects, cache->total_objects, cache->object_size, cache->pages_per_slab,
+			cache->slabs, cache->cached_objects, cache->overhead);
+	}
+
+	free(caches);
+}
+
+static void procfs_vmstat(struct procfs_buffer *buffer) {
+	struct filemap_stats stats;
+	filemap_get_stats(&stats);
+
+	struct pagecache_stats pagecache_stats;
+	pagecache_get_stats(&pagecache_stats);
+
+	procfs_print(buffer, "pagecache_hits %d\n", pagecache_stats.hits);
+	procfs_print(buffer, "pagecache_misses %d\n", pagecache_stats.misses);
+	procfs_print(buffer, "pagecache_activations %d\n", pagecache_stats.activations);
+	procfs_print(buffer, "pagecache_evictions %d\n", pagecache_stats.evictions);
+	procfs_print(buffer, "pagecache_writebacks %d\n", pagecache_stats.writebacks);
+
+	struct reclaim_stats reclaim_stats;
+	reclaim_get_stats(&reclaim_stats);
+
+	struct swap_stats swap_stats;
+	swap_get_stats(&swap_stats);
+
+	procfs_print(buffer, "pgscan %d\n", reclaim_stats.scanned);
+	procfs_print(buffer, "pgactivate %d\n", reclaim_stats.activated);
+	procfs_print(buffer, "pgdeactivate %d\n", reclaim_stats.deactivated);
+	procfs_print(buffer, "pgsteal_file %d\n", reclaim_stats.file);
+	procfs_print(buffer, "pgsteal_anon %d\n", reclaim_stats.anon);
+	procfs_print(buffer, "pswpin %d\n", swap_stats.ins);
+	procfs_print(buffer, "pswpout %d\n", swap_stats.outs);
+	procfs_print(buffer, "direct_reclaim %d\n", reclaim_stats.direct);
+	procfs_print(buffer, "kswapd_wakeups %d\n", reclaim_stats.kswapd_wakeups);
+
+	struct ksm_stats ksm_stats;
+	ksm_get_stats(&ksm_stats);
+
+	procfs_print(buffer, "ksm_pages_shared %d\n", ksm_stats.pages_shared);
+	procfs_print(buffer, "ksm_pages_sharing %d\n", ksm_stats.pages_sharing);
+	procfs_print(buffer, "ksm_pages_saved %d\n", ksm_stats.pages_saved);
+	procfs_print(buffer, "ksm_pages_scanned %d\n", ksm_stats.scanned);
+	procfs_print(buffer, "ksm_merges %d\n", ksm_stats.merges);
+	procfs_print(buffer, "ksm_zero_pages %d\n", ksm_stats.zero_pages);
+	procfs_print(buffer, "ksm_full_scans %d\n", ksm_stats.full_scans);
+
+	procfs_print(buffer, "filemap_faults %d\n", stats.faults);
+	procfs_print(buffer, "readahead_hits %d\n", stats.ra_hits);
+	procfs_print(buffer, "readahead_misses %d\n", stats.ra_misses);
+	procfs_print(buffer, "readahead_pages %d\n", stats.ra_pages);
+	procfs_print(buffer, "faultaround_pages %d\n", stats.around_pages);
+
+	for(size_t i = 0; i < FILEMAP_RA_ORDERS; i++) {
+		procfs_print(buffer, "readahead_window_%d %d\n", 1 << i, stats.windows[i]);
+	}
+}
+
+static void procfs_schedstat(struct procfs_buffer *buffer) {
+	size_t cpu_cnt = sched_get_stats(NULL, 0);
+	struct sched_queue_stats *cpus = alloc(sizeof(struct sched_queue_stats) * cpu_cnt);
+
+	cpu_cnt = sched_get_stats(cpus, cpu_cnt);
+
+	uint64_t uptime_ms = hpet_nanoseconds() / 1000000;
+
+	procfs_print(buffer, "uptime_ms %d\n", uptime_ms);
+	procfs_print(buffer, "# cpu apic_id queued idle ticks switches interrupts idle_wakeups timer_expiries wakeups_per_sec "
+		"wakeup_preemptions min_vruntime idle_steals balance_pulls migrations_out\n");
+
+	for(size_t i = 0; i < cpu_cnt; i++) {
+		struct sched_queue_stats *cpu = &cpus[i];
+
+		// averaged since boot, sample interrupts twice for the current rate
+		size_t wakeups_per_sec = uptime_ms ? cpu->interrupts * 1000 / uptime_ms : 0;
+
+		procfs_print(buffer, "cpu%d %d %d %d %d %d %d %d %d %d %d %d %d %d %d\n", cpu->cpu, cpu->apic_id, cpu->queued,
+			cpu->idle, cpu->ticks, cpu->switches, cpu->interrupts, cpu->idle_wakeups, cpu->timer_expiries, wakeups_per_sec,
+			cpu->wakeup_preemptions, cpu->min_vruntime, cpu->idle_steals, cpu->balance_pulls, cpu->migrations_out);
+	}
+
+	free(cpus);
+}
+
+void procfs_init() {
+	procfs_create("meminfo", procfs_meminfo);
+	procfs_create("vmstat", procfs_vmstat);
+	procfs_create("slabinfo", procfs_slabinfo);
+	procfs_create("schedstat", procfs_schedstat);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <fs/vfs.h>
+
+struct procfs_buffer {
+	char *data;
+	size_t length;
+	size_t capacity;
+};
+
+struct procfs_entry {
+	void (*generate)(struct procfs_buffer *buffer);
+};
+
+void procfs_print(struct procfs_buffer *buffer, const char *format, ...);
+void procfs_create(const char *name, void (*generate)(struct procfs_buffer *buffer));
+void procfs_init();
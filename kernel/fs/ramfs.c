@@ -1,5 +1,6 @@
 #include <fs/ramfs.h>
 #include <fs/vfs.h>
+#include <mm/pagecache.h>
 #include <hash.h>
 #include <vector.h>
 #include <cpu.h>
@@ -22,6 +23,7 @@ struct vfs_node *ramfs_create(struct vfs_node *parent, const char *name, int mod
 	asset->read = ramfs_read;
 	asset->write = ramfs_write;
 	asset->resize = ramfs_resize;
+	asset->pagecache = pagecache_create(asset, &ramfs_pagecache_ops);
 
 	asset->stat->st_ino = ramfs_inode_cnt++;
 	asset->stat->st_blksize = 512;
@@ -44,21 +46,39 @@ struct vfs_node *ramfs_create(struct vfs_node *parent, const char *name, int mod
 	return vfs_node;
 }
 
-ssize_t ramfs_read(struct asset *asset, void*, off_t offset, off_t cnt, void *buf) {
-	spinlock(&asset->lock);
-
-	struct stat *stat = asset->stat;
-
+static struct ramfs_handle *ramfs_find_handle(struct asset *asset) {
 	spinlock(&ramfs_lock);
-	struct ramfs_handle *ramfs_handle = hash_table_search(&ramfs_node_list, &stat->st_ino, sizeof(stat->st_ino));
+	struct ramfs_handle *ramfs_handle = hash_table_search(&ramfs_node_list, &asset->stat->st_ino, sizeof(asset->stat->st_ino));
 	spinrelease(&ramfs_lock);
 
-	if(ramfs_handle == NULL) {
-		spinrelease(&asset->lock);
+	return ramfs_handle;
+}
+
+// files unpacked from the initramfs fill from the archive, everything else starts out as zeroes
+static ssize_t ramfs_readpage(struct asset *asset, off_t offset, void *buffer) {
+	struct ramfs_handle *ramfs_handle = ramfs_find_handle(asset);
+
+	if(ramfs_handle == NULL || ramfs_handle->buffer == NULL || offset >= ramfs_handle->length) {
 		return 0;
 	}
 
-	if(offset > stat->st_size) {
+	size_t cnt = ramfs_handle->length - offset < PAGE_SIZE ? ramfs_handle->length - offset : PAGE_SIZE;
+	memcpy8(buffer, ramfs_handle->buffer + offset, cnt);
+
+	return cnt;
+}
+
+// there is nothing to write back to, dirty pages stay in the cache
+const struct pagecache_ops ramfs_pagecache_ops = {
+	.readpage = ramfs_readpage
+};
+
+ssize_t ramfs_read(struct asset *asset, void*, off_t offset, off_t cnt, void *buf) {
+	spinlock(&asset->lock);
+
+	struct stat *stat = asset->stat;
+
+	if(asset->pagecache == NULL) {
 		spinrelease(&asset->lock);
 		return 0;
 	}
@@ -67,15 +87,9 @@ ssize_t ramfs_read(struct asset *asset, void*, off_t offset, off_t cnt, void *bu
 	stat->st_mtim = clock_realtime;
 	stat->st_ctim = clock_realtime;
 
-	if(offset + cnt > stat->st_size) {
-		cnt = stat->st_size - offset;
-	}
-
-	memcpy8(buf, ramfs_handle->buffer + offset, cnt);
-
 	spinrelease(&asset->lock);
 
-	return cnt;
+	return pagecache_read(asset->pagecache, offset, cnt, buf);
 }
 
 ssize_t ramfs_write(struct asset *asset, void*, off_t offset, off_t cnt, const void *buf) {
@@ -83,11 +97,7 @@ ssize_t ramfs_write(struct asset *asset, void*, off_t offset, off_t cnt, const v
 
 	struct stat *stat = asset->stat;
 
-	spinlock(&ramfs_lock);
-	struct ramfs_handle *ramfs_handle = hash_table_search(&ramfs_node_list, &stat->st_ino, sizeof(stat->st_ino));
-	spinrelease(&ramfs_lock);
-
-	if(ramfs_handle == NULL) {
+	if(asset->pagecache == NULL) {
 		spinrelease(&asset->lock);
 		return 0;
 	}
@@ -96,29 +106,18 @@ ssize_t ramfs_write(struct asset *asset, void*, off_t offset, off_t cnt, const v
 	stat->st_mtim = clock_realtime;
 	stat->st_ctim = clock_realtime;
 
-	if(offset + cnt > stat->st_size) {
-		//stat->st_size += offset + cnt - stat->st_size;
-		stat->st_size = offset + cnt;
-		ramfs_handle->buffer = realloc(ramfs_handle->buffer, stat->st_size);
-	}
-
-	memcpy8(ramfs_handle->buffer + offset, buf, cnt);
-
 	spinrelease(&asset->lock);
 
-	return cnt;
+	return pagecache_write(asset->pagecache, offset, cnt, buf);
 }
 
 int ramfs_resize(struct asset *asset, void*, off_t cnt) {
 	spinlock(&asset->lock);
 
 	struct stat *stat = asset->stat;
+	struct ramfs_handle *ramfs_handle = ramfs_find_handle(asset);
 
-	spinlock(&ramfs_lock);
-	struct ramfs_handle *ramfs_handle = hash_table_search(&ramfs_node_list, &stat->st_ino, sizeof(stat->st_ino));
-	spinrelease(&ramfs_lock);
-
-	if(ramfs_handle == NULL) {
+	if(ramfs_handle == NULL || asset->pagecache == NULL) {
 		spinrelease(&asset->lock);
 		return -1;
 	}
@@ -127,8 +126,11 @@ int ramfs_resize(struct asset *asset, void*, off_t cnt) {
 	stat->st_mtim = clock_realtime;
 	stat->st_ctim = clock_realtime;
 
-	stat->st_size = cnt;
-	ramfs_handle->buffer = realloc(ramfs_handle->buffer, stat->st_size);
+	if(ramfs_handle->length > (size_t)cnt) { // the archive must not show through once the file grows again
+		ramfs_handle->length = cnt;
+	}
+
+	pagecache_truncate(asset->pagecache, cnt);
 
 	spinrelease(&asset->lock);
 
@@ -2,10 +2,12 @@
 
 #include <fs/vfs.h>
 #include <hash.h>
+#include <mm/pagecache.h>
 
 struct ramfs_handle {
 	size_t inode;
-	void *buffer;
+	void *buffer; // read only image the page cache fills from
+	size_t length;
 };
 
 extern size_t ramfs_inode_cnt;
@@ -13,6 +15,7 @@ extern char ramfs_lock;
 
 extern struct hash_table ramfs_node_list;
 extern struct filesystem ramfs_filesystem;
+extern const struct pagecache_ops ramfs_pagecache_ops;
 
 struct vfs_node *ramfs_create(struct vfs_node *parent, const char *name, int mode);
 ssize_t ramfs_read(struct asset *asset, void*, off_t offset, off_t cnt, void *buf);
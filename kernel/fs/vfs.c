@@ -135,7 +135,7 @@ struct vfs_node *vfs_create_node_deep(struct vfs_node *parent, struct asset *ass
 
 	VECTOR(const char*) subpath_list = { 0 };
 
-	char *str = alloc(strlen(path));
+	char *str = alloc(strlen(path) + 1);
 	strcpy(str, path);
 
 	while(*str == '/') *str++ = 0;
@@ -184,7 +184,7 @@ struct vfs_node *vfs_search_absolute(struct vfs_node *parent, const char *path,
 
 	VECTOR(const char*) subpath_list = { 0 };
 
-	char *str = alloc(strlen(path));
+	char *str = alloc(strlen(path) + 1);
 	strcpy(str, path);
 
 	while(*str == '/') *str++ = 0;
@@ -255,7 +255,7 @@ struct vfs_node *vfs_parent_dir(struct vfs_node *parent, const char *path) {
 
 	VECTOR(const char*) subpath_list = { 0 };
 
-	char *str = alloc(strlen(path));
+	char *str = alloc(strlen(path) + 1);
 	strcpy(str, path);
 
 	while(*str == '/') *str++ = 0;
@@ -21,8 +21,6 @@ struct vfs_node {
 
 	VECTOR(struct vfs_node*) children;
 
-	struct hash_table shared_pages;
-
 	const char *symlink;
 };
 
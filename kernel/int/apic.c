@@ -32,6 +32,18 @@ uint32_t xapic_read(uint32_t reg) {
 	return *(volatile uint32_t*)((rdmsr(MSR_LAPIC_BASE) & 0xfffff000) + HIGH_VMA + reg);
 }
 
+// the scheduler sends ipis from interrupt context too, one landing between the two writes would redirect ours
+void xapic_send_ipi(uint8_t apic_id, uint8_t vector) {
+	uint64_t rflags = interrupts_save();
+
+	while(xapic_read(XAPIC_ICR_OFF) & IOAPIC_DELIVS); // wait out the previous ipi
+
+	xapic_write(XAPIC_ICR_OFF + 0x10, (uint32_t)apic_id << 24);
+	xapic_write(XAPIC_ICR_OFF, vector); // fixed delivery, physical destination
+
+	interrupts_restore(rflags);
+}
+
 void ioapic_write_redirection_table(struct ioapic *ioapic, uint32_t redirection_entry, uint64_t data) {
 	ioapic_write(ioapic, redirection_entry + 0x10, data & 0xffffffff);
 	ioapic_write(ioapic, redirection_entry + 0x10 + 1, data >> 32 & 0xffffffff);
@@ -42,19 +54,73 @@ uint64_t ioapic_read_redirection_table(struct ioapic *ioapic, uint8_t redirectio
 	return data;
 }
 
-void apic_timer_init(uint32_t ms) {
+static uint64_t apic_timer_ticks_per_ms;
+static uint64_t apic_tsc_per_ms;
+static bool apic_tsc_deadline;
+
+static uint64_t apic_ns_to_ticks(uint64_t ns, uint64_t per_ms) {
+	return (ns / 1000000) * per_ms + (ns % 1000000) * per_ms / 1000000;
+}
+
+// once on the bsp against the hpet, the other cores run off the same clocks
+void apic_timer_calibrate(uint32_t ms) {
 	xapic_write(XAPIC_TIMER_DIVIDE_CONF_OFF, 0x3); // divide by 16
 	xapic_write(XAPIC_TIMER_INITAL_COUNT_OFF, ~0);
 
+	uint64_t tsc = rdtsc();
+
 	msleep(ms);
 
 	uint32_t ticks = ~0 - xapic_read(XAPIC_TIMER_CURRENT_COUNT_OFF);
+	tsc = rdtsc() - tsc;
+
+	xapic_write(XAPIC_TIMER_INITAL_COUNT_OFF, 0);
+
+	apic_timer_ticks_per_ms = ticks / ms;
+	apic_tsc_per_ms = tsc / ms;
+
+	// a deadline in tsc cycles only holds if the tsc does not follow the core frequency
+	apic_tsc_deadline = (cpuid(1, 0).rcx & (1 << 24)) && (cpuid(0x80000007, 0).rdx & (1 << 8));
+
+	print("apic: timer %d ticks/ms, tsc %d cycles/ms%s\n", apic_timer_ticks_per_ms, apic_tsc_per_ms,
+		apic_tsc_deadline ? ", using tsc deadline" : "");
+}
+
+// one-shot and disarmed, the scheduler arms it for the next event of the core
+void apic_timer_init() {
+	if(apic_tsc_deadline) {
+		xapic_write(XAPIC_TIMER_LVT_OFF, 0x20 | APIC_TIMER_TSC_DEADLINE);
+		asm volatile ("mfence" ::: "memory"); // the mode switch has to land before the first deadline write
+		wrmsr(MSR_TSC_DEADLINE, 0);
+	} else {
+		xapic_write(XAPIC_TIMER_DIVIDE_CONF_OFF, 0x3); // divide by 16
+		xapic_write(XAPIC_TIMER_LVT_OFF, 0x20);
+		xapic_write(XAPIC_TIMER_INITAL_COUNT_OFF, 0);
+	}
+}
+
+void apic_timer_oneshot(uint64_t ns) {
+	if(apic_tsc_deadline) {
+		wrmsr(MSR_TSC_DEADLINE, rdtsc() + apic_ns_to_ticks(ns, apic_tsc_per_ms) + 1);
+		return;
+	}
+
+	uint64_t ticks = apic_ns_to_ticks(ns, apic_timer_ticks_per_ms);
+
+	if(ticks == 0) ticks = 1;
+	if(ticks > 0xffffffff) ticks = 0xffffffff;
 
-	xapic_write(XAPIC_TIMER_LVT_OFF, 0x20 | (1 << 17));
-	xapic_write(XAPIC_TIMER_DIVIDE_CONF_OFF, 0x3); // divide by 16
 	xapic_write(XAPIC_TIMER_INITAL_COUNT_OFF, ticks);
 }
 
+void apic_timer_stop() {
+	if(apic_tsc_deadline) {
+		wrmsr(MSR_TSC_DEADLINE, 0);
+	} else {
+		xapic_write(XAPIC_TIMER_INITAL_COUNT_OFF, 0);
+	}
+}
+
 int ioapic_set_irq_redirection(uint32_t lapic_id, uint8_t vector, uint8_t irq, bool mask) {
 	uint64_t flags = 0;
 
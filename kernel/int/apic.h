@@ -53,6 +53,8 @@
 #define XAPIC_TIMER_CURRENT_COUNT_OFF 0x390
 #define XAPIC_TIMER_DIVIDE_CONF_OFF 0x3E0
 
+#define APIC_TIMER_TSC_DEADLINE (0b10 << 17)
+
 struct ioapic {
 	uint32_t ioapic_id;
 	uint32_t ioapic_version;
@@ -65,12 +67,16 @@ struct ioapic {
 };
 
 void apic_init();
-void apic_timer_init(uint32_t ms);
+void apic_timer_calibrate(uint32_t ms);
+void apic_timer_init();
+void apic_timer_oneshot(uint64_t ns);
+void apic_timer_stop();
 uint32_t ioapic_read(struct ioapic *ioapic, uint8_t reg);
 void ioapic_write(struct ioapic *ioapic, uint32_t reg, uint32_t data);
 void ioapic_write_redirection_table(struct ioapic *ioapic, uint32_t redirection_entry, uint64_t data);
 void xapic_write(uint32_t reg, uint32_t data);
 uint32_t xapic_read(uint32_t reg);
+void xapic_send_ipi(uint8_t apic_id, uint8_t vector);
 uint64_t ioapic_read_redirection_table(struct ioapic *ioapic, uint8_t redirection_entry);
 int ioapic_set_irq_redirection(uint32_t lapic_id, uint8_t vector, uint8_t irq, bool bask);
 
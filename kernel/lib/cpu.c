@@ -14,7 +14,7 @@ struct cpuid_state cpuid(size_t leaf, size_t subleaf) {
 		return ret;
 	}
 
-	asm volatile ("cpuid" : "=a"(ret.rax), "=b"(ret.rbx), "=c"(ret.rcx), "=d"(ret.rbx) : "a"(leaf), "c"(subleaf));
+	asm volatile ("cpuid" : "=a"(ret.rax), "=b"(ret.rbx), "=c"(ret.rcx), "=d"(ret.rdx) : "a"(leaf), "c"(subleaf));
 
 	return ret;
 }
@@ -30,6 +30,7 @@ void init_cpu_features() {
 
 	cr0 &= ~(1 << 2); // ensure EM=0
 	cr0 |= (1 << 1); // set MP=0
+	cr0 |= (1 << 16); // set WP, the aps come up without it and the kernel would write through read-only user ptes
 
 	asm volatile ("mov %0, %%cr0" :: "r"(cr0));
 
@@ -40,9 +41,14 @@ void init_cpu_features() {
 			(1 << 9) | // Enables SSE and fxsave/fxrstor
 			(1 << 10); // Enables unmasked SSE exceptions
 											
+	struct cpuid_state cpuid_state = cpuid(1, 0);
+	if(cpuid_state.rcx & (1 << 17)) {
+		cr4 |= (1 << 17); // PCIDE, cr3 is still on pcid 0 here
+	}
+
 	asm volatile ("mov %0, %%cr4" :: "r"(cr4));
 
-	struct cpuid_state cpuid_state = cpuid(7, 0);
+	cpuid_state = cpuid(7, 0);
 	if(cpuid_state.rcx & (1 << 16)) {
 		HIGH_VMA = 0xff00000000000000;
 	}
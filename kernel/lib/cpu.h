@@ -10,6 +10,7 @@
 extern uint64_t HIGH_VMA;
 
 #define MSR_LAPIC_BASE 0x1b
+#define MSR_TSC_DEADLINE 0x6e0
 #define MSR_EFER 0xc0000080
 #define MSR_STAR 0xc0000081
 #define MSR_LSTAR 0xc0000082
@@ -140,6 +141,24 @@ static inline void invlpg(uint64_t vaddr) {
 	asm volatile ("invlpg %0" :: "m"((*((int(*)[])((void*)vaddr)))) : "memory");
 }
 
+static inline uint64_t rdtsc() {
+	uint32_t low, high;
+	asm volatile ("rdtsc" : "=a"(low), "=d"(high));
+	return ((uint64_t)high << 32) | low;
+}
+
+static inline uint64_t interrupts_save() {
+	uint64_t rflags;
+	asm volatile ("pushfq\n\tpop %0\n\tcli" : "=r"(rflags) :: "memory");
+	return rflags;
+}
+
+static inline void interrupts_restore(uint64_t rflags) {
+	if(rflags & (1 << 9)) {
+		asm volatile ("sti" ::: "memory");
+	}
+}
+
 static inline void spinlock(void *lock) {
 	while(__atomic_test_and_set(lock, __ATOMIC_ACQUIRE));
 }
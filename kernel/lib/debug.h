@@ -1,6 +1,14 @@
 #pragma once
 
 //#define SYSCALL_DEBUG
+//#define PMM_SELF_TEST
+//#define SLAB_BENCHMARK
+//#define VMM_FORK_BENCHMARK
+//#define VMM_REGION_BENCHMARK
+//#define VMM_SELF_TEST
+//#define SCHED_BENCHMARK
+//#define SWAP_TEST
+//#define KSM
 
 void print(const char *str, ...);
 void panic(const char *str, ...);
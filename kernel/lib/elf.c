@@ -18,6 +18,53 @@ int elf_validate(struct elf_hdr *hdr) {
 	return 0;
 }
 
+static int elf_prot(uint32_t p_flags) {
+	int prot = MMAP_PROT_USER;
+
+	if(p_flags & ELF_PF_R) prot |= MMAP_PROT_READ;
+	if(p_flags & ELF_PF_W) prot |= MMAP_PROT_WRITE;
+	if(p_flags & ELF_PF_X) prot |= MMAP_PROT_EXEC;
+
+	return prot;
+}
+
+// the file backed part is faulted in on demand, only the bss beyond it is anonymous
+static int elf_map_segment(struct page_table *page_table, struct elf64_phdr *phdr, int fd, uint64_t base) {
+	uintptr_t vaddr = base + phdr->p_vaddr;
+	size_t misalignment = vaddr & (PAGE_SIZE - 1);
+
+	uintptr_t start = vaddr - misalignment;
+	uintptr_t file_end = vaddr + phdr->p_filesz;
+	uintptr_t mem_end = vaddr + phdr->p_memsz;
+
+	int prot = elf_prot(phdr->p_flags);
+
+	if(phdr->p_filesz) {
+		void *addr = mmap(page_table, (void*)start, ALIGN_UP(file_end - start, PAGE_SIZE), prot,
+			MMAP_MAP_FIXED | MMAP_MAP_PRIVATE, fd, phdr->p_offset - misalignment);
+		if(addr == MMAP_MAP_FAILED) {
+			return -1;
+		}
+
+		// the rest of the last file page belongs to the bss, not to whatever follows in the file
+		if(mem_end > file_end && (file_end & (PAGE_SIZE - 1)) && (prot & MMAP_PROT_WRITE)) {
+			memset8((uint8_t*)file_end, 0, PAGE_SIZE - (file_end & (PAGE_SIZE - 1)));
+		}
+	}
+
+	uintptr_t bss = phdr->p_filesz ? ALIGN_UP(file_end, PAGE_SIZE) : start;
+
+	if(mem_end > bss) {
+		void *addr = mmap(page_table, (void*)bss, ALIGN_UP(mem_end - bss, PAGE_SIZE), prot,
+			MMAP_MAP_FIXED | MMAP_MAP_PRIVATE | MMAP_MAP_ANONYMOUS, -1, 0);
+		if(addr == MMAP_MAP_FAILED) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 int elf_load(struct page_table *page_table, struct aux *aux, int fd, uint64_t base, char **ld) {
 	struct elf_hdr hdr;
 	fd_read(fd, &hdr, sizeof(hdr));
@@ -54,26 +101,14 @@ int elf_load(struct page_table *page_table, struct aux *aux, int fd, uint64_t ba
 			continue;
 		}
 
-		size_t misalignment = phdr[i].p_vaddr & (PAGE_SIZE - 1);
-		size_t page_cnt = DIV_ROUNDUP(misalignment + phdr[i].p_memsz, PAGE_SIZE);
-
-		if((misalignment + phdr[i].p_memsz) > PAGE_SIZE) {
-			page_cnt++;
+		if(elf_map_segment(page_table, &phdr[i], fd, base) == -1) {
+			free(phdr);
+			return -1;
 		}
-
-		mmap(	page_table,
-				(void*)(phdr[i].p_vaddr + base - misalignment),
-				page_cnt * PAGE_SIZE,
-				MMAP_PROT_READ | MMAP_PROT_WRITE | MMAP_PROT_EXEC | MMAP_PROT_USER,
-				MMAP_MAP_FIXED | MMAP_MAP_ANONYMOUS,
-				-1,
-				-1
-			);
-
-		fd_seek(fd, phdr[i].p_offset, SEEK_SET);
-		fd_read(fd, (void*)(phdr[i].p_vaddr + base), phdr[i].p_filesz);
 	}
 
+	free(phdr);
+
 	aux->at_entry = base + hdr.entry;
 
 	return 0;
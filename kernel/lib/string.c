@@ -84,10 +84,7 @@ static void sprint_print_number(char *str, int *write_cnt, size_t number, int ba
 	}
 }
 
-int sprint(char *str, const char *format, ...) {
-	va_list arg;
-	va_start(arg, format);
-
+int vsprint(char *str, const char *format, va_list arg) {
 	int write_cnt = 0;
 
 	for(size_t i = 0; i < strlen(format); i++) {
@@ -131,9 +128,18 @@ int sprint(char *str, const char *format, ...) {
 
 	str[write_cnt++] = '\0';
 
+	return write_cnt - 1;
+}
+
+int sprint(char *str, const char *format, ...) {
+	va_list arg;
+	va_start(arg, format);
+
+	int ret = vsprint(str, format, arg);
+
 	va_end(arg);
 
-	return write_cnt - 1;
+	return ret;
 }
 
 void memcpy(void *dest, void *src, size_t n) {
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <types.h>
+#include <stdarg.h>
 
 #define DIV_ROUNDUP(a, b) (((a) + ((b) - 1)) / (b))
 #define ALIGN_UP(a, b) (DIV_ROUNDUP(a, b) * b)
@@ -118,6 +119,7 @@ static inline size_t find_last_char(const char *str, char c) {
 int strcmp(const char *str0, const char *str1);
 int strncmp(const char *str0, const char *str1, size_t n);
 int sprint(char *str, const char *format, ...);
+int vsprint(char *str, const char *format, va_list arg);
 int memcmp(const char *str0, const char *str, size_t n);
 char *strcpy(char *dest, const char *src);
 char *strncpy(char *dest, const char *src, size_t n);
@@ -9,6 +9,7 @@ struct event_trigger;
 
 struct timer {
 	struct timespec timespec;
+	uint64_t deadline; // hpet nanoseconds
 	VECTOR(struct event_trigger*) triggers;
 };
 
@@ -19,3 +20,8 @@ extern struct timespec clock_monotonic;
 
 struct timespec timespec_add(struct timespec a, struct timespec b);
 struct timespec timespec_sub(struct timespec a, struct timespec b);
+
+void clock_update(uint64_t now);
+void timer_add(struct timer *timer, struct timespec *timespec);
+void timer_expire(uint64_t now);
+uint64_t timer_next_deadline();
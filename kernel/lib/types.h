@@ -170,6 +170,7 @@ struct dirent {
 
 struct event;
 struct event_trigger;
+struct pagecache;
 
 struct vfs_node;
 
@@ -187,6 +188,8 @@ struct asset {
 
 	void *something;
 
+	struct pagecache *pagecache;
+
 	struct stat *stat;
 	char lock;
 };
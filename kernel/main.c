@@ -5,6 +5,12 @@
 #include <mm/vmm.h>
 #include <mm/mmap.h>
 #include <mm/slab.h>
+#include <mm/vmalloc.h>
+#include <mm/tlb.h>
+#include <mm/reclaim.h>
+#include <mm/thp.h>
+#include <mm/ksm.h>
+#include <mm/swap.h>
 #include <int/apic.h>
 #include <int/gdt.h>
 #include <int/idt.h>
@@ -19,6 +25,8 @@
 #include <drivers/fbdev.h>
 #include <fs/vfs.h>
 #include <fs/initramfs.h>
+#include <fs/procfs.h>
+#include <fs/ramfs.h>
 #include <sched/sched.h>
 #include <time.h>
 #include <hash.h>
@@ -139,7 +147,7 @@ void init_process() {
 	
 	VECTOR_PUSH(task->group->process_list, task);
 
-	task->status = TASK_WAITING;
+	sched_requeue(task, sched_translate_tid(task->pid, 0));
 }
 
 void pastoral_thread() {
@@ -149,6 +157,8 @@ void pastoral_thread() {
 		panic("initramfs: unable to initialise");
 	}
 
+	procfs_init();
+
 	limine_terminal_init();
 
 	struct limine_framebuffer **framebuffers = limine_framebuffer_request.response->framebuffers;
@@ -170,8 +180,27 @@ void pastoral_thread() {
 		vfs_create_node_deep(NULL, asset, NULL, device_path);
 	}
 
+#ifdef SWAP_TEST
+	// a ramfs file keeps its pages in memory, good enough to exercise swapping in and out
+	ramfs_create(vfs_root, "swapfile", S_IFREG | S_IRUSR | S_IWUSR);
+	if(swap_on("/swapfile", SWAP_TEST_PAGES) == -1) {
+		print("swap: unable to use /swapfile\n");
+	}
+#endif
+
+#ifdef SCHED_BENCHMARK
+	sched_benchmark(); // before init so nothing else competes for the cores
+#endif
+
 	init_process();
 
+	reclaim_init(); // after init so it keeps pid 1
+	thp_init();
+
+#ifdef KSM
+	ksm_init();
+#endif
+
 	sched_dequeue(CURRENT_TASK, CURRENT_THREAD);
 
 	for(;;)
@@ -185,22 +214,47 @@ void pastoral_entry(void) {
 
 	init_cpu_features();
 
+	set_kernel_gs(0); // no cpu_local until boot_aps, per-cpu caches stay disabled until then
+
 	pmm_init();
+	vmalloc_init();
 	vmm_init();
 
-	slab_cache_create(NULL, 32);
-	slab_cache_create(NULL, 64);
-	slab_cache_create(NULL, 128);
-	slab_cache_create(NULL, 256);
-	slab_cache_create(NULL, 512);
-	slab_cache_create(NULL, 1024);
-	slab_cache_create(NULL, 2048);
-	slab_cache_create(NULL, 4096);
-	slab_cache_create(NULL, 8192);
-	slab_cache_create(NULL, 16384);
+#ifdef PMM_SELF_TEST
+	pmm_self_test();
+#endif
+
+	// pagecache_page, fd_handle and event_trigger live in the small caches
+	slab_cache_create("kmalloc-32", 32, SLAB_CACHE_PERCPU);
+	slab_cache_create("kmalloc-64", 64, SLAB_CACHE_PERCPU);
+	slab_cache_create("kmalloc-128", 128, SLAB_CACHE_PERCPU);
+	slab_cache_create("kmalloc-256", 256, SLAB_CACHE_PERCPU);
+	slab_cache_create("kmalloc-512", 512, 0);
+	slab_cache_create("kmalloc-1024", 1024, 0);
+	slab_cache_create("kmalloc-2048", 2048, 0);
+	slab_cache_create("kmalloc-4096", 4096, 0);
+	slab_cache_create("kmalloc-8192", 8192, 0);
+	slab_cache_create("kmalloc-16384", 16384, 0);
+
+#ifdef SLAB_BENCHMARK
+	slab_benchmark();
+#endif
+
+#ifdef VMM_FORK_BENCHMARK
+	vmm_fork_benchmark();
+#endif
+
+#ifdef VMM_REGION_BENCHMARK
+	vmm_region_benchmark();
+#endif
+
+#ifdef VMM_SELF_TEST
+	vmm_self_test();
+#endif
 
 	gdt_init();
 	idt_init();
+	tlb_init();
 
 	rsdp = limine_rsdp_request.response->address;
 
@@ -216,11 +270,12 @@ void pastoral_entry(void) {
 
 	hpet_init();
 	apic_init();
+	apic_timer_calibrate(10); // before the aps set their timers up
 	boot_aps();
 	pci_init();
 	pit_init();
 
-	apic_timer_init(20);
+	apic_timer_init();
 
 	struct sched_task *kernel_task = sched_default_task();
 	struct sched_thread *kernel_thread = sched_default_thread(kernel_task);
@@ -237,11 +292,12 @@ void pastoral_entry(void) {
 
 	task_create_session(kernel_task);
 
-	kernel_task->status = TASK_WAITING;
-	kernel_thread->status = TASK_WAITING;
+	sched_requeue(kernel_task, kernel_thread);
 
 	asm ("sti");
 
-	for(;;)
+	for(;;) {
+		pmm_zero_idle();
 		asm ("hlt");
+	}
 }
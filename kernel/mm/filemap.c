@@ -0,0 +1,185 @@
+#include <mm/filemap.h>
+#include <mm/vmm.h>
+#include <mm/mmap.h>
+#include <mm/pmm.h>
+#include <mm/pagecache.h>
+#include <fs/vfs.h>
+#include <string.h>
+#include <cpu.h>
+#include <debug.h>
+
+#define FILEMAP_STAT_ADD(FIELD, VALUE) __atomic_add_fetch(&filemap_stats.FIELD, VALUE, __ATOMIC_RELAXED)
+
+static struct filemap_stats filemap_stats;
+
+static off_t filemap_offset(struct mmap_region *region, uintptr_t vaddr) {
+	return (region->offset & ~(0xfff)) + (vaddr - region->base);
+}
+
+// a file pte that has not been pointed at a frame yet
+static uint64_t *filemap_pending_entry(struct page_table *page_table, uintptr_t vaddr) {
+	uint64_t *entry = page_table->lowest_level(page_table, vaddr);
+
+	if(entry == NULL || (*entry & VMM_FILE_FLAG) == 0 || (*entry & VMM_FLAGS_P)) {
+		return NULL;
+	}
+
+	return entry;
+}
+
+// private mappings share the cache frame until they write to it
+static uint64_t filemap_entry_flags(uint64_t entry) {
+	uint64_t flags = (entry & ~VMM_PADDR_MASK) | VMM_FLAGS_P;
+
+	if((flags & VMM_SHARE_FLAG) == 0 && (flags & VMM_FLAGS_RW)) {
+		flags = (flags & ~VMM_FLAGS_RW) | VMM_COW_FLAG;
+	}
+
+	return flags;
+}
+
+// assets without a page cache (procfs, devices) hand every private mapping its own snapshot
+static int filemap_read_private(struct asset *asset, off_t offset, uint64_t *entry) {
+	if(asset->read == NULL) {
+		return 0;
+	}
+
+	uint64_t paddr = pmm_alloc_flags(1, 1, PMM_ALLOC_NOZERO);
+	if(paddr == (uint64_t)-1) {
+		return 0;
+	}
+
+	ssize_t cnt = asset->read(asset, NULL, offset, PAGE_SIZE, (void*)(paddr + HIGH_VMA));
+	if(cnt == -1) {
+		pmm_free(paddr, 1);
+		return 0;
+	}
+
+	if(cnt < PAGE_SIZE) {
+		memset8((void*)(paddr + HIGH_VMA + cnt), 0, PAGE_SIZE - cnt);
+	}
+
+	pmm_frame_map(paddr, FRAME_FILE);
+	*entry = paddr | (*entry & ~VMM_PADDR_MASK) | VMM_FLAGS_P;
+
+	return 1;
+}
+
+// point the pte at the cache frame for its offset, only a fill is allowed to read the page in
+static int filemap_map_page(struct mmap_region *region, uintptr_t vaddr, uint64_t *entry, bool fill) {
+	struct asset *asset = region->node->asset;
+	off_t offset = filemap_offset(region, vaddr);
+
+	if(asset->pagecache == NULL) {
+		return fill ? filemap_read_private(asset, offset, entry) : 0;
+	}
+
+	int frame_flags = FRAME_FILE | ((*entry & VMM_SHARE_FLAG) ? FRAME_SHARED : 0);
+
+	uint64_t paddr = fill ? pagecache_map(asset->pagecache, offset, frame_flags)
+		: pagecache_map_cached(asset->pagecache, offset, frame_flags);
+	if(paddr == (uint64_t)-1) {
+		return 0;
+	}
+
+	*entry = paddr | filemap_entry_flags(*entry);
+
+	return 1;
+}
+
+static void filemap_fault_around(struct page_table *page_table, struct mmap_region *region, uintptr_t address) {
+	uintptr_t start = address & ~(FILEMAP_FAULT_AROUND * PAGE_SIZE - 1);
+	size_t mapped = 0;
+
+	for(size_t i = 0; i < FILEMAP_FAULT_AROUND; i++) {
+		uintptr_t vaddr = start + i * PAGE_SIZE;
+		if(vaddr < region->base || vaddr >= region->base + region->limit) {
+			continue;
+		}
+
+		uint64_t *entry = filemap_pending_entry(page_table, vaddr);
+		if(entry && filemap_map_page(region, vaddr, entry, false)) {
+			mapped++;
+		}
+	}
+
+	FILEMAP_STAT_ADD(around_pages, mapped);
+}
+
+// grow the window while faults keep landing right behind the previous one, shrink it when they don't
+static size_t filemap_ra_window(struct mmap_region *region, uintptr_t faulting_page) {
+	size_t window = region->ra_window;
+
+	if(window == 0) {
+		window = FILEMAP_RA_MIN;
+	} else if(faulting_page == region->ra_next) {
+		FILEMAP_STAT_ADD(ra_hits, 1);
+		window = window * 2 > FILEMAP_RA_MAX ? FILEMAP_RA_MAX : window * 2;
+	} else {
+		FILEMAP_STAT_ADD(ra_misses, 1);
+		window = window / 2 ? window / 2 : 1;
+	}
+
+	size_t order = 0;
+	while((1ull << order) < window && order < FILEMAP_RA_ORDERS - 1) {
+		order++;
+	}
+
+	FILEMAP_STAT_ADD(windows[order], 1);
+
+	region->ra_window = window;
+
+	return window;
+}
+
+int filemap_fault(struct page_table *page_table, struct mmap_region *region, uintptr_t address) {
+	uintptr_t faulting_page = address & ~(0xfff);
+
+	uint64_t *entry = filemap_pending_entry(page_table, faulting_page);
+	if(entry == NULL) { // somebody else filled it in the meantime
+		entry = page_table->lowest_level(page_table, faulting_page);
+		return entry && (*entry & VMM_FLAGS_P);
+	}
+
+	FILEMAP_STAT_ADD(faults, 1);
+
+	if(filemap_map_page(region, faulting_page, entry, true) == 0) {
+		return 0;
+	}
+
+	size_t window = filemap_ra_window(region, faulting_page);
+
+	uintptr_t end = faulting_page + window * PAGE_SIZE;
+	if(end > region->base + region->limit) {
+		end = region->base + region->limit;
+	}
+
+	off_t size = region->node->asset->stat->st_size;
+	uintptr_t vaddr = faulting_page + PAGE_SIZE;
+	size_t read = 0;
+
+	for(; vaddr < end && filemap_offset(region, vaddr) < size; vaddr += PAGE_SIZE) {
+		entry = filemap_pending_entry(page_table, vaddr);
+		if(entry == NULL || filemap_map_page(region, vaddr, entry, false)) {
+			continue;
+		}
+
+		if(filemap_map_page(region, vaddr, entry, true) == 0) {
+			break;
+		}
+
+		read++;
+	}
+
+	region->ra_next = vaddr;
+
+	FILEMAP_STAT_ADD(ra_pages, read);
+
+	filemap_fault_around(page_table, region, faulting_page);
+
+	return 1;
+}
+
+void filemap_get_stats(struct filemap_stats *stats) {
+	*stats = filemap_stats;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <mm/vmm.h>
+
+#define FILEMAP_RA_MIN 4 // pages, the window a region starts out with
+#define FILEMAP_RA_MAX 64
+#define FILEMAP_RA_ORDERS 7 // window histogram buckets, 1 << i pages
+#define FILEMAP_FAULT_AROUND 16 // pages, aligned window around a fault checked for cached neighbours
+
+struct filemap_stats {
+	size_t faults;
+	size_t ra_hits;
+	size_t ra_misses;
+	size_t ra_pages;
+	size_t around_pages;
+	size_t windows[FILEMAP_RA_ORDERS];
+};
+
+int filemap_fault(struct page_table *page_table, struct mmap_region *region, uintptr_t address);
+void filemap_get_stats(struct filemap_stats *stats);
@@ -0,0 +1,428 @@
+#include <mm/ksm.h>
+#include <mm/pmm.h>
+#include <mm/mmap.h>
+#include <mm/mmap_region.h>
+#include <mm/tlb.h>
+#include <sched/sched.h>
+#include <cpu.h>
+#include <debug.h>
+
+// there is no reverse map, so a merged frame is only ever found through its checksum: the stable table
+// holds a reference of its own on each one and drops it once a pass finds no pte left pointing at it.
+// writes to a merged page take the ordinary cow fault, which copies it back out
+
+static struct ksm_node *ksm_stable[KSM_BUCKETS];
+static struct ksm_node *ksm_unstable[KSM_BUCKETS];
+
+static struct ksm_stats ksm_stats;
+static char ksm_lock;
+
+static struct page_table *ksm_cursor;
+static uintptr_t ksm_cursor_vaddr;
+
+static struct sched_task *ksmd_task;
+static struct sched_thread *ksmd_thread;
+static size_t ksmd_ticks;
+
+static uint64_t ksm_zero_checksum;
+
+static uint64_t ksm_checksum(uint64_t paddr) {
+	uint64_t *page = (uint64_t*)(paddr + HIGH_VMA);
+	uint64_t hash = 0xcbf29ce484222325;
+
+	for(size_t i = 0; i < PAGE_SIZE / 8; i++) {
+		hash = (hash ^ page[i]) * 0x100000001b3;
+	}
+
+	return hash;
+}
+
+static bool ksm_same(uint64_t paddr0, uint64_t paddr1) {
+	uint64_t *page0 = (uint64_t*)(paddr0 + HIGH_VMA);
+	uint64_t *page1 = (uint64_t*)(paddr1 + HIGH_VMA);
+
+	for(size_t i = 0; i < PAGE_SIZE / 8; i++) {
+		if(page0[i] != page1[i]) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static struct ksm_node *ksm_stable_search(uint64_t checksum, uint64_t paddr) {
+	for(struct ksm_node *node = ksm_stable[checksum % KSM_BUCKETS]; node; node = node->next) {
+		if(node->checksum == checksum && ksm_same(node->paddr, paddr)) {
+			return node;
+		}
+	}
+
+	return NULL;
+}
+
+static struct ksm_node **ksm_unstable_search(uint64_t checksum) {
+	struct ksm_node **link = &ksm_unstable[checksum % KSM_BUCKETS];
+
+	for(; *link; link = &(*link)->next) {
+		if((*link)->checksum == checksum) {
+			break;
+		}
+	}
+
+	return link;
+}
+
+static void ksm_unstable_clear() {
+	for(size_t i = 0; i < KSM_BUCKETS; i++) {
+		while(ksm_unstable[i]) {
+			struct ksm_node *node = ksm_unstable[i];
+			ksm_unstable[i] = node->next;
+			free(node);
+		}
+	}
+}
+
+// merged frames nobody maps anymore lose the table reference and go back to the pmm
+static void ksm_stable_sweep() {
+	for(size_t i = 0; i < KSM_BUCKETS; i++) {
+		struct ksm_node **link = &ksm_stable[i];
+
+		while(*link) {
+			struct ksm_node *node = *link;
+			struct frame *frame = pmm_frame(node->paddr);
+
+			if(frame->mapcount) {
+				link = &node->next;
+				continue;
+			}
+
+			*link = node->next;
+			pmm_frame_put(node->paddr);
+			free(node);
+		}
+	}
+}
+
+static uint64_t *ksm_pte(struct page_table *page_table, uintptr_t vaddr) {
+	uint64_t *pml2_entry = vmm_pml2_entry(page_table, vaddr);
+	if(pml2_entry == NULL || (*pml2_entry & VMM_FLAGS_P) == 0 || (*pml2_entry & VMM_FLAGS_PS)) {
+		return NULL;
+	}
+
+	uint64_t *pml1 = (uint64_t*)((*pml2_entry & VMM_PADDR_MASK) + HIGH_VMA);
+
+	return &pml1[(vaddr >> 12) & 0x1ff];
+}
+
+// a resident private anonymous page no other pte points at
+static bool ksm_candidate(uint64_t pte) {
+	if((pte & VMM_FLAGS_P) == 0 || (pte & (VMM_FILE_FLAG | VMM_SHARE_FLAG))) {
+		return false;
+	}
+
+	struct frame *frame = pmm_frame(pte & VMM_PADDR_MASK);
+
+	return frame && frame->refcnt == 1 && (frame->flags & FRAME_ANON) && !(frame->flags & FRAME_KSM);
+}
+
+// only ptes the mapping could write to get the cow flag, read only ones stay read only
+static uint64_t ksm_entry(uint64_t pte, uint64_t paddr) {
+	uint64_t entry = paddr | (pte & ~(VMM_PADDR_MASK | VMM_FLAGS_RW | VMM_FLAGS_D));
+
+	if(pte & (VMM_FLAGS_RW | VMM_COW_FLAG)) {
+		entry |= VMM_COW_FLAG;
+	}
+
+	return entry;
+}
+
+// the owner keeps running on other cores, so a page is only compared once nothing can store to it anymore.
+// a store in the meantime takes the cow fault, which finds the frame unshared and hands the write back
+static void ksm_write_protect(struct page_table *page_table, uintptr_t vaddr, uint64_t *entry) {
+	uint64_t pte = *entry;
+
+	if(pte & VMM_FLAGS_RW) {
+		*entry = (pte & ~(VMM_FLAGS_RW)) | VMM_COW_FLAG;
+		tlb_invalidate(page_table, vaddr);
+	}
+}
+
+// a left over page gets its write permission back without the fault, adding it needs no shootdown
+static void ksm_write_restore(uint64_t *entry) {
+	uint64_t pte = *entry;
+
+	if(pte & VMM_COW_FLAG) {
+		*entry = (pte & ~(VMM_COW_FLAG)) | VMM_FLAGS_RW;
+	}
+}
+
+static void ksm_replace(struct page_table *page_table, uintptr_t vaddr, uint64_t *entry, uint64_t paddr) {
+	uint64_t pte = *entry;
+
+	*entry = ksm_entry(pte, paddr);
+	pmm_frame_map(paddr, 0);
+
+	tlb_invalidate(page_table, vaddr); // other threads could still write through the old frame
+
+	pmm_frame_unmap(pte & VMM_PADDR_MASK);
+
+	ksm_stats.merges++;
+}
+
+// both tables are locked by the caller and the entry is write protected, returns whether it was merged
+static bool ksm_merge_unstable(struct page_table *page_table, uintptr_t vaddr, uint64_t *entry, struct ksm_node **link) {
+	struct ksm_node *node = *link;
+
+	uint64_t paddr = *entry & VMM_PADDR_MASK;
+	uint64_t checksum = node->checksum;
+
+	// the candidate may have been written, unmapped or merged since it was seen
+	uint64_t *other = ksm_pte(node->page_table, node->vaddr);
+	bool same = false;
+
+	if(other && (*other & VMM_PADDR_MASK) == node->paddr && ksm_candidate(*other)) {
+		ksm_write_protect(node->page_table, node->vaddr, other);
+
+		same = ksm_same(node->paddr, paddr);
+
+		if(!same) {
+			ksm_write_restore(other);
+		}
+	}
+
+	if(!same) {
+		*node = (struct ksm_node) { .checksum = checksum, .paddr = paddr, .page_table = page_table, .vaddr = vaddr, .next = node->next };
+		return false;
+	}
+
+	// the candidate becomes the merged frame, the pte keeps a mapping of it on top of the table reference
+	*link = node->next;
+
+	*other = ksm_entry(*other, node->paddr);
+	tlb_invalidate(node->page_table, node->vaddr);
+
+	struct frame *frame = pmm_frame(node->paddr);
+	__atomic_or_fetch(&frame->flags, FRAME_KSM, __ATOMIC_RELAXED);
+	pmm_frame_get(node->paddr);
+
+	node->page_table = NULL;
+	node->vaddr = 0;
+	node->next = ksm_stable[checksum % KSM_BUCKETS];
+	ksm_stable[checksum % KSM_BUCKETS] = node;
+
+	ksm_replace(page_table, vaddr, entry, node->paddr);
+
+	return true;
+}
+
+static bool ksm_scan_page(struct page_table *page_table, uintptr_t vaddr, uint64_t *entry) {
+	uint64_t paddr = *entry & VMM_PADDR_MASK;
+	uint64_t checksum = ksm_checksum(paddr);
+
+	if(checksum == ksm_zero_checksum && ksm_same(vmm_zero_page, paddr)) { // no need for a merged frame of its own
+		ksm_replace(page_table, vaddr, entry, vmm_zero_page);
+		ksm_stats.zero_pages++;
+		return true;
+	}
+
+	struct ksm_node *stable = ksm_stable_search(checksum, paddr);
+	if(stable) {
+		ksm_replace(page_table, vaddr, entry, stable->paddr);
+		return true;
+	}
+
+	struct ksm_node **link = ksm_unstable_search(checksum);
+	struct ksm_node *node = *link;
+
+	if(node == NULL) {
+		node = alloc(sizeof(struct ksm_node));
+		*node = (struct ksm_node) { .checksum = checksum, .paddr = paddr, .page_table = page_table, .vaddr = vaddr };
+		*link = node;
+		return false;
+	}
+
+	struct page_table *other_table = node->page_table;
+
+	if(other_table != page_table && __atomic_test_and_set(&other_table->mm_lock, __ATOMIC_ACQUIRE)) { // busy, next pass
+		return false;
+	}
+
+	bool merged = ksm_merge_unstable(page_table, vaddr, entry, link);
+
+	if(other_table != page_table) {
+		spinrelease(&other_table->mm_lock);
+	}
+
+	return merged;
+}
+
+static void ksm_scan_entry(struct page_table *page_table, uintptr_t vaddr, uint64_t *entry) {
+	if(!ksm_candidate(*entry)) {
+		return;
+	}
+
+	ksm_write_protect(page_table, vaddr, entry);
+
+	if(!ksm_scan_page(page_table, vaddr, entry)) {
+		ksm_write_restore(entry);
+	}
+}
+// one pml1 window under the cursor, the caller holds the mm lock of the table
+static void ksm_scan_window(struct page_table *page_table, size_t *budget) {
+	struct mmap_region *region = mmap_region_first_overlap(page_table, ksm_cursor_vaddr, MMAP_MAP_MAX_ADDR);
+	if(region == NULL) {
+		ksm_cursor = vmm_page_table_next(page_table);
+		ksm_cursor_vaddr = 0;
+		return;
+	}
+
+	uintptr_t vaddr = region->base > ksm_cursor_vaddr ? region->base : ksm_cursor_vaddr;
+	uintptr_t end = (vaddr & ~(VMM_HUGE_PAGE_SIZE - 1)) + VMM_HUGE_PAGE_SIZE;
+
+	if(end > region->base + region->limit) {
+		end = region->base + region->limit;
+	}
+
+	ksm_cursor_vaddr = end;
+	(*budget)--;
+
+	if(region->flags & MMAP_MAP_SHARED) { // every mapper has to see the same frame
+		return;
+	}
+
+	uint64_t *pml2_entry = vmm_pml2_entry(page_table, vaddr);
+	if(pml2_entry == NULL || (*pml2_entry & VMM_FLAGS_P) == 0 || (*pml2_entry & VMM_FLAGS_PS)) {
+		return;
+	}
+
+	uint64_t *pml1 = (uint64_t*)((*pml2_entry & VMM_PADDR_MASK) + HIGH_VMA);
+
+	for(; vaddr < end && *budget; vaddr += PAGE_SIZE, (*budget)--) {
+		ksm_scan_entry(page_table, vaddr, &pml1[(vaddr >> 12) & 0x1ff]);
+		ksm_stats.scanned++;
+	}
+
+	ksm_cursor_vaddr = vaddr;
+}
+
+// walks every address space one pml1 table at a time, a lap of the list starts a fresh unstable table
+static void ksm_scan(size_t budget) {
+	while(budget) {
+		if(ksm_cursor == NULL) {
+			ksm_cursor = vmm_page_table_next(NULL);
+			ksm_cursor_vaddr = 0;
+
+			ksm_unstable_clear();
+			ksm_stable_sweep();
+			ksm_stats.full_scans++;
+
+			if(ksm_cursor == NULL) {
+				break;
+			}
+		}
+
+		struct page_table *page_table = ksm_cursor;
+
+		if(__atomic_test_and_set(&page_table->mm_lock, __ATOMIC_ACQUIRE)) { // its owner is faulting or mapping
+			ksm_cursor = vmm_page_table_next(page_table);
+			ksm_cursor_vaddr = 0;
+			budget--;
+			continue;
+		}
+
+		ksm_scan_window(page_table, &budget);
+
+		spinrelease(&page_table->mm_lock);
+	}
+}
+
+void ksm_page_table_release(struct page_table *page_table) {
+	uint64_t rflags = interrupts_save();
+	tlb_spinlock(&ksm_lock);
+
+	if(ksm_cursor == page_table) { // its neighbours could be gone as well, start over
+		ksm_cursor = NULL;
+		ksm_cursor_vaddr = 0;
+	}
+
+	ksm_unstable_clear(); // cheaper than picking out the candidates of this table
+
+	spinrelease(&ksm_lock);
+	interrupts_restore(rflags);
+}
+
+static void ksmd() {
+	for(;;) {
+		asm volatile ("cli");
+		tlb_spinlock(&ksm_lock);
+
+		ksm_scan(KSM_SCAN_BATCH);
+
+		spinrelease(&ksm_lock);
+
+		sched_dequeue(ksmd_task, ksmd_thread);
+		ksmd_task->event_waiting = 1;
+
+		asm volatile ("sti");
+
+		while(ksmd_task->event_waiting) {
+			asm volatile ("hlt");
+		}
+	}
+}
+
+// called by the scheduler before it locks its run queue
+void ksm_tick() {
+	if(ksmd_thread == NULL || ++ksmd_ticks < KSM_TICK_INTERVAL) {
+		return;
+	}
+
+	ksmd_ticks = 0;
+
+	if(ksmd_thread->status == TASK_YIELD) {
+		sched_requeue(ksmd_task, ksmd_thread);
+	}
+}
+
+void ksm_init() {
+	ksm_zero_checksum = ksm_checksum(vmm_zero_page);
+
+	ksmd_task = sched_default_task();
+	ksmd_task->page_table = &kernel_mappings;
+
+	ksmd_thread = sched_default_thread(ksmd_task);
+
+	ksmd_thread->regs.cs = 0x28;
+	ksmd_thread->regs.ss = 0x30;
+	ksmd_thread->regs.rip = (uintptr_t)ksmd;
+	ksmd_thread->regs.rflags = 0x202;
+	ksmd_thread->regs.rsp = ksmd_thread->kernel_stack;
+
+	sched_requeue(ksmd_task, ksmd_thread);
+
+	print("ksm: ksmd scans %d ptes every %d ticks\n", KSM_SCAN_BATCH, KSM_TICK_INTERVAL);
+}
+
+void ksm_get_stats(struct ksm_stats *stats) {
+	uint64_t rflags = interrupts_save();
+	tlb_spinlock(&ksm_lock);
+
+	*stats = ksm_stats;
+
+	stats->pages_shared = 0;
+	stats->pages_sharing = 0;
+	stats->pages_saved = 0;
+
+	for(size_t i = 0; i < KSM_BUCKETS; i++) {
+		for(struct ksm_node *node = ksm_stable[i]; node; node = node->next) {
+			size_t mapcount = pmm_frame(node->paddr)->mapcount;
+
+			stats->pages_shared++;
+			stats->pages_sharing += mapcount;
+			stats->pages_saved += mapcount ? mapcount - 1 : 0;
+		}
+	}
+
+	spinrelease(&ksm_lock);
+	interrupts_restore(rflags);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <mm/vmm.h>
+
+#define KSM_BUCKETS 1024
+#define KSM_TICK_INTERVAL 20 // bsp scheduler passes between ksmd batches, none while it idles
+#define KSM_SCAN_BATCH 256 // ptes looked at per batch
+
+// stable nodes own a merged frame, unstable ones remember a candidate seen during the current pass
+struct ksm_node {
+	uint64_t checksum;
+	uint64_t paddr;
+
+	struct page_table *page_table;
+	uintptr_t vaddr;
+
+	struct ksm_node *next;
+};
+
+struct ksm_stats {
+	size_t pages_shared; // merged frames
+	size_t pages_sharing; // ptes pointing at them
+	size_t pages_saved;
+	size_t scanned;
+	size_t merges;
+	size_t zero_pages; // merged into the shared zero page
+	size_t full_scans;
+};
+
+void ksm_init();
+void ksm_tick();
+void ksm_page_table_release(struct page_table *page_table);
+void ksm_get_stats(struct ksm_stats *stats);
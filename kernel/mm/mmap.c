@@ -4,114 +4,58 @@
 #include <sched/sched.h>
 #include <debug.h>
 #include <errno.h>
-#include <bst.h>
 #include <string.h>
 #include <fs/vfs.h>
 #include <mm/pmm.h>
-
-static ssize_t validate_region(struct page_table *page_table, uint64_t base, uint64_t length) {
-	struct mmap_region *root = page_table->mmap_region_root;
-
-	if(root == NULL) {
-		return -1;
-	}
-
-	while(root) {
-		if(root->base <= base && (root->base + root->limit) > base) {
-			return root->base + root->limit - base + length;
-		}
-
-		if(root->base > base) {
-			root = root->left;
-		} else {
-			root = root->right;
-		}
-	}
-
-	return -1;
+#include <mm/tlb.h>
+#include <mm/thp.h>
+#include <mm/pagecache.h>
+#include <mm/mmap_region.h>
+#include <mm/swap.h>
+
+// what a pending file pte of a mapping looks like
+uint64_t mmap_file_entry_flags(int prot, int flags) {
+	uint64_t entry_flags = VMM_FILE_FLAG | VMM_FLAGS_NX;
+
+	if(flags & MMAP_MAP_SHARED) entry_flags |= VMM_SHARE_FLAG;
+	if(prot & MMAP_PROT_WRITE) entry_flags |= VMM_FLAGS_RW;
+	if(prot & MMAP_PROT_USER) entry_flags |= VMM_FLAGS_US;
+	if(prot & MMAP_PROT_EXEC) entry_flags &= ~(VMM_FLAGS_NX);
+
+	return entry_flags;
 }
 
-static struct mmap_region *mmap_search_region(struct page_table *page_table, uint64_t base) {
-	struct mmap_region *root = page_table->mmap_region_root;
-
-	while(root) {
-		if(root->base <= base && (root->base + root->limit) >= base) {
-			break;
-		}
-
-		if(root->base > base) {
-			root = root->left;
-		} else {
-			root = root->right;
-		}
-	}
-
-	return root;
-}
-
-static int mmap_shared_pages(struct page_table *page_table, uintptr_t vaddr, int fd, off_t offset, int length, int prot) {
+// file ptes start out pending, the fault path points them at page cache frames
+static int mmap_file_pages(struct page_table *page_table, uintptr_t vaddr, int fd, off_t offset, int length, int prot, int flags) {
 	struct fd_handle *handle = fd_translate(fd);
 	if(handle == NULL) {
 		set_errno(EBADF);
 		return -1;
 	}
 
+	struct asset *asset = handle->file_handle->vfs_node->asset;
+	bool shared = (flags & MMAP_MAP_SHARED) != 0;
+
+	if(shared && asset->shared == NULL && asset->pagecache == NULL) { // nothing to share the pages through
+		set_errno(ENODEV);
+		return -1;
+	}
+
 	file_get(handle->file_handle);
-	struct vfs_node *vfs_node = handle->file_handle->vfs_node;
 	offset = offset & ~(0xfff);
 
-	uint64_t flags = VMM_FILE_FLAG | VMM_SHARE_FLAG | VMM_FLAGS_NX;
-
-	if(prot & MMAP_PROT_WRITE) flags |= VMM_FLAGS_RW;
-	if(prot & MMAP_PROT_USER) flags |= VMM_FLAGS_US;
-	if(prot & MMAP_PROT_EXEC) flags &= ~(VMM_FLAGS_NX);
+	uint64_t entry_flags = mmap_file_entry_flags(prot, flags);
 
 	for(size_t i = 0; i < DIV_ROUNDUP(length, PAGE_SIZE); i++) {
-		struct page *page = hash_table_search(&vfs_node->shared_pages, &offset, sizeof(offset));
-		struct page *new_page = alloc(sizeof(struct page));
-
-		if(page) {
-			flags |= VMM_FLAGS_P;
-
-			*new_page = (struct page) {
-				.vaddr = vaddr,
-				.paddr = page->paddr,
-				.size = PAGE_SIZE,
-				.flags = flags,
-				.offset = offset,
-				.pml_entry = page_table->map_page(page_table, vaddr, page->paddr, flags),
-				.reference = page->reference
-			};
+		if(shared && asset->shared) { // device memory is there already
+			uint64_t frame = (uint64_t)asset->shared(asset, NULL, offset);
 
-			(*new_page->reference)++;
+			page_table->map_page(page_table, vaddr, frame, entry_flags | VMM_FLAGS_P);
+			pmm_frame_map(frame, FRAME_FILE | FRAME_SHARED);
 		} else {
-			uint64_t frame;
-			uint64_t extra_flags = 0;
-
-			if(vfs_node->asset->shared == NULL) {
-				frame = pmm_alloc(1, 1);
-			} else {
-				frame = (uint64_t)vfs_node->asset->shared(vfs_node->asset, NULL, offset);
-				extra_flags |= VMM_FLAGS_P;
-			}
-
-			*new_page = (struct page) {
-				.vaddr = vaddr,
-				.paddr = frame,
-				.size = PAGE_SIZE,
-				.flags = flags | extra_flags,
-				.node = handle->file_handle->vfs_node,
-				.offset = offset,
-				.pml_entry = page_table->map_page(page_table, vaddr, frame, flags | extra_flags),
-				.reference = alloc(sizeof(int))
-			};
-
-			(*new_page->reference) = 1;
+			page_table->map_page(page_table, vaddr, 0, entry_flags);
 		}
 
-		hash_table_push(page_table->pages, &new_page->vaddr, new_page, sizeof(new_page->vaddr));
-		hash_table_push(&vfs_node->shared_pages, &new_page->offset, new_page, sizeof(new_page->vaddr));
-
 		offset += PAGE_SIZE;
 		vaddr += PAGE_SIZE;
 	}
@@ -119,50 +63,28 @@ static int mmap_shared_pages(struct page_table *page_table, uintptr_t vaddr, int
 	return 0;
 }
 
-static int mmap_private_pages(struct page_table *page_table, uintptr_t vaddr, int fd, off_t offset, int length, int prot) {
-	struct fd_handle *handle = fd_translate(fd);
-	if(handle == NULL) {
-		set_errno(EBADF);
-		return -1;
-	}
-
-	file_get(handle->file_handle);
-	offset = offset & ~(0xfff);
-
-	uint64_t flags = VMM_FILE_FLAG | VMM_FLAGS_NX;
-
-	if(prot & MMAP_PROT_WRITE) flags |= VMM_FLAGS_RW;
-	if(prot & MMAP_PROT_USER) flags |= VMM_FLAGS_US;
-	if(prot & MMAP_PROT_EXEC) flags &= ~(VMM_FLAGS_NX);
-
-	for(size_t i = 0; i < DIV_ROUNDUP(length, PAGE_SIZE); i++) {
-		struct page *page = alloc(sizeof(struct page));
-
-		uint64_t frame = pmm_alloc(1, 1);
+// a free hint is taken as is, otherwise holes left by munmap are handed out again before fresh space
+static uintptr_t mmap_find_range(struct page_table *page_table, uintptr_t hint, size_t length, size_t align) {
+	hint &= ~(PAGE_SIZE - 1);
 
-		*page = (struct page) {
-			.vaddr = vaddr,
-			.paddr = frame,
-			.size = PAGE_SIZE,
-			.flags = flags,
-			.node = handle->file_handle->vfs_node,
-			.offset = offset,
-			.pml_entry = page_table->map_page(page_table, vaddr, frame, flags),
-			.reference = alloc(sizeof(int))
-		};
-
-		(*page->reference) = 1;
-
-		hash_table_push(page_table->pages, &page->vaddr, page, sizeof(page->vaddr));
+	if(hint >= MMAP_MAP_MIN_ADDR && hint + length > hint && hint + length <= MMAP_MAP_MAX_ADDR
+		&& mmap_region_first_overlap(page_table, hint, hint + length) == NULL) {
+		return hint;
+	}
 
-		offset += PAGE_SIZE;
-		vaddr += PAGE_SIZE;
+	if(page_table->mmap_top_down) {
+		uintptr_t base = mmap_region_find_gap_top_down(page_table, MMAP_MAP_MIN_ADDR, page_table->mmap_base, length, align);
+		if(base != (uintptr_t)-1) {
+			return base;
+		}
 	}
 
-	return 0;
+	return mmap_region_find_gap(page_table, MMAP_MAP_MIN_ADDR, MMAP_MAP_MAX_ADDR, length, align);
 }
 
-void *mmap(struct page_table *page_table, void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+static int munmap_locked(struct page_table *page_table, void *addr, size_t length);
+
+static void *mmap_locked(struct page_table *page_table, void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
 	uint64_t base = 0;
 
 	length = ALIGN_UP(length, PAGE_SIZE);
@@ -170,20 +92,14 @@ void *mmap(struct page_table *page_table, void *addr, size_t length, int prot, i
 	if(flags & MMAP_MAP_FIXED) {
 		base = (uintptr_t)addr;
 	} else {
-		base = page_table->mmap_bump_base;
+		// line big anonymous mappings up with huge pages
+		bool huge = (flags & MMAP_MAP_ANONYMOUS) && !(flags & MMAP_MAP_SHARED) && length >= VMM_HUGE_PAGE_SIZE;
 
-		for(;;) {
-			ssize_t conflict_offset = validate_region(page_table, base, length);
-
-			if(conflict_offset == -1) {
-				break;
-			}
-
-			base += conflict_offset;
+		base = mmap_find_range(page_table, (uintptr_t)addr, length, huge ? VMM_HUGE_PAGE_SIZE : PAGE_SIZE);
+		if(base == (uintptr_t)-1) {
+			set_errno(ENOMEM);
+			return (void*)-1;
 		}
-
-		page_table->mmap_bump_base = base;
-		page_table->mmap_bump_base += length;
 	}
 
 	if(length == 0 || base == 0) {
@@ -196,19 +112,27 @@ void *mmap(struct page_table *page_table, void *addr, size_t length, int prot, i
 		return (void*)-1;
 	}
 
+	if(flags & MMAP_MAP_FIXED) { // a fixed mapping replaces whatever was there
+		if(munmap_locked(page_table, (void*)base, length) == -1) {
+			return (void*)-1;
+		}
+	}
+
 	if(!(flags & MMAP_MAP_ANONYMOUS)) {
-		if(flags & MMAP_MAP_SHARED) {
-			if(mmap_shared_pages(page_table, base, fd, offset, length, prot) == -1) {
-				return (void*)-1;
-			}
-		} else if(flags & MMAP_MAP_PRIVATE) {
-			if(mmap_private_pages(page_table, base, fd, offset, length, prot) == -1) {
-				return (void*)-1;
-			}
-		} else {
+		if((flags & (MMAP_MAP_SHARED | MMAP_MAP_PRIVATE)) == 0) {
 			set_errno(EINVAL);
 			return (void*)-1;
 		}
+
+		if(mmap_file_pages(page_table, base, fd, offset, length, prot, flags) == -1) {
+			return (void*)-1;
+		}
+	}
+
+	struct vfs_node *node = NULL;
+
+	if(!(flags & MMAP_MAP_ANONYMOUS)) {
+		node = fd_translate(fd)->file_handle->vfs_node;
 	}
 
 	struct mmap_region *region = alloc(sizeof(struct mmap_region));
@@ -219,10 +143,12 @@ void *mmap(struct page_table *page_table, void *addr, size_t length, int prot, i
 		.prot = prot,
 		.flags = flags,
 		.fd = fd,
-		.offset = offset
+		.offset = offset,
+		.node = node
 	};
 
-	BST_GENERIC_INSERT(page_table->mmap_region_root, base, region);
+	mmap_region_insert(page_table, region);
+	mmap_region_merge(page_table, region);
 
 /*	uint64_t _flags = VMM_FLAGS_P | VMM_FLAGS_NX;
 
@@ -241,105 +167,199 @@ void *mmap(struct page_table *page_table, void *addr, size_t length, int prot, i
 			.paddr = paddr,
 			.size = PAGE_SIZE,
 			.flags = _flags,
-			.pml_entry = page_table->map_page(page_table, vaddr, paddr, _flags),
-			.reference = alloc(sizeof(int))
+			.pml_entry = page_table->map_page(page_table, vaddr, paddr, _flags)
 		};
 
-		(*new_page->reference) = 1;
-
-		hash_table_push(page_table->pages, &new_page->vaddr, new_page, sizeof(new_page->vaddr));
+		pmm_frame_map(paddr, FRAME_ANON);
 	}*/
 
 	return (void*)base;
 }
 
 
-// TODO: decrease reference count on the mmaped file
-int munmap(struct page_table *page_table, void *addr, size_t length) {
-	uint64_t base = (uint64_t)addr;
+static void mmap_unmap_pages(struct page_table *page_table, struct mmap_region *region, uintptr_t base, size_t length) {
+	struct tlb_batch batch;
+	tlb_batch_init(&batch, page_table);
 
-	if(length == 0 || base == 0) {
-		set_errno(EINVAL);
-		return -1;
-	}
+	// missing tables are stepped over whole, so a large untouched reservation costs a walk per 1 GiB and not per page
+	for(uintptr_t vaddr = base; vaddr < base + length; vaddr += PAGE_SIZE) {
+		uint64_t *pml2_entry = vmm_pml2_entry(page_table, vaddr);
 
-	if((base % PAGE_SIZE != 0) || (length % PAGE_SIZE != 0)) {
-		set_errno(EINVAL);
-		return -1;
-	}
+		if(pml2_entry == NULL) {
+			vaddr = (vaddr & ~(VMM_PML2_SPAN - 1)) + VMM_PML2_SPAN - PAGE_SIZE;
+			continue;
+		}
 
-	struct mmap_region *region = mmap_search_region(page_table, base);
+		if(*pml2_entry & VMM_FLAGS_PS) {
+			if(thp_unmap(page_table, pml2_entry, vaddr, base, length, &batch)) { // unmapped whole, or left alone when it could not be split
+				vaddr = (vaddr & ~(VMM_HUGE_PAGE_SIZE - 1)) + VMM_HUGE_PAGE_SIZE - PAGE_SIZE;
+				continue;
+			}
+		}
 
-	if(region == NULL) {
-		return 0;
-	}
+		if((*pml2_entry & VMM_FLAGS_P) == 0) {
+			vaddr = (vaddr & ~(VMM_HUGE_PAGE_SIZE - 1)) + VMM_HUGE_PAGE_SIZE - PAGE_SIZE;
+			continue;
+		}
 
-	if(length > region->limit) {
-		munmap(page_table, (void*)(base + region->limit), length - region->limit);
-		length = region->limit;
+		uint64_t *entry = (uint64_t*)((*pml2_entry & VMM_PADDR_MASK) + HIGH_VMA) + ((vaddr >> 12) & 0x1ff);
+
+		if(*entry & VMM_SWAP_FLAG) {
+			swap_free(SWAP_SLOT(*entry));
+			*entry = 0;
+			continue;
+		}
+
+		if((*entry & VMM_PADDR_MASK) == 0) { // pending file pte, never pointed at a frame
+			*entry = 0;
+			continue;
+		}
+
+		// other threads may still store through it, the dirty bit is taken from the value the exchange returns
+		uint64_t pte = __atomic_exchange_n(entry, 0, __ATOMIC_SEQ_CST);
+		uint64_t paddr = pte & VMM_PADDR_MASK;
+		struct vfs_node *node = region->node;
+
+		// stores through a shared mapping land in the cache frame, the cache has to keep them
+		if((pte & VMM_SHARE_FLAG) && (pte & VMM_FLAGS_D) && node && node->asset->pagecache) {
+			pagecache_set_dirty(node->asset->pagecache, (region->offset & ~(0xfff)) + (vaddr - region->base));
+		}
+
+		tlb_batch_add(&batch, vaddr);
+		tlb_batch_add_frames(&batch, paddr, 1);
 	}
 
+	tlb_batch_flush(&batch);
+}
+
+// base and length lie within region
+static void mmap_unmap_region(struct page_table *page_table, struct mmap_region *region, uintptr_t base, size_t length) {
+	uintptr_t region_end = region->base + region->limit;
+
 	struct mmap_region *lower_split = NULL;
 	struct mmap_region *upper_split = NULL;
 
-	if(region->base > base) {
+	if(region->base < base) {
 		lower_split = alloc(sizeof(struct mmap_region));
 
 		*lower_split = (struct mmap_region) {
 			.base = region->base,
-			.limit = region->base - base,
+			.limit = base - region->base,
 			.prot = region->prot,
 			.flags = region->flags,
 			.fd = region->fd,
-			.offset = region->offset
+			.offset = region->offset,
+			.node = region->node
 		};
 	}
 
-	if(region->limit > length) {
+	if(region_end > base + length) {
 		upper_split = alloc(sizeof(struct mmap_region));
 
 		*upper_split = (struct mmap_region) {
-			.base = region->base + length,
-			.limit = length - region->limit,
+			.base = base + length,
+			.limit = region_end - (base + length),
 			.prot = region->prot,
 			.flags = region->flags,
 			.fd = region->fd,
-			.offset = region->offset
+			.offset = region->offset + (base + length - region->base),
+			.node = region->node
 		};
 	}
 
-	BST_GENERIC_DELETE(page_table->mmap_region_root, base, region);
-	BST_GENERIC_INSERT(page_table->mmap_region_root, base, lower_split);
-	BST_GENERIC_INSERT(page_table->mmap_region_root, base, upper_split);
+	mmap_unmap_pages(page_table, region, base, length);
 
-	for(size_t i = 0; i < region->limit / PAGE_SIZE; i++) {
-		struct page *page = hash_table_search(CURRENT_TASK->page_table->pages, &base, sizeof(base));
+	mmap_region_remove(page_table, region);
 
-		if(page) {
-			struct vfs_node *node = page->node;
+	if(lower_split) mmap_region_insert(page_table, lower_split);
+	if(upper_split) mmap_region_insert(page_table, upper_split);
 
-			if(page->flags & VMM_SHARE_FLAG) {
-				(*page->reference)--;
+	free(region);
+}
 
-				if(*page->reference == 0 && node) {
-					if(node->asset->shared == NULL) {
-						node->asset->write(node->asset, NULL, page->offset, PAGE_SIZE, (void*)(page->paddr + HIGH_VMA));
-					}
+// TODO: decrease reference count on the mmaped file
+static int munmap_locked(struct page_table *page_table, void *addr, size_t length) {
+	uint64_t base = (uint64_t)addr;
 
-					hash_table_delete(&node->shared_pages, &page->vaddr, sizeof(page->vaddr));
-				}
-			}
+	if(length == 0 || base == 0) {
+		set_errno(EINVAL);
+		return -1;
+	}
 
-			hash_table_delete(CURRENT_TASK->page_table->pages, &base, sizeof(base));
-		}
+	if((base % PAGE_SIZE != 0) || (length % PAGE_SIZE != 0)) {
+		set_errno(EINVAL);
+		return -1;
+	}
 
-		page_table->unmap_page(page_table, base);
-		base += PAGE_SIZE;
+	if(base + length < base || base + length > MMAP_MAP_MAX_ADDR) {
+		set_errno(EINVAL);
+		return -1;
 	}
 
+	uintptr_t end = base + length;
+	struct mmap_region *region;
+
+	// huge pages straddling either end are broken up before anything changes, running out of memory leaves it all mapped
+	if(((base & (VMM_HUGE_PAGE_SIZE - 1)) && thp_split(page_table, base) == -1) ||
+		((end & (VMM_HUGE_PAGE_SIZE - 1)) && thp_split(page_table, end - 1) == -1)) {
+		set_errno(ENOMEM);
+		return -1;
+	}
+
+	while((region = mmap_region_first_overlap(page_table, base, end))) {
+		uintptr_t from = region->base > base ? region->base : base;
+		uintptr_t to = region->base + region->limit < end ? region->base + region->limit : end;
+
+		mmap_unmap_region(page_table, region, from, to - from);
+	}
+
+	vmm_prune_tables(page_table, base, end);
+
 	return 0;
 }
 
+void *mmap(struct page_table *page_table, void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+	uint64_t rflags = interrupts_save();
+	tlb_spinlock(&page_table->mm_lock);
+
+	void *ret = mmap_locked(page_table, addr, length, prot, flags, fd, offset);
+
+	spinrelease(&page_table->mm_lock);
+	interrupts_restore(rflags);
+
+	return ret;
+}
+
+int munmap(struct page_table *page_table, void *addr, size_t length) {
+	uint64_t rflags = interrupts_save();
+	tlb_spinlock(&page_table->mm_lock);
+
+	int ret = munmap_locked(page_table, addr, length);
+
+	spinrelease(&page_table->mm_lock);
+	interrupts_restore(rflags);
+
+	return ret;
+}
+
+static void mmap_release_tree(struct page_table *page_table, struct mmap_region *region) {
+	if(region == NULL) {
+		return;
+	}
+
+	mmap_release_tree(page_table, region->left);
+	mmap_release_tree(page_table, region->right);
+
+	mmap_unmap_pages(page_table, region, region->base, region->limit);
+
+	free(region);
+}
+
+void mmap_release(struct page_table *page_table) {
+	mmap_release_tree(page_table, page_table->mmap_region_root);
+	page_table->mmap_region_root = NULL;
+}
+
 extern void syscall_mmap(struct registers *regs) {
 	struct sched_task *current_task = CURRENT_TASK;
 	if(current_task == NULL) {
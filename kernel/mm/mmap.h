@@ -8,6 +8,7 @@
 #define MMAP_MAP_FIXED 0x4
 #define MMAP_MAP_ANONYMOUS 0x8
 #define MMAP_MAP_MIN_ADDR 0x10000
+#define MMAP_MAP_MAX_ADDR 0x800000000000 // end of the lower half with 4 level paging
 
 #define MMAP_PROT_NONE 0x0
 #define MMAP_PROT_READ 0x1
@@ -17,3 +18,5 @@
 
 void *mmap(struct page_table *page_table, void *addr, size_t length, int prot, int flags, int fd, off_t offset);
 int munmap(struct page_table *page_table, void *addr, size_t length);
+void mmap_release(struct page_table *page_table);
+uint64_t mmap_file_entry_flags(int prot, int flags);
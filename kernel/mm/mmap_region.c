@@ -0,0 +1,488 @@
+#include <mm/mmap_region.h>
+#include <mm/mmap.h>
+#include <mm/slab.h>
+#include <string.h>
+#include <debug.h>
+
+// regions sit in a red-black tree ordered by base, every node also tracks the largest hole in its subtree
+
+static inline uintptr_t mmap_region_end(struct mmap_region *region) {
+	return region->base + region->limit;
+}
+
+static inline bool mmap_region_red(struct mmap_region *region) {
+	return region && region->red;
+}
+
+static void mmap_region_augment(struct mmap_region *region) {
+	size_t max_gap = region->gap;
+
+	if(region->left && region->left->max_gap > max_gap) max_gap = region->left->max_gap;
+	if(region->right && region->right->max_gap > max_gap) max_gap = region->right->max_gap;
+
+	region->max_gap = max_gap;
+}
+
+static void mmap_region_propagate(struct mmap_region *region) {
+	for(; region; region = region->parent) {
+		mmap_region_augment(region);
+	}
+}
+
+static void mmap_region_replace_child(struct page_table *page_table, struct mmap_region *parent,
+	struct mmap_region *old, struct mmap_region *new) {
+	if(parent == NULL) {
+		page_table->mmap_region_root = new;
+	} else if(parent->left == old) {
+		parent->left = new;
+	} else {
+		parent->right = new;
+	}
+
+	if(new) {
+		new->parent = parent;
+	}
+}
+
+static void mmap_region_rotate_left(struct page_table *page_table, struct mmap_region *region) {
+	struct mmap_region *pivot = region->right;
+
+	region->right = pivot->left;
+	if(pivot->left) pivot->left->parent = region;
+
+	mmap_region_replace_child(page_table, region->parent, region, pivot);
+
+	pivot->left = region;
+	region->parent = pivot;
+
+	mmap_region_augment(region);
+	mmap_region_augment(pivot);
+}
+
+static void mmap_region_rotate_right(struct page_table *page_table, struct mmap_region *region) {
+	struct mmap_region *pivot = region->left;
+
+	region->left = pivot->right;
+	if(pivot->right) pivot->right->parent = region;
+
+	mmap_region_replace_child(page_table, region->parent, region, pivot);
+
+	pivot->right = region;
+	region->parent = pivot;
+
+	mmap_region_augment(region);
+	mmap_region_augment(pivot);
+}
+
+// the hole in front of a region changes whenever its predecessor does
+static void mmap_region_set_gap(struct mmap_region *region, uintptr_t prev_end) {
+	region->gap = region->base - prev_end;
+	mmap_region_propagate(region);
+}
+
+struct mmap_region *mmap_region_next(struct mmap_region *region) {
+	if(region->right) {
+		region = region->right;
+		while(region->left) region = region->left;
+		return region;
+	}
+
+	while(region->parent && region == region->parent->right) {
+		region = region->parent;
+	}
+
+	return region->parent;
+}
+
+struct mmap_region *mmap_region_prev(struct mmap_region *region) {
+	if(region->left) {
+		region = region->left;
+		while(region->right) region = region->right;
+		return region;
+	}
+
+	while(region->parent && region == region->parent->left) {
+		region = region->parent;
+	}
+
+	return region->parent;
+}
+
+struct mmap_region *mmap_region_find(struct page_table *page_table, uintptr_t address) {
+	struct mmap_region *root = page_table->mmap_region_root;
+
+	while(root) {
+		if(address < root->base) {
+			root = root->left;
+		} else if(address >= mmap_region_end(root)) {
+			root = root->right;
+		} else {
+			return root;
+		}
+	}
+
+	return NULL;
+}
+
+// lowest region that intersects [base, end)
+struct mmap_region *mmap_region_first_overlap(struct page_table *page_table, uintptr_t base, uintptr_t end) {
+	struct mmap_region *root = page_table->mmap_region_root;
+	struct mmap_region *ret = NULL;
+
+	while(root) {
+		if(mmap_region_end(root) > base) {
+			ret = root;
+			root = root->left;
+		} else {
+			root = root->right;
+		}
+	}
+
+	return (ret && ret->base < end) ? ret : NULL;
+}
+
+static void mmap_region_insert_fixup(struct page_table *page_table, struct mmap_region *region) {
+	while(mmap_region_red(region->parent)) {
+		struct mmap_region *parent = region->parent;
+		struct mmap_region *grandparent = parent->parent;
+
+		if(parent == grandparent->left) {
+			struct mmap_region *uncle = grandparent->right;
+
+			if(mmap_region_red(uncle)) {
+				parent->red = false;
+				uncle->red = false;
+				grandparent->red = true;
+				region = grandparent;
+				continue;
+			}
+
+			if(region == parent->right) {
+				region = parent;
+				mmap_region_rotate_left(page_table, region);
+				parent = region->parent;
+			}
+
+			parent->red = false;
+			grandparent->red = true;
+			mmap_region_rotate_right(page_table, grandparent);
+		} else {
+			struct mmap_region *uncle = grandparent->left;
+
+			if(mmap_region_red(uncle)) {
+				parent->red = false;
+				uncle->red = false;
+				grandparent->red = true;
+				region = grandparent;
+				continue;
+			}
+
+			if(region == parent->left) {
+				region = parent;
+				mmap_region_rotate_right(page_table, region);
+				parent = region->parent;
+			}
+
+			parent->red = false;
+			grandparent->red = true;
+			mmap_region_rotate_left(page_table, grandparent);
+		}
+	}
+
+	page_table->mmap_region_root->red = false;
+}
+
+void mmap_region_insert(struct page_table *page_table, struct mmap_region *region) {
+	struct mmap_region **link = &page_table->mmap_region_root;
+	struct mmap_region *parent = NULL;
+
+	while(*link) {
+		parent = *link;
+		link = region->base < parent->base ? &parent->left : &parent->right;
+	}
+
+	region->parent = parent;
+	region->left = NULL;
+	region->right = NULL;
+	region->red = true;
+
+	*link = region;
+
+	struct mmap_region *prev = mmap_region_prev(region);
+	struct mmap_region *next = mmap_region_next(region);
+
+	mmap_region_set_gap(region, prev ? mmap_region_end(prev) : 0);
+
+	if(next) {
+		mmap_region_set_gap(next, mmap_region_end(region));
+	}
+
+	mmap_region_insert_fixup(page_table, region);
+}
+
+static void mmap_region_remove_fixup(struct page_table *page_table, struct mmap_region *region, struct mmap_region *parent) {
+	while(region != page_table->mmap_region_root && !mmap_region_red(region)) {
+		if(region == parent->left) {
+			struct mmap_region *sibling = parent->right;
+
+			if(mmap_region_red(sibling)) {
+				sibling->red = false;
+				parent->red = true;
+				mmap_region_rotate_left(page_table, parent);
+				sibling = parent->right;
+			}
+
+			if(!mmap_region_red(sibling->left) && !mmap_region_red(sibling->right)) {
+				sibling->red = true;
+				region = parent;
+				parent = region->parent;
+				continue;
+			}
+
+			if(!mmap_region_red(sibling->right)) {
+				sibling->left->red = false;
+				sibling->red = true;
+				mmap_region_rotate_right(page_table, sibling);
+				sibling = parent->right;
+			}
+
+			sibling->red = parent->red;
+			parent->red = false;
+			sibling->right->red = false;
+			mmap_region_rotate_left(page_table, parent);
+		} else {
+			struct mmap_region *sibling = parent->left;
+
+			if(mmap_region_red(sibling)) {
+				sibling->red = false;
+				parent->red = true;
+				mmap_region_rotate_right(page_table, parent);
+				sibling = parent->left;
+			}
+
+			if(!mmap_region_red(sibling->left) && !mmap_region_red(sibling->right)) {
+				sibling->red = true;
+				region = parent;
+				parent = region->parent;
+				continue;
+			}
+
+			if(!mmap_region_red(sibling->left)) {
+				sibling->right->red = false;
+				sibling->red = true;
+				mmap_region_rotate_left(page_table, sibling);
+				sibling = parent->left;
+			}
+
+			sibling->red = parent->red;
+			parent->red = false;
+			sibling->left->red = false;
+			mmap_region_rotate_right(page_table, parent);
+		}
+
+		region = page_table->mmap_region_root;
+	}
+
+	if(region) {
+		region->red = false;
+	}
+}
+
+void mmap_region_remove(struct page_table *page_table, struct mmap_region *region) {
+	struct mmap_region *next = mmap_region_next(region);
+	uintptr_t prev_end = region->base - region->gap;
+
+	struct mmap_region *child;
+	struct mmap_region *parent;
+	bool removed_red = region->red;
+
+	if(region->left == NULL || region->right == NULL) {
+		child = region->left ? region->left : region->right;
+		parent = region->parent;
+
+		mmap_region_replace_child(page_table, region->parent, region, child);
+	} else { // the successor takes over the slot of the region
+		struct mmap_region *successor = next;
+
+		removed_red = successor->red;
+		child = successor->right;
+
+		if(successor->parent == region) {
+			parent = successor;
+		} else {
+			parent = successor->parent;
+
+			mmap_region_replace_child(page_table, successor->parent, successor, successor->right);
+
+			successor->right = region->right;
+			successor->right->parent = successor;
+		}
+
+		mmap_region_replace_child(page_table, region->parent, region, successor);
+
+		successor->left = region->left;
+		successor->left->parent = successor;
+		successor->red = region->red;
+	}
+
+	// the subtree sums have to be right again before the fixup rotates anything
+	mmap_region_propagate(parent);
+
+	if(next) {
+		mmap_region_set_gap(next, prev_end);
+	}
+
+	if(removed_red == false) {
+		mmap_region_remove_fixup(page_table, child, parent);
+	}
+
+	region->left = NULL;
+	region->right = NULL;
+	region->parent = NULL;
+}
+
+static void mmap_region_set_limit(struct mmap_region *region, size_t limit) {
+	region->limit = limit;
+
+	struct mmap_region *next = mmap_region_next(region);
+	if(next) {
+		mmap_region_set_gap(next, mmap_region_end(region));
+	}
+}
+
+// upper directly follows lower and a single region could describe both
+static bool mmap_region_mergeable(struct mmap_region *lower, struct mmap_region *upper) {
+	if(mmap_region_end(lower) != upper->base || lower->prot != upper->prot
+		|| (lower->flags & ~MMAP_MAP_FIXED) != (upper->flags & ~MMAP_MAP_FIXED)
+		|| lower->node != upper->node || lower->fd != upper->fd) {
+		return false;
+	}
+
+	return lower->node == NULL || lower->offset + (off_t)lower->limit == upper->offset;
+}
+
+// folds a region into compatible neighbours it touches, returns whichever region is left
+struct mmap_region *mmap_region_merge(struct page_table *page_table, struct mmap_region *region) {
+	struct mmap_region *prev = mmap_region_prev(region);
+
+	if(prev && mmap_region_mergeable(prev, region)) {
+		mmap_region_remove(page_table, region);
+		mmap_region_set_limit(prev, prev->limit + region->limit);
+
+		free(region);
+		region = prev;
+	}
+
+	struct mmap_region *next = mmap_region_next(region);
+
+	if(next && mmap_region_mergeable(region, next)) {
+		mmap_region_remove(page_table, next);
+		mmap_region_set_limit(region, region->limit + next->limit);
+
+		free(next);
+	}
+
+	return region;
+}
+
+static bool mmap_region_gap_search(struct mmap_region *region, uintptr_t low, size_t length, size_t align, uintptr_t *ret) {
+	if(region == NULL || region->max_gap < length) {
+		return false;
+	}
+
+	// holes in the left subtree all end before this region starts
+	if(region->base > low && mmap_region_gap_search(region->left, low, length, align, ret)) {
+		return true;
+	}
+
+	if(region->gap >= length) {
+		uintptr_t base = region->base - region->gap;
+		base = ALIGN_UP(base > low ? base : low, align);
+
+		if(base < region->base && base + length <= region->base) {
+			*ret = base;
+			return true;
+		}
+	}
+
+	return mmap_region_gap_search(region->right, low, length, align, ret);
+}
+
+// lowest aligned base at or above low with length bytes free below high, -1 if there is none
+uintptr_t mmap_region_find_gap(struct page_table *page_table, uintptr_t low, uintptr_t high, size_t length, size_t align) {
+	struct mmap_region *root = page_table->mmap_region_root;
+	uintptr_t base;
+
+	if(mmap_region_gap_search(root, low, length, align, &base)) {
+		return base + length <= high ? base : (uintptr_t)-1;
+	}
+
+	while(root && root->right) { // past the last region
+		root = root->right;
+	}
+
+	base = root && mmap_region_end(root) > low ? mmap_region_end(root) : low;
+	base = ALIGN_UP(base, align);
+
+	return base + length <= high ? base : (uintptr_t)-1;
+}
+
+static bool mmap_region_gap_search_top_down(struct mmap_region *region, uintptr_t low, uintptr_t high,
+	size_t length, size_t align, uintptr_t *ret) {
+	if(region == NULL || region->max_gap < length) {
+		return false;
+	}
+
+	// holes in the right subtree all start after this region ends
+	if(mmap_region_end(region) < high && mmap_region_gap_search_top_down(region->right, low, high, length, align, ret)) {
+		return true;
+	}
+
+	if(region->gap >= length) {
+		uintptr_t bottom = region->base - region->gap;
+		uintptr_t top = region->base < high ? region->base : high;
+
+		if(bottom < low) bottom = low;
+
+		if(top >= bottom + length && ((top - length) & ~(align - 1)) >= bottom) {
+			*ret = (top - length) & ~(align - 1);
+			return true;
+		}
+	}
+
+	return region->base - region->gap > low && mmap_region_gap_search_top_down(region->left, low, high, length, align, ret);
+}
+
+// highest aligned base at or above low with length bytes free below high, -1 if there is none
+uintptr_t mmap_region_find_gap_top_down(struct page_table *page_table, uintptr_t low, uintptr_t high, size_t length, size_t align) {
+	struct mmap_region *last = page_table->mmap_region_root;
+	uintptr_t base;
+
+	while(last && last->right) {
+		last = last->right;
+	}
+
+	// the space past the last region sits above every hole the tree knows about
+	uintptr_t bottom = last && mmap_region_end(last) > low ? mmap_region_end(last) : low;
+
+	if(high >= bottom + length && ((high - length) & ~(align - 1)) >= bottom) {
+		return (high - length) & ~(align - 1);
+	}
+
+	if(mmap_region_gap_search_top_down(page_table->mmap_region_root, low, high, length, align, &base)) {
+		return base;
+	}
+
+	return -1;
+}
+
+size_t mmap_region_depth(struct mmap_region *region) {
+	if(region == NULL) {
+		return 0;
+	}
+
+	size_t left = mmap_region_depth(region->left);
+	size_t right = mmap_region_depth(region->right);
+
+	return (left > right ? left : right) + 1;
+}
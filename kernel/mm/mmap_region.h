@@ -0,0 +1,14 @@
+#pragma once
+
+#include <mm/vmm.h>
+
+struct mmap_region *mmap_region_find(struct page_table *page_table, uintptr_t address);
+struct mmap_region *mmap_region_first_overlap(struct page_table *page_table, uintptr_t base, uintptr_t end);
+struct mmap_region *mmap_region_next(struct mmap_region *region);
+struct mmap_region *mmap_region_prev(struct mmap_region *region);
+void mmap_region_insert(struct page_table *page_table, struct mmap_region *region);
+void mmap_region_remove(struct page_table *page_table, struct mmap_region *region);
+struct mmap_region *mmap_region_merge(struct page_table *page_table, struct mmap_region *region);
+uintptr_t mmap_region_find_gap(struct page_table *page_table, uintptr_t low, uintptr_t high, size_t length, size_t align);
+uintptr_t mmap_region_find_gap_top_down(struct page_table *page_table, uintptr_t low, uintptr_t high, size_t length, size_t align);
+size_t mmap_region_depth(struct mmap_region *region);
@@ -0,0 +1,572 @@
+#include <mm/pagecache.h>
+#include <mm/pmm.h>
+#include <mm/slab.h>
+#include <mm/vmm.h>
+#include <string.h>
+#include <errno.h>
+#include <cpu.h>
+#include <debug.h>
+
+#define PAGECACHE_STAT_ADD(FIELD, VALUE) __atomic_add_fetch(&pagecache_stats.FIELD, VALUE, __ATOMIC_RELAXED)
+#define PAGECACHE_STAT_SUB(FIELD, VALUE) __atomic_sub_fetch(&pagecache_stats.FIELD, VALUE, __ATOMIC_RELAXED)
+
+#define PAGECACHE_SHRINK_BATCH 32
+
+// page flags are protected by the owning cache lock, the list links by pagecache_lru_lock
+static struct pagecache_lru pagecache_active;
+static struct pagecache_lru pagecache_inactive;
+static char pagecache_lru_lock;
+
+static struct pagecache_stats pagecache_stats;
+
+static void pagecache_lru_remove(struct pagecache_lru *lru, struct pagecache_page *page) {
+	if(page->lru_prev) page->lru_prev->lru_next = page->lru_next;
+	else lru->head = page->lru_next;
+
+	if(page->lru_next) page->lru_next->lru_prev = page->lru_prev;
+	else lru->tail = page->lru_prev;
+
+	page->lru_next = NULL;
+	page->lru_prev = NULL;
+
+	lru->cnt--;
+}
+
+static void pagecache_lru_push(struct pagecache_lru *lru, struct pagecache_page *page) {
+	page->lru_prev = NULL;
+	page->lru_next = lru->head;
+
+	if(lru->head) lru->head->lru_prev = page;
+	else lru->tail = page;
+
+	lru->head = page;
+	lru->cnt++;
+}
+
+static struct pagecache_lru *pagecache_lru_of(struct pagecache_page *page) {
+	return (page->flags & PAGECACHE_ACTIVE) ? &pagecache_active : &pagecache_inactive;
+}
+
+// a second touch while inactive promotes the page, the first one only marks it
+static void pagecache_mark_accessed(struct pagecache_page *page) {
+	spinlock(&pagecache_lru_lock);
+
+	if((page->flags & (PAGECACHE_ACTIVE | PAGECACHE_REFERENCED)) == PAGECACHE_REFERENCED) {
+		pagecache_lru_remove(&pagecache_inactive, page);
+		page->flags = (page->flags | PAGECACHE_ACTIVE) & ~PAGECACHE_REFERENCED;
+		pagecache_lru_push(&pagecache_active, page);
+
+		PAGECACHE_STAT_ADD(activations, 1);
+	} else {
+		page->flags |= PAGECACHE_REFERENCED;
+	}
+
+	spinrelease(&pagecache_lru_lock);
+}
+
+static size_t pagecache_radix_capacity(int height) {
+	return 1ull << (height * PAGECACHE_RADIX_BITS);
+}
+
+static struct pagecache_page *pagecache_radix_lookup(struct pagecache *cache, size_t index) {
+	if(cache->root == NULL || index >= pagecache_radix_capacity(cache->height)) {
+		return NULL;
+	}
+
+	struct pagecache_radix_node *node = cache->root;
+
+	for(int level = cache->height - 1; level > 0; level--) {
+		node = node->slots[(index >> (level * PAGECACHE_RADIX_BITS)) & PAGECACHE_RADIX_MASK];
+		if(node == NULL) {
+			return NULL;
+		}
+	}
+
+	return node->slots[index & PAGECACHE_RADIX_MASK];
+}
+
+static void pagecache_radix_insert(struct pagecache *cache, size_t index, struct pagecache_page *page) {
+	if(cache->root == NULL) {
+		cache->root = alloc(sizeof(struct pagecache_radix_node));
+		cache->height = 1;
+	}
+
+	while(index >= pagecache_radix_capacity(cache->height)) { // grow upwards, the old tree covers the lowest slot
+		struct pagecache_radix_node *root = alloc(sizeof(struct pagecache_radix_node));
+
+		root->slots[0] = cache->root;
+		root->cnt = 1;
+
+		cache->root = root;
+		cache->height++;
+	}
+
+	struct pagecache_radix_node *node = cache->root;
+
+	for(int level = cache->height - 1; level > 0; level--) {
+		size_t slot = (index >> (level * PAGECACHE_RADIX_BITS)) & PAGECACHE_RADIX_MASK;
+
+		if(node->slots[slot] == NULL) {
+			node->slots[slot] = alloc(sizeof(struct pagecache_radix_node));
+			node->cnt++;
+		}
+
+		node = node->slots[slot];
+	}
+
+	node->slots[index & PAGECACHE_RADIX_MASK] = page;
+	node->cnt++;
+}
+
+// returns true once the node is empty so the caller can drop it
+static bool pagecache_radix_delete_node(struct pagecache_radix_node *node, int level, size_t index) {
+	size_t slot = (index >> (level * PAGECACHE_RADIX_BITS)) & PAGECACHE_RADIX_MASK;
+
+	if(node->slots[slot] == NULL) {
+		return false;
+	}
+
+	if(level) {
+		struct pagecache_radix_node *child = node->slots[slot];
+
+		if(pagecache_radix_delete_node(child, level - 1, index) == false) {
+			return false;
+		}
+
+		free(child);
+	}
+
+	node->slots[slot] = NULL;
+
+	return --node->cnt == 0;
+}
+
+static void pagecache_radix_delete(struct pagecache *cache, size_t index) {
+	if(cache->root == NULL || index >= pagecache_radix_capacity(cache->height)) {
+		return;
+	}
+
+	if(pagecache_radix_delete_node(cache->root, cache->height - 1, index)) {
+		free(cache->root);
+		cache->root = NULL;
+		cache->height = 0;
+	}
+}
+
+static struct pagecache_page *pagecache_radix_next_node(struct pagecache_radix_node *node, int level, size_t index) {
+	for(size_t slot = (index >> (level * PAGECACHE_RADIX_BITS)) & PAGECACHE_RADIX_MASK; slot < PAGECACHE_RADIX_SLOTS; slot++) {
+		if(node->slots[slot]) {
+			if(level == 0) {
+				return node->slots[slot];
+			}
+
+			struct pagecache_page *page = pagecache_radix_next_node(node->slots[slot], level - 1, index);
+			if(page) {
+				return page;
+			}
+		}
+
+		index = 0; // every following subtree is searched from its start
+	}
+
+	return NULL;
+}
+
+// lowest cached page at or above index
+static struct pagecache_page *pagecache_radix_next(struct pagecache *cache, size_t index) {
+	if(cache->root == NULL || index >= pagecache_radix_capacity(cache->height)) {
+		return NULL;
+	}
+
+	return pagecache_radix_next_node(cache->root, cache->height - 1, index);
+}
+
+static void pagecache_set_page_dirty(struct pagecache_page *page) {
+	if((page->flags & PAGECACHE_DIRTY) == 0) {
+		page->flags |= PAGECACHE_DIRTY;
+		PAGECACHE_STAT_ADD(dirty, 1);
+	}
+}
+
+static void pagecache_clear_page_dirty(struct pagecache_page *page) {
+	if(page->flags & PAGECACHE_DIRTY) {
+		page->flags &= ~PAGECACHE_DIRTY;
+		PAGECACHE_STAT_SUB(dirty, 1);
+	}
+}
+
+// cache lock and lru lock held, mappings keep their own references to the frame
+static void pagecache_page_release(struct pagecache_page *page) {
+	struct pagecache *cache = page->cache;
+
+	pagecache_lru_remove(pagecache_lru_of(page), page);
+	pagecache_radix_delete(cache, page->index);
+	cache->nrpages--;
+
+	pagecache_clear_page_dirty(page);
+	pmm_frame_put(page->paddr);
+	free(page);
+
+	PAGECACHE_STAT_SUB(pages, 1);
+}
+
+static struct pagecache_page *pagecache_page_create(struct pagecache *cache, size_t index, int alloc_flags) {
+	uint64_t paddr = pmm_alloc_flags(1, 1, alloc_flags);
+
+	if(paddr == (uint64_t)-1 && pagecache_shrink(PAGECACHE_SHRINK_BATCH)) {
+		paddr = pmm_alloc_flags(1, 1, alloc_flags);
+	}
+
+	if(paddr == (uint64_t)-1) {
+		return NULL;
+	}
+
+	pmm_frame_get(paddr); // the cache's own reference
+
+	struct pagecache_page *page = alloc(sizeof(struct pagecache_page));
+
+	*page = (struct pagecache_page) {
+		.paddr = paddr,
+		.index = index,
+		.cache = cache
+	};
+
+	pagecache_radix_insert(cache, index, page);
+	cache->nrpages++;
+
+	spinlock(&pagecache_lru_lock);
+	pagecache_lru_push(&pagecache_inactive, page);
+	spinrelease(&pagecache_lru_lock);
+
+	PAGECACHE_STAT_ADD(pages, 1);
+
+	return page;
+}
+
+static int pagecache_fill(struct pagecache *cache, struct pagecache_page *page) {
+	void *buffer = (void*)(page->paddr + HIGH_VMA);
+	ssize_t cnt = 0;
+
+	if(cache->ops && cache->ops->readpage) {
+		cnt = cache->ops->readpage(cache->asset, page->index * PAGE_SIZE, buffer);
+		if(cnt == -1) {
+			return -1;
+		}
+	}
+
+	if(cnt < (ssize_t)PAGE_SIZE) { // past the end of the backing store reads as zeroes
+		memset8((uint8_t*)buffer + cnt, 0, PAGE_SIZE - cnt);
+	}
+
+	page->flags |= PAGECACHE_UPTODATE;
+
+	return 0;
+}
+
+// cache lock held, fill is false when the caller overwrites the whole page anyway
+// the copy happens after the lock is dropped, so such a page starts out zeroed rather than with stale contents
+static struct pagecache_page *pagecache_get(struct pagecache *cache, size_t index, bool fill) {
+	struct pagecache_page *page = pagecache_radix_lookup(cache, index);
+
+	if(page) {
+		PAGECACHE_STAT_ADD(hits, 1);
+		pagecache_mark_accessed(page);
+		return page;
+	}
+
+	PAGECACHE_STAT_ADD(misses, 1);
+
+	page = pagecache_page_create(cache, index, fill ? PMM_ALLOC_NOZERO : 0);
+	if(page == NULL) {
+		return NULL;
+	}
+
+	if(fill == false) {
+		page->flags |= PAGECACHE_UPTODATE;
+	} else if(pagecache_fill(cache, page) == -1) {
+		spinlock(&pagecache_lru_lock);
+		pagecache_page_release(page);
+		spinrelease(&pagecache_lru_lock);
+		return NULL;
+	}
+
+	return page;
+}
+
+struct pagecache *pagecache_create(struct asset *asset, const struct pagecache_ops *ops) {
+	struct pagecache *cache = alloc(sizeof(struct pagecache));
+
+	*cache = (struct pagecache) {
+		.asset = asset,
+		.ops = ops
+	};
+
+	return cache;
+}
+
+// the frame is pinned while it is copied so a fault on the user buffer can come back into the cache
+ssize_t pagecache_read(struct pagecache *cache, off_t offset, off_t cnt, void *buf) {
+	spinlock(&cache->lock);
+
+	off_t size = cache->asset->stat->st_size;
+
+	if(offset >= size) {
+		spinrelease(&cache->lock);
+		return 0;
+	}
+
+	if(offset + cnt > size) {
+		cnt = size - offset;
+	}
+
+	spinrelease(&cache->lock);
+
+	off_t done = 0;
+
+	while(done < cnt) {
+		off_t position = offset + done;
+		off_t page_offset = position & (PAGE_SIZE - 1);
+		off_t length = PAGE_SIZE - page_offset < (size_t)(cnt - done) ? (off_t)(PAGE_SIZE - page_offset) : cnt - done;
+
+		spinlock(&cache->lock);
+
+		struct pagecache_page *page = pagecache_get(cache, position / PAGE_SIZE, true);
+		if(page == NULL) {
+			spinrelease(&cache->lock);
+			break;
+		}
+
+		uint64_t paddr = page->paddr;
+		pmm_frame_get(paddr);
+
+		spinrelease(&cache->lock);
+
+		memcpy8(buf + done, (void*)(paddr + HIGH_VMA + page_offset), length);
+		pmm_frame_put(paddr);
+
+		done += length;
+	}
+
+	if(done == 0 && cnt) {
+		set_errno(EIO);
+		return -1;
+	}
+
+	return done;
+}
+
+ssize_t pagecache_write(struct pagecache *cache, off_t offset, off_t cnt, const void *buf) {
+	off_t done = 0;
+
+	while(done < cnt) {
+		off_t position = offset + done;
+		off_t page_offset = position & (PAGE_SIZE - 1);
+		off_t length = PAGE_SIZE - page_offset < (size_t)(cnt - done) ? (off_t)(PAGE_SIZE - page_offset) : cnt - done;
+		size_t index = position / PAGE_SIZE;
+
+		spinlock(&cache->lock);
+
+		struct pagecache_page *page = pagecache_get(cache, index, length != PAGE_SIZE);
+		if(page == NULL) {
+			spinrelease(&cache->lock);
+			break;
+		}
+
+		uint64_t paddr = page->paddr;
+		pmm_frame_get(paddr);
+		pagecache_set_page_dirty(page);
+
+		spinrelease(&cache->lock);
+
+		memcpy8((void*)(paddr + HIGH_VMA + page_offset), (void*)buf + done, length);
+		pmm_frame_put(paddr);
+
+		done += length;
+	}
+
+	spinlock(&cache->lock);
+
+	if(offset + done > cache->asset->stat->st_size) {
+		cache->asset->stat->st_size = offset + done;
+	}
+
+	spinrelease(&cache->lock);
+
+	if(done == 0 && cnt) {
+		set_errno(ENOMEM);
+		return -1;
+	}
+
+	return done;
+}
+
+void pagecache_truncate(struct pagecache *cache, off_t size) {
+	spinlock(&cache->lock);
+
+	struct pagecache_page *page;
+
+	spinlock(&pagecache_lru_lock);
+
+	while((page = pagecache_radix_next(cache, DIV_ROUNDUP(size, PAGE_SIZE)))) {
+		pagecache_page_release(page);
+	}
+
+	spinrelease(&pagecache_lru_lock);
+
+	// growing the file again has to bring back zeroes, not the old tail
+	if(size & (PAGE_SIZE - 1) && (page = pagecache_radix_lookup(cache, size / PAGE_SIZE))) {
+		memset8((uint8_t*)(page->paddr + HIGH_VMA) + (size & (PAGE_SIZE - 1)), 0, PAGE_SIZE - (size & (PAGE_SIZE - 1)));
+	}
+
+	cache->asset->stat->st_size = size;
+
+	spinrelease(&cache->lock);
+}
+
+// hands out a mapping reference on the frame backing offset, reading it in on a miss
+uint64_t pagecache_map(struct pagecache *cache, off_t offset, int frame_flags) {
+	spinlock(&cache->lock);
+
+	struct pagecache_page *page = pagecache_get(cache, offset / PAGE_SIZE, true);
+	if(page == NULL) {
+		spinrelease(&cache->lock);
+		return -1;
+	}
+
+	uint64_t paddr = page->paddr;
+	pmm_frame_map(paddr, frame_flags);
+
+	spinrelease(&cache->lock);
+
+	return paddr;
+}
+
+// same as pagecache_map but never does I/O, for fault-around
+uint64_t pagecache_map_cached(struct pagecache *cache, off_t offset, int frame_flags) {
+	spinlock(&cache->lock);
+
+	struct pagecache_page *page = pagecache_radix_lookup(cache, offset / PAGE_SIZE);
+	if(page == NULL) {
+		spinrelease(&cache->lock);
+		return -1;
+	}
+
+	uint64_t paddr = page->paddr;
+	pmm_frame_map(paddr, frame_flags);
+
+	spinrelease(&cache->lock);
+
+	return paddr;
+}
+
+void pagecache_set_dirty(struct pagecache *cache, off_t offset) {
+	spinlock(&cache->lock);
+
+	struct pagecache_page *page = pagecache_radix_lookup(cache, offset / PAGE_SIZE);
+	if(page) {
+		pagecache_set_page_dirty(page);
+	}
+
+	spinrelease(&cache->lock);
+}
+
+// both locks held, returns true if the page went away
+static bool pagecache_reclaim_page(struct pagecache_page *page) {
+	struct pagecache *cache = page->cache;
+	struct frame *frame = pmm_frame(page->paddr);
+
+	// touched since the last scan, mapped somewhere or pinned for a copy
+	if((page->flags & PAGECACHE_REFERENCED) || (frame && frame->refcnt > 1)) {
+		pagecache_lru_remove(&pagecache_inactive, page);
+		page->flags = (page->flags | PAGECACHE_ACTIVE) & ~PAGECACHE_REFERENCED;
+		pagecache_lru_push(&pagecache_active, page);
+		return false;
+	}
+
+	if(page->flags & PAGECACHE_DIRTY) {
+		// without a writepage the cache is the only copy of the data
+		if(cache->ops == NULL || cache->ops->writepage == NULL
+			|| cache->ops->writepage(cache->asset, page->index * PAGE_SIZE, (void*)(page->paddr + HIGH_VMA)) == -1) {
+			pagecache_lru_remove(&pagecache_inactive, page);
+			pagecache_lru_push(&pagecache_inactive, page);
+			return false;
+		}
+
+		pagecache_clear_page_dirty(page);
+		PAGECACHE_STAT_ADD(writebacks, 1);
+	}
+
+	pagecache_page_release(page);
+	PAGECACHE_STAT_ADD(evictions, 1);
+
+	return true;
+}
+
+// lru lock held, keeps the active list from outgrowing the inactive one
+static void pagecache_deactivate_tail() {
+	struct pagecache_page *page = pagecache_active.tail;
+	if(page == NULL) {
+		return;
+	}
+
+	pagecache_lru_remove(&pagecache_active, page);
+
+	if(__atomic_test_and_set(&page->cache->lock, __ATOMIC_ACQUIRE)) {
+		pagecache_lru_push(&pagecache_active, page);
+		return;
+	}
+
+	if(page->flags & PAGECACHE_REFERENCED) {
+		page->flags &= ~PAGECACHE_REFERENCED;
+		pagecache_lru_push(&pagecache_active, page);
+	} else {
+		page->flags &= ~PAGECACHE_ACTIVE;
+		pagecache_lru_push(&pagecache_inactive, page);
+	}
+
+	spinrelease(&page->cache->lock);
+}
+
+// evicts up to cnt clean unmapped pages from the inactive tail, returns how many went
+size_t pagecache_shrink(size_t cnt) {
+	size_t freed = 0;
+
+	spinlock(&pagecache_lru_lock);
+
+	for(size_t scan = pagecache_active.cnt + pagecache_inactive.cnt; freed < cnt && scan; scan--) {
+		if(pagecache_active.cnt > pagecache_inactive.cnt) {
+			pagecache_deactivate_tail();
+		}
+
+		struct pagecache_page *page = pagecache_inactive.tail;
+		if(page == NULL) {
+			break;
+		}
+
+		struct pagecache *cache = page->cache;
+
+		// lock order is cache then lru, so only try, whoever holds it may be waiting for us
+		if(__atomic_test_and_set(&cache->lock, __ATOMIC_ACQUIRE)) {
+			pagecache_lru_remove(&pagecache_inactive, page);
+			pagecache_lru_push(&pagecache_inactive, page);
+			continue;
+		}
+
+		if(pagecache_reclaim_page(page)) {
+			freed++;
+		}
+
+		spinrelease(&cache->lock);
+	}
+
+	spinrelease(&pagecache_lru_lock);
+
+	return freed;
+}
+
+void pagecache_get_stats(struct pagecache_stats *stats) {
+	*stats = pagecache_stats;
+
+	stats->active = pagecache_active.cnt;
+	stats->inactive = pagecache_inactive.cnt;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <types.h>
+
+#define PAGECACHE_RADIX_BITS 6
+#define PAGECACHE_RADIX_SLOTS (1 << PAGECACHE_RADIX_BITS)
+#define PAGECACHE_RADIX_MASK (PAGECACHE_RADIX_SLOTS - 1)
+
+#define PAGECACHE_UPTODATE (1 << 0)
+#define PAGECACHE_DIRTY (1 << 1)
+#define PAGECACHE_ACTIVE (1 << 2)
+#define PAGECACHE_REFERENCED (1 << 3)
+
+struct pagecache;
+
+// how a cache talks to whatever backs it, a NULL writepage pins dirty pages in memory
+struct pagecache_ops {
+	ssize_t (*readpage)(struct asset *asset, off_t offset, void *buffer);
+	ssize_t (*writepage)(struct asset *asset, off_t offset, const void *buffer);
+};
+
+struct pagecache_page {
+	uint64_t paddr;
+	size_t index;
+	int flags;
+
+	struct pagecache *cache;
+
+	struct pagecache_page *lru_next;
+	struct pagecache_page *lru_prev;
+};
+
+struct pagecache_radix_node {
+	void *slots[PAGECACHE_RADIX_SLOTS];
+	size_t cnt;
+};
+
+// one per asset, pages are indexed by file offset >> 12
+struct pagecache {
+	struct asset *asset;
+	const struct pagecache_ops *ops;
+
+	struct pagecache_radix_node *root;
+	int height;
+	size_t nrpages;
+
+	char lock;
+};
+
+struct pagecache_lru {
+	struct pagecache_page *head;
+	struct pagecache_page *tail;
+	size_t cnt;
+};
+
+struct pagecache_stats {
+	size_t pages;
+	size_t dirty;
+	size_t active;
+	size_t inactive;
+	size_t hits;
+	size_t misses;
+	size_t activations;
+	size_t evictions;
+	size_t writebacks;
+};
+
+struct pagecache *pagecache_create(struct asset *asset, const struct pagecache_ops *ops);
+ssize_t pagecache_read(struct pagecache *cache, off_t offset, off_t cnt, void *buf);
+ssize_t pagecache_write(struct pagecache *cache, off_t offset, off_t cnt, const void *buf);
+void pagecache_truncate(struct pagecache *cache, off_t size);
+uint64_t pagecache_map(struct pagecache *cache, off_t offset, int frame_flags);
+uint64_t pagecache_map_cached(struct pagecache *cache, off_t offset, int frame_flags);
+void pagecache_set_dirty(struct pagecache *cache, off_t offset);
+size_t pagecache_shrink(size_t cnt);
+void pagecache_get_stats(struct pagecache_stats *stats);
@@ -5,13 +5,24 @@
 #include <string.h>
 #include <limine.h>
 
+#define PMM_MAX_ORDER 18
+#define PMM_FREE_BLOCK 0x80
+
+struct pmm_free_block {
+	struct pmm_free_block *next;
+	struct pmm_free_block *last;
+};
+
 struct pmm_module {
 	struct limine_memmap_entry *mmap_entry;
 
-	size_t bitmap_size;
-	size_t bitmap_entry_cnt;
-	size_t last_free;
-	uint8_t *bitmap;
+	uint64_t base_pfn;
+	size_t page_cnt;
+	size_t free_pages;
+	uint8_t *order_map;
+	struct frame *frames;
+
+	struct pmm_free_block *free_list[PMM_MAX_ORDER + 1];
 
 	struct pmm_module *next;
 
@@ -26,70 +37,155 @@ volatile struct limine_memmap_request limine_memmap_request = {
 	.revision = 0
 };
 
-static void pmm_init_module(struct pmm_module *module, struct limine_memmap_entry *mmap_entry) {
-	size_t page_cnt = DIV_ROUNDUP(mmap_entry->length, PAGE_SIZE);
+static inline struct pmm_free_block *pmm_pfn_to_block(uint64_t pfn) {
+	return (struct pmm_free_block*)(pfn * PAGE_SIZE + HIGH_VMA);
+}
 
-	module->mmap_entry = mmap_entry;
-	module->bitmap_size = DIV_ROUNDUP(page_cnt, 8);
-	module->bitmap_entry_cnt = page_cnt;
-	module->bitmap = meta_buffer;
+static inline uint64_t pmm_block_to_pfn(struct pmm_free_block *block) {
+	return ((uintptr_t)block - HIGH_VMA) / PAGE_SIZE;
+}
 
-	memset8(module->bitmap, 0, module->bitmap_size);
+static int pmm_order(uint64_t cnt) {
+	int order = 0;
 
-	meta_buffer += module->bitmap_size;
+	while((1ull << order) < cnt) {
+		order++;
+	}
+
+	return order;
 }
 
-static uint64_t pmm_module_alloc(struct pmm_module *module, uint64_t cnt, uint64_t align) {
-	spinlock(&module->lock);
+static void pmm_module_insert(struct pmm_module *module, uint64_t pfn, int order) {
+	struct pmm_free_block *block = pmm_pfn_to_block(pfn);
 
-	size_t alloc_base = ALIGN_UP(module->mmap_entry->base + (module->last_free * PAGE_SIZE), align * PAGE_SIZE); // calcuate base address for the allocation
-	size_t bit_base = (alloc_base - module->mmap_entry->base) / PAGE_SIZE;
+	block->last = NULL;
+	block->next = module->free_list[order];
 
-	for(size_t i = bit_base; i < module->bitmap_entry_cnt; i += align) {
-		if(module->bitmap_entry_cnt < (i + cnt)) {
-			spinrelease(&module->lock);
-			return -1;
+	if(module->free_list[order]) {
+		module->free_list[order]->last = block;
+	}
+
+	module->free_list[order] = block;
+	module->order_map[pfn - module->base_pfn] = PMM_FREE_BLOCK | order;
+}
+
+static void pmm_module_remove(struct pmm_module *module, uint64_t pfn, int order) {
+	struct pmm_free_block *block = pmm_pfn_to_block(pfn);
+
+	if(block->next) {
+		block->next->last = block->last;
+	}
+
+	if(block->last) {
+		block->last->next = block->next;
+	} else {
+		module->free_list[order] = block->next;
+	}
+
+	module->order_map[pfn - module->base_pfn] = 0;
+}
+
+static void pmm_module_free_block(struct pmm_module *module, uint64_t pfn, int order) {
+	if(module->order_map[pfn - module->base_pfn] & PMM_FREE_BLOCK) {
+		print("pmm: double free of frame %x\n", pfn * PAGE_SIZE);
+		return;
+	}
+
+	module->free_pages += 1ull << order;
+
+	while(order < PMM_MAX_ORDER) { // coalesce with the buddy for as long as it is free and of the same order
+		uint64_t buddy = pfn ^ (1ull << order);
+
+		if(buddy < module->base_pfn || (buddy + (1ull << order)) > (module->base_pfn + module->page_cnt)) {
+			break;
 		}
 
-		for(size_t j = i, count = 0; j < (i + cnt); j++) {
-			if(BIT_TEST(module->bitmap, j)) {
-				alloc_base += align * PAGE_SIZE;
-				break;
-			}
+		if(module->order_map[buddy - module->base_pfn] != (PMM_FREE_BLOCK | order)) {
+			break;
+		}
 
-			if(++count == cnt) {
-				for(size_t z = 0; z < count; z++) {
-					BIT_SET(module->bitmap, i + z);
-				}
+		pmm_module_remove(module, buddy, order);
 
-				module->last_free = 0;
+		pfn &= ~(1ull << order);
+		order++;
+	}
 
-				for(size_t z = j; z < module->bitmap_entry_cnt; z++) {
-					if(!BIT_TEST(module->bitmap, z)) {
-						module->last_free = z;
-						break;
-					}
-				}
+	pmm_module_insert(module, pfn, order);
+}
 
-				spinrelease(&module->lock);
+static void pmm_module_free_range(struct pmm_module *module, uint64_t pfn, uint64_t cnt) {
+	while(cnt) { // split the range into the largest naturally aligned blocks it contains
+		int order = 0;
 
-				return alloc_base;
-			}
+		while(order < PMM_MAX_ORDER && (pfn & ((2ull << order) - 1)) == 0 && (2ull << order) <= cnt) {
+			order++;
 		}
+
+		pmm_module_free_block(module, pfn, order);
+
+		pfn += 1ull << order;
+		cnt -= 1ull << order;
 	}
+}
 
-	spinrelease(&module->lock);
+static void pmm_init_module(struct pmm_module *module, struct limine_memmap_entry *mmap_entry) {
+	module->mmap_entry = mmap_entry;
+	module->base_pfn = mmap_entry->base / PAGE_SIZE;
+	module->page_cnt = mmap_entry->length / PAGE_SIZE;
+	module->frames = meta_buffer;
 
-	return -1;
+	memset8((void*)module->frames, 0, module->page_cnt * sizeof(struct frame));
+
+	meta_buffer += module->page_cnt * sizeof(struct frame);
+	module->order_map = meta_buffer;
+
+	memset8(module->order_map, 0, module->page_cnt);
+
+	meta_buffer += module->page_cnt;
+
+	pmm_module_free_range(module, module->base_pfn, module->page_cnt);
 }
 
-static void pmm_module_free(struct pmm_module *module, uint64_t base, uint64_t cnt) {
+static uint64_t pmm_module_alloc(struct pmm_module *module, uint64_t cnt, uint64_t align) {
+	int order = pmm_order(cnt > align ? cnt : align); // a block of order n is always aligned to 2^n pages
+	if(order > PMM_MAX_ORDER) {
+		return -1;
+	}
+
 	spinlock(&module->lock);
 
-	for(size_t i = DIV_ROUNDUP(base, PAGE_SIZE); i < (DIV_ROUNDUP(base, PAGE_SIZE) + cnt); i++) {
-		BIT_CLEAR(module->bitmap, i);
+	int current_order = order;
+	while(current_order <= PMM_MAX_ORDER && module->free_list[current_order] == NULL) {
+		current_order++;
+	}
+
+	if(current_order > PMM_MAX_ORDER) {
+		spinrelease(&module->lock);
+		return -1;
+	}
+
+	uint64_t pfn = pmm_block_to_pfn(module->free_list[current_order]);
+	pmm_module_remove(module, pfn, current_order);
+
+	while(current_order > order) { // split the block, returning the upper halves to the free lists
+		current_order--;
+		pmm_module_insert(module, pfn + (1ull << current_order), current_order);
 	}
 
+	module->free_pages -= 1ull << order;
+
+	if((1ull << order) > cnt) { // give back the tail that was only needed for the size class or alignment
+		pmm_module_free_range(module, pfn + cnt, (1ull << order) - cnt);
+	}
+
+	spinrelease(&module->lock);
+
+	return pfn * PAGE_SIZE;
+}
+
+static void pmm_module_free(struct pmm_module *module, uint64_t base, uint64_t cnt) {
+	spinlock(&module->lock);
+	pmm_module_free_range(module, base / PAGE_SIZE, cnt);
 	spinrelease(&module->lock);
 }
 
@@ -102,7 +198,7 @@ void pmm_init() {
 	for(size_t i = 0; i < entry_count; i++) { // calcuate the size the metabuffer needs to be
 		if(mmap[i]->type == LIMINE_MEMMAP_USABLE) {
 			size_t entry_cnt = DIV_ROUNDUP(mmap[i]->length, PAGE_SIZE);
-			buffer_size += sizeof(struct pmm_module) * 2 + DIV_ROUNDUP(entry_cnt, 8);
+			buffer_size += sizeof(struct pmm_module) * 2 + entry_cnt * (sizeof(struct frame) + 1);
 		}
 
 		if(mmap[i]->base < 0x100000) {
@@ -129,7 +225,7 @@ void pmm_init() {
 		}
 	}
 
-	for(size_t i = 0; i < entry_count; i++) { // create bitmap modules for all usable regions
+	for(size_t i = 0; i < entry_count; i++) { // create buddy modules for all usable regions
 		if(mmap[i]->type == LIMINE_MEMMAP_USABLE && mmap[i]->length) {
 			print("pmm: [%x -> %x] length %x type %x\n", mmap[i]->base, mmap[i]->base + mmap[i]->length, mmap[i]->length, mmap[i]->type);
 
@@ -159,10 +255,13 @@ void pmm_init() {
 	print("pmm: initialised\n");
 }
 
-
-uint64_t pmm_alloc(uint64_t cnt, uint64_t align) {
+static uint64_t pmm_alloc_pages(uint64_t cnt, uint64_t align) {
 	struct pmm_module *module = root_module;
 
+	if(align == 0) {
+		align = 1;
+	}
+
 	do {
 		uint64_t alloc = pmm_module_alloc(module, cnt, align);
 
@@ -171,22 +270,441 @@ uint64_t pmm_alloc(uint64_t cnt, uint64_t align) {
 			continue;
 		}
 
-		memset64((void*)(alloc + HIGH_VMA), 0, (cnt * PAGE_SIZE) / 8);
-
 		return alloc;
 	} while(module);
 
 	return -1;
 }
 
+static struct pmm_module *pmm_find_module(uint64_t base, uint64_t cnt) {
+	for(struct pmm_module *module = root_module; module; module = module->next) {
+		uint64_t module_base = module->base_pfn * PAGE_SIZE;
+		uint64_t module_limit = module_base + module->page_cnt * PAGE_SIZE;
+
+		if(base >= module_base && (base + cnt * PAGE_SIZE) <= module_limit) {
+			return module;
+		}
+	}
+
+	return NULL;
+}
+
+struct frame *pmm_frame(uint64_t paddr) {
+	struct pmm_module *module = pmm_find_module(paddr & ~(PAGE_SIZE - 1), 1);
+	if(module == NULL) {
+		return NULL;
+	}
+
+	return &module->frames[paddr / PAGE_SIZE - module->base_pfn];
+}
+
+// frames outside of the pmm (framebuffers, mmio) have no descriptor and are never counted
+void pmm_frame_get(uint64_t paddr) {
+	struct frame *frame = pmm_frame(paddr);
+	if(frame == NULL) {
+		return;
+	}
+
+	__atomic_add_fetch(&frame->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+static void pmm_frame_release(struct frame *frame, uint64_t paddr) {
+	if(__atomic_sub_fetch(&frame->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+		frame->mapcount = 0;
+		frame->flags = 0;
+		pmm_free(paddr & ~(PAGE_SIZE - 1), 1);
+	}
+}
+
+void pmm_frame_put(uint64_t paddr) {
+	struct frame *frame = pmm_frame(paddr);
+	if(frame == NULL) {
+		return;
+	}
+
+	pmm_frame_release(frame, paddr);
+}
+
+void pmm_frame_map(uint64_t paddr, int flags) {
+	struct frame *frame = pmm_frame(paddr);
+	if(frame == NULL) {
+		return;
+	}
+
+	__atomic_or_fetch(&frame->flags, flags, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&frame->mapcount, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&frame->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+void pmm_frame_unmap(uint64_t paddr) {
+	struct frame *frame = pmm_frame(paddr);
+	if(frame == NULL) {
+		return;
+	}
+
+	__atomic_sub_fetch(&frame->mapcount, 1, __ATOMIC_RELAXED);
+	pmm_frame_release(frame, paddr);
+}
+
+static void pmm_free_batch(uint64_t *frames, size_t cnt) {
+	struct pmm_module *locked = NULL;
+
+	for(size_t i = 0; i < cnt; i++) { // hold each module lock across consecutive frames of the same region
+		struct pmm_module *module = pmm_find_module(frames[i], 1);
+		if(module == NULL) {
+			continue;
+		}
+
+		if(module != locked) {
+			if(locked) {
+				spinrelease(&locked->lock);
+			}
+
+			spinlock(&module->lock);
+			locked = module;
+		}
+
+		pmm_module_free_range(module, frames[i] / PAGE_SIZE, 1);
+	}
+
+	if(locked) {
+		spinrelease(&locked->lock);
+	}
+}
+
+static void pmm_cache_refill(struct pmm_cache *cache) {
+	uint64_t base = pmm_alloc_pages(PMM_CACHE_BATCH, 1);
+
+	if(base != -1) {
+		for(size_t i = PMM_CACHE_BATCH; i-- > 0;) {
+			cache->frames[cache->cnt++] = base + i * PAGE_SIZE;
+		}
+	} else { // no contiguous batch left, scrape together single frames
+		while(cache->cnt < PMM_CACHE_BATCH) {
+			uint64_t frame = pmm_alloc_pages(1, 1);
+			if(frame == -1) {
+				break;
+			}
+
+			cache->frames[cache->cnt++] = frame;
+		}
+	}
+
+	cache->refills++;
+}
+
+static uint64_t pmm_cache_alloc(int flags, bool *zeroed) {
+	uint64_t rflags = interrupts_save();
+
+	*zeroed = false;
+
+	struct cpu_local *cpu_local = CORE_LOCAL;
+	if(cpu_local == NULL || cpu_local->pmm_cache == NULL) {
+		interrupts_restore(rflags);
+		return pmm_alloc_pages(1, 1);
+	}
+
+	struct pmm_cache *cache = cpu_local->pmm_cache;
+
+	if(!(flags & PMM_ALLOC_NOZERO) && cache->zeroed_cnt) { // the idle pass already did the work
+		uint64_t frame = cache->zeroed[--cache->zeroed_cnt];
+		cache->hits++;
+		cache->zeroed_hits++;
+		interrupts_restore(rflags);
+		*zeroed = true;
+		return frame;
+	}
+
+	if(cache->cnt == 0 && (flags & PMM_ALLOC_NOZERO) && cache->zeroed_cnt) { // rather waste a zeroed frame than take the lock
+		uint64_t frame = cache->zeroed[--cache->zeroed_cnt];
+		cache->hits++;
+		interrupts_restore(rflags);
+		*zeroed = true;
+		return frame;
+	}
+
+	if(cache->cnt == 0) {
+		cache->misses++;
+		pmm_cache_refill(cache);
+	} else {
+		cache->hits++;
+	}
+
+	uint64_t frame = cache->cnt ? cache->frames[--cache->cnt] : -1;
+
+	interrupts_restore(rflags);
+
+	return frame;
+}
+
+static int pmm_cache_free(uint64_t frame) {
+	uint64_t rflags = interrupts_save();
+
+	struct cpu_local *cpu_local = CORE_LOCAL;
+	if(cpu_local == NULL || cpu_local->pmm_cache == NULL) {
+		interrupts_restore(rflags);
+		return -1;
+	}
+
+	struct pmm_cache *cache = cpu_local->pmm_cache;
+
+	if(cache->cnt == PMM_CACHE_CAPACITY) { // drain the coldest frames, keep the recently freed ones
+		pmm_free_batch(cache->frames, PMM_CACHE_BATCH);
+		memcpy64(cache->frames, cache->frames + PMM_CACHE_BATCH, PMM_CACHE_CAPACITY - PMM_CACHE_BATCH);
+		cache->cnt -= PMM_CACHE_BATCH;
+		cache->drains++;
+	}
+
+	cache->frames[cache->cnt++] = frame;
+
+	interrupts_restore(rflags);
+
+	return 0;
+}
+
+uint64_t pmm_alloc_flags(uint64_t cnt, uint64_t align, int flags) {
+	uint64_t alloc;
+	bool zeroed = false;
+
+	if(cnt == 1 && align <= 1) {
+		alloc = pmm_cache_alloc(flags, &zeroed);
+	} else {
+		alloc = pmm_alloc_pages(cnt, align);
+	}
+
+	if(alloc != -1 && !zeroed && !(flags & PMM_ALLOC_NOZERO)) {
+		memset64((void*)(alloc + HIGH_VMA), 0, (cnt * PAGE_SIZE) / 8);
+	}
+
+	return alloc;
+}
+
+uint64_t pmm_alloc(uint64_t cnt, uint64_t align) {
+	return pmm_alloc_flags(cnt, align, 0);
+}
+
+size_t pmm_zero_idle() {
+	size_t cnt = 0;
+
+	while(cnt < PMM_ZERO_IDLE_BATCH) { // one frame at a time so interrupts are never held off for long
+		uint64_t rflags = interrupts_save();
+
+		struct cpu_local *cpu_local = CORE_LOCAL;
+		if(cpu_local == NULL || cpu_local->pmm_cache == NULL) {
+			interrupts_restore(rflags);
+			break;
+		}
+
+		struct pmm_cache *cache = cpu_local->pmm_cache;
+
+		if(cache->zeroed_cnt == PMM_CACHE_ZEROED_CAPACITY) {
+			interrupts_restore(rflags);
+			break;
+		}
+
+		if(cache->cnt == 0) {
+			pmm_cache_refill(cache);
+
+			if(cache->cnt == 0) {
+				interrupts_restore(rflags);
+				break;
+			}
+		}
+
+		uint64_t frame = cache->frames[--cache->cnt];
+		memset64((void*)(frame + HIGH_VMA), 0, PAGE_SIZE / 8);
+
+		cache->zeroed[cache->zeroed_cnt++] = frame;
+		cache->idle_zeroed++;
+
+		interrupts_restore(rflags);
+
+		cnt++;
+	}
+
+	return cnt;
+}
+
 void pmm_free(uint64_t base, uint64_t cnt) {
-	struct pmm_module *module = root_module;
+	struct pmm_module *module = pmm_find_module(base, cnt);
+	if(module == NULL) {
+		return;
+	}
 
-	do {
-		struct limine_memmap_entry *mmap = module->mmap_entry;
-		if(base >= mmap->base && (mmap->base + cnt * PAGE_SIZE) <= (mmap->base + module->bitmap_entry_cnt * PAGE_SIZE)) {
-			return pmm_module_free(module, base - mmap->base, cnt);
+	if(cnt == 1 && pmm_cache_free(base) == 0) {
+		return;
+	}
+
+	pmm_module_free(module, base, cnt);
+}
+
+void pmm_get_cache_stats(struct pmm_cache_stats *stats) {
+	*stats = (struct pmm_cache_stats) { 0 };
+
+	for(size_t i = 0; i < cpu_local_list.length; i++) {
+		struct pmm_cache *cache = cpu_local_list.data[i]->pmm_cache;
+
+		stats->cached += cache->cnt;
+		stats->zeroed += cache->zeroed_cnt;
+		stats->hits += cache->hits;
+		stats->misses += cache->misses;
+		stats->refills += cache->refills;
+		stats->drains += cache->drains;
+		stats->zeroed_hits += cache->zeroed_hits;
+		stats->idle_zeroed += cache->idle_zeroed;
+	}
+}
+
+size_t pmm_get_region_stats(struct pmm_region_stats *stats, size_t cnt) {
+	size_t region_cnt = 0;
+
+	for(struct pmm_module *module = root_module; module; module = module->next, region_cnt++) {
+		if(region_cnt >= cnt) {
+			continue;
 		}
-		module = module->next;
-	} while(module);
+
+		spinlock(&module->lock);
+
+		stats[region_cnt] = (struct pmm_region_stats) {
+			.base = module->base_pfn * PAGE_SIZE,
+			.pages = module->page_cnt,
+			.free_pages = module->free_pages
+		};
+
+		spinrelease(&module->lock);
+	}
+
+	return region_cnt;
+}
+
+// frames sitting in the per-cpu caches are free as well
+size_t pmm_free_page_cnt() {
+	size_t cnt = 0;
+
+	for(struct pmm_module *module = root_module; module; module = module->next) {
+		cnt += module->free_pages;
+	}
+
+	for(size_t i = 0; i < cpu_local_list.length; i++) {
+		struct pmm_cache *cache = cpu_local_list.data[i]->pmm_cache;
+		cnt += cache->cnt + cache->zeroed_cnt;
+	}
+
+	return cnt;
+}
+
+#ifdef PMM_SELF_TEST
+
+#define PMM_TEST_SLOTS 4096
+#define PMM_TEST_ITERATIONS 4000000
+
+static int pmm_test_mark(uint8_t *shadow, uint64_t base, uint64_t cnt, int allocate) {
+	for(uint64_t pfn = base / PAGE_SIZE; pfn < (base / PAGE_SIZE + cnt); pfn++) {
+		if(BIT_TEST(shadow, pfn) == allocate) {
+			return -1;
+		}
+
+		if(allocate) {
+			BIT_SET(shadow, pfn);
+		} else {
+			BIT_CLEAR(shadow, pfn);
+		}
+	}
+
+	return 0;
+}
+
+void pmm_self_test() {
+	static struct {
+		uint64_t base;
+		uint64_t cnt;
+	} slots[PMM_TEST_SLOTS];
+
+	uint64_t highest_pfn = 0;
+
+	for(struct pmm_module *module = root_module; module; module = module->next) {
+		if(module->base_pfn + module->page_cnt > highest_pfn) {
+			highest_pfn = module->base_pfn + module->page_cnt;
+		}
+	}
+
+	uint64_t shadow_pages = DIV_ROUNDUP(DIV_ROUNDUP(highest_pfn, 8), PAGE_SIZE);
+	uint8_t *shadow = (uint8_t*)(pmm_alloc(shadow_pages, 1) + HIGH_VMA); // records which frames the test owns
+
+	size_t baseline = pmm_free_page_cnt();
+
+	uint64_t seed = 0x2545f4914f6cdd1d;
+	uint64_t alloc_cycles = 0, alloc_cnt = 0;
+	uint64_t free_cycles = 0, free_cnt = 0;
+
+	print("pmm: self test, %d iterations over %d slots\n", PMM_TEST_ITERATIONS, PMM_TEST_SLOTS);
+
+	for(size_t i = 0; i < PMM_TEST_ITERATIONS; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+
+		size_t slot = seed % PMM_TEST_SLOTS;
+
+		if(slots[slot].cnt) {
+			if(pmm_test_mark(shadow, slots[slot].base, slots[slot].cnt, 0) == -1) {
+				panic("pmm: self test lost ownership of block %x", slots[slot].base);
+			}
+
+			uint64_t start = rdtsc();
+			pmm_free(slots[slot].base, slots[slot].cnt);
+			free_cycles += rdtsc() - start;
+			free_cnt++;
+
+			slots[slot].cnt = 0;
+			continue;
+		}
+
+		int order = __builtin_ctzll((seed >> 16) | (1ull << 9)); // geometric mix of orders 0 through 9
+		uint64_t cnt = 1ull << order;
+		uint64_t align = (seed >> 32) & 1 ? cnt : 1;
+
+		if(order && ((seed >> 33) & 1)) { // exercise non power of two sizes as well
+			cnt += (seed >> 40) % cnt;
+		}
+
+		uint64_t start = rdtsc();
+		uint64_t base = pmm_alloc_pages(cnt, align);
+		alloc_cycles += rdtsc() - start;
+		alloc_cnt++;
+
+		if(base == -1) {
+			continue;
+		}
+
+		if(base % (align * PAGE_SIZE)) {
+			panic("pmm: self test block %x is not aligned to %x pages", base, align);
+		}
+
+		if(pmm_test_mark(shadow, base, cnt, 1) == -1) {
+			panic("pmm: self test block %x overlaps a live block", base);
+		}
+
+		slots[slot].base = base;
+		slots[slot].cnt = cnt;
+	}
+
+	for(size_t i = 0; i < PMM_TEST_SLOTS; i++) {
+		if(slots[i].cnt) {
+			pmm_free(slots[i].base, slots[i].cnt);
+			slots[i].cnt = 0;
+		}
+	}
+
+	if(pmm_free_page_cnt() != baseline) {
+		panic("pmm: self test leaked %d pages", baseline - pmm_free_page_cnt());
+	}
+
+	pmm_free((uintptr_t)shadow - HIGH_VMA, shadow_pages);
+
+	print("pmm: self test passed: %d allocs at %d cycles/op, %d frees at %d cycles/op\n",
+		alloc_cnt, alloc_cycles / (alloc_cnt ? alloc_cnt : 1),
+		free_cnt, free_cycles / (free_cnt ? free_cnt : 1));
 }
+
+#endif
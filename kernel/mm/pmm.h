@@ -1,9 +1,73 @@
 #pragma once
 
+#include <stdint.h>
+#include <stddef.h>
 #include <limine.h>
 
+#define PMM_CACHE_CAPACITY 64
+#define PMM_CACHE_BATCH 32
+#define PMM_CACHE_ZEROED_CAPACITY 64
+#define PMM_ZERO_IDLE_BATCH 8
+
+#define PMM_ALLOC_NOZERO (1 << 0)
+
+#define FRAME_ANON (1 << 0)
+#define FRAME_FILE (1 << 1)
+#define FRAME_SHARED (1 << 2)
+#define FRAME_KSM (1 << 3)
+
+struct frame {
+	void *slab;
+	uint32_t refcnt;
+	uint32_t mapcount;
+	uint32_t flags;
+};
+
+struct pmm_cache {
+	uint64_t frames[PMM_CACHE_CAPACITY];
+	size_t cnt;
+
+	uint64_t zeroed[PMM_CACHE_ZEROED_CAPACITY];
+	size_t zeroed_cnt;
+
+	size_t hits;
+	size_t misses;
+	size_t refills;
+	size_t drains;
+	size_t zeroed_hits;
+	size_t idle_zeroed;
+};
+
+struct pmm_region_stats {
+	uint64_t base;
+	size_t pages;
+	size_t free_pages;
+};
+
+struct pmm_cache_stats {
+	size_t cached;
+	size_t zeroed;
+	size_t hits;
+	size_t misses;
+	size_t refills;
+	size_t drains;
+	size_t zeroed_hits;
+	size_t idle_zeroed;
+};
+
 void pmm_init();
 uint64_t pmm_alloc(uint64_t cnt, uint64_t align);
+uint64_t pmm_alloc_flags(uint64_t cnt, uint64_t align, int flags);
 void pmm_free(uint64_t base, uint64_t cnt);
+struct frame *pmm_frame(uint64_t paddr);
+void pmm_frame_get(uint64_t paddr);
+void pmm_frame_put(uint64_t paddr);
+void pmm_frame_map(uint64_t paddr, int flags);
+void pmm_frame_unmap(uint64_t paddr);
+void pmm_self_test();
+void pmm_get_cache_stats(struct pmm_cache_stats *stats);
+size_t pmm_get_region_stats(struct pmm_region_stats *stats, size_t cnt);
+size_t pmm_zero_idle();
+size_t pmm_free_page_cnt();
 
 extern volatile struct limine_memmap_request limine_memmap_request;
@@ -0,0 +1,306 @@
+#include <mm/reclaim.h>
+#include <mm/swap.h>
+#include <mm/pmm.h>
+#include <mm/mmap.h>
+#include <mm/mmap_region.h>
+#include <mm/pagecache.h>
+#include <mm/tlb.h>
+#include <sched/sched.h>
+#include <fs/vfs.h>
+#include <cpu.h>
+#include <debug.h>
+
+#define RECLAIM_STAT_ADD(FIELD, VALUE) __atomic_add_fetch(&reclaim_stats.FIELD, VALUE, __ATOMIC_RELAXED)
+
+// there is no reverse map, so the lists live in the ptes: the accessed bit puts a page on the active list,
+// a pass that finds it clear moves it to the inactive one and the next such pass evicts it
+
+static struct reclaim_stats reclaim_stats;
+
+static size_t reclaim_low;
+static size_t reclaim_high;
+
+static struct page_table *reclaim_cursor;
+static uintptr_t reclaim_cursor_vaddr;
+static char reclaim_lock;
+
+static struct sched_task *kswapd_task;
+static struct sched_thread *kswapd_thread;
+static size_t kswapd_ticks;
+
+// the page goes back to the pending state mmap left it in, the cache can drop it once nobody maps it
+static int reclaim_file_page(struct mmap_region *region, uintptr_t vaddr, uint64_t *entry, struct tlb_batch *batch) {
+	struct pagecache *cache = region->node ? region->node->asset->pagecache : NULL;
+	if(cache == NULL) { // device memory and private snapshots have nothing to fall back on
+		return 0;
+	}
+
+	// the owner keeps running on other cores, a plain read and store could lose a dirty bit set in between
+	uint64_t pte = __atomic_exchange_n(entry, mmap_file_entry_flags(region->prot, region->flags), __ATOMIC_SEQ_CST);
+
+	if((pte & VMM_SHARE_FLAG) && (pte & VMM_FLAGS_D)) {
+		pagecache_set_dirty(cache, (region->offset & ~(0xfff)) + (vaddr - region->base));
+	}
+
+	tlb_batch_add(batch, vaddr);
+	tlb_batch_add_frames(batch, pte & VMM_PADDR_MASK, 1);
+
+	RECLAIM_STAT_ADD(file, 1);
+
+	return 1;
+}
+
+static int reclaim_anon_page(struct page_table *page_table, uintptr_t vaddr, uint64_t *entry) {
+	uint64_t pte = *entry;
+	uint64_t paddr = pte & VMM_PADDR_MASK;
+
+	struct frame *frame = pmm_frame(paddr);
+	if(frame == NULL || frame->refcnt != 1) { // shared with a fork, the other ptes can not be found
+		return 0;
+	}
+
+	pte = __atomic_fetch_and(entry, ~(VMM_FLAGS_P), __ATOMIC_SEQ_CST);
+	tlb_invalidate(page_table, vaddr); // nothing may store to the frame while it is copied out
+
+	uint64_t slot = swap_out(paddr);
+	if(slot == (uint64_t)-1) {
+		*entry = pte & ~(VMM_INACTIVE_FLAG);
+		return 0;
+	}
+
+	*entry = SWAP_ENTRY(slot, pte);
+	pmm_frame_unmap(paddr);
+
+	RECLAIM_STAT_ADD(anon, 1);
+
+	return 1;
+}
+
+static int reclaim_entry(struct page_table *page_table, struct mmap_region *region, uintptr_t vaddr, uint64_t *entry,
+	struct tlb_batch *batch) {
+	uint64_t pte = *entry;
+
+	if((pte & VMM_FLAGS_P) == 0) {
+		return 0;
+	}
+
+	if(pte & VMM_FLAGS_A) { // the cached translation has to go as well or the bit is never set again
+		if(pte & VMM_INACTIVE_FLAG) {
+			RECLAIM_STAT_ADD(activated, 1);
+		}
+
+		*entry = pte & ~(VMM_FLAGS_A | VMM_INACTIVE_FLAG);
+		tlb_batch_add(batch, vaddr);
+
+		return 0;
+	}
+
+	if((pte & VMM_INACTIVE_FLAG) == 0) {
+		*entry = pte | VMM_INACTIVE_FLAG;
+		RECLAIM_STAT_ADD(deactivated, 1);
+
+		return 0;
+	}
+
+	if(pte & VMM_FILE_FLAG) {
+		return reclaim_file_page(region, vaddr, entry, batch);
+	}
+
+	return reclaim_anon_page(page_table, vaddr, entry);
+}
+
+// one pml1 window under the cursor, the caller holds the mm lock of the table
+static size_t reclaim_scan_window(struct page_table *page_table, size_t *budget) {
+	struct mmap_region *region = mmap_region_first_overlap(page_table, reclaim_cursor_vaddr, MMAP_MAP_MAX_ADDR);
+	if(region == NULL) {
+		reclaim_cursor = vmm_page_table_next(page_table);
+		reclaim_cursor_vaddr = 0;
+		return 0;
+	}
+
+	uintptr_t vaddr = region->base > reclaim_cursor_vaddr ? region->base : reclaim_cursor_vaddr;
+	uintptr_t end = (vaddr & ~(VMM_HUGE_PAGE_SIZE - 1)) + VMM_HUGE_PAGE_SIZE;
+
+	if(end > region->base + region->limit) {
+		end = region->base + region->limit;
+	}
+
+	reclaim_cursor_vaddr = end;
+	(*budget)--;
+
+	uint64_t *pml2_entry = vmm_pml2_entry(page_table, vaddr);
+	if(pml2_entry == NULL || (*pml2_entry & VMM_FLAGS_P) == 0 || (*pml2_entry & VMM_FLAGS_PS)) {
+		return 0;
+	}
+
+	uint64_t *pml1 = (uint64_t*)((*pml2_entry & VMM_PADDR_MASK) + HIGH_VMA);
+
+	struct tlb_batch batch;
+	tlb_batch_init(&batch, page_table);
+
+	size_t freed = 0;
+
+	for(; vaddr < end && *budget; vaddr += PAGE_SIZE, (*budget)--) {
+		freed += reclaim_entry(page_table, region, vaddr, &pml1[(vaddr >> 12) & 0x1ff], &batch);
+		RECLAIM_STAT_ADD(scanned, 1);
+	}
+
+	reclaim_cursor_vaddr = vaddr;
+
+	tlb_batch_flush(&batch);
+
+	return freed;
+}
+
+// a clock over every address space, one pml1 table at a time
+static size_t reclaim_scan(size_t cnt) {
+	size_t freed = 0;
+	size_t budget = RECLAIM_SCAN_BATCH;
+	size_t wraps = 0;
+
+	tlb_spinlock(&reclaim_lock);
+
+	while(freed < cnt && budget && wraps < 2) { // two laps age everything to the inactive list and past it
+		if(reclaim_cursor == NULL) {
+			reclaim_cursor = vmm_page_table_next(NULL);
+			reclaim_cursor_vaddr = 0;
+			wraps++;
+
+			if(reclaim_cursor == NULL) {
+				break;
+			}
+		}
+
+		struct page_table *page_table = reclaim_cursor;
+
+		if(__atomic_test_and_set(&page_table->mm_lock, __ATOMIC_ACQUIRE)) { // its owner is faulting or mapping
+			reclaim_cursor = vmm_page_table_next(page_table);
+			reclaim_cursor_vaddr = 0;
+			continue;
+		}
+
+		freed += reclaim_scan_window(page_table, &budget);
+
+		spinrelease(&page_table->mm_lock);
+	}
+
+	spinrelease(&reclaim_lock);
+
+	return freed;
+}
+
+// nothing else may touch user page tables while this runs, so interrupts stay off
+size_t reclaim_pages(size_t cnt) {
+	uint64_t rflags = interrupts_save();
+
+	size_t freed = pagecache_shrink(cnt);
+
+	if(freed < cnt) {
+		freed += reclaim_scan(cnt - freed);
+		pagecache_shrink(cnt); // whatever file pages the scan just unmapped
+	}
+
+	interrupts_restore(rflags);
+
+	return freed;
+}
+
+// allocations on behalf of userspace make room before giving up
+uint64_t reclaim_alloc(int flags) {
+	uint64_t paddr = pmm_alloc_flags(1, 1, flags);
+
+	for(size_t i = 0; paddr == (uint64_t)-1 && i < RECLAIM_DIRECT_TRIES; i++) {
+		RECLAIM_STAT_ADD(direct, 1);
+
+		reclaim_pages(RECLAIM_DIRECT_BATCH);
+		paddr = pmm_alloc_flags(1, 1, flags);
+	}
+
+	return paddr;
+}
+
+// the table is off the list already, once the cursor moves on no scan can reach it again
+void reclaim_page_table_release(struct page_table *page_table) {
+	uint64_t rflags = interrupts_save();
+	tlb_spinlock(&reclaim_lock);
+
+	if(reclaim_cursor == page_table) { // its neighbours could be gone as well, start over
+		reclaim_cursor = NULL;
+		reclaim_cursor_vaddr = 0;
+	}
+
+	spinrelease(&reclaim_lock);
+	interrupts_restore(rflags);
+}
+
+static void kswapd() {
+	for(;;) {
+		while(pmm_free_page_cnt() < reclaim_high) {
+			if(reclaim_pages(RECLAIM_KSWAPD_BATCH) == 0) {
+				break;
+			}
+		}
+
+		asm volatile ("cli");
+
+		sched_dequeue(kswapd_task, kswapd_thread);
+		kswapd_task->event_waiting = 1;
+
+		asm volatile ("sti");
+
+		while(kswapd_task->event_waiting) {
+			asm volatile ("hlt");
+		}
+	}
+}
+
+// called by the scheduler before it locks its run queue
+void reclaim_tick() {
+	if(kswapd_thread == NULL || ++kswapd_ticks < RECLAIM_TICK_INTERVAL) {
+		return;
+	}
+
+	kswapd_ticks = 0;
+
+	if(kswapd_thread->status == TASK_YIELD && pmm_free_page_cnt() < reclaim_low) {
+		sched_requeue(kswapd_task, kswapd_thread);
+
+		RECLAIM_STAT_ADD(kswapd_wakeups, 1);
+	}
+}
+
+void reclaim_init() {
+	size_t region_cnt = pmm_get_region_stats(NULL, 0);
+	struct pmm_region_stats *regions = alloc(sizeof(struct pmm_region_stats) * region_cnt);
+
+	region_cnt = pmm_get_region_stats(regions, region_cnt);
+
+	size_t total_pages = 0;
+	for(size_t i = 0; i < region_cnt; i++) {
+		total_pages += regions[i].pages;
+	}
+
+	free(regions);
+
+	reclaim_low = total_pages >> RECLAIM_LOW_SHIFT;
+	reclaim_high = total_pages >> RECLAIM_HIGH_SHIFT;
+
+	kswapd_task = sched_default_task();
+	kswapd_task->page_table = &kernel_mappings;
+
+	kswapd_thread = sched_default_thread(kswapd_task);
+
+	kswapd_thread->regs.cs = 0x28;
+	kswapd_thread->regs.ss = 0x30;
+	kswapd_thread->regs.rip = (uintptr_t)kswapd;
+	kswapd_thread->regs.rflags = 0x202;
+	kswapd_thread->regs.rsp = kswapd_thread->kernel_stack;
+
+	sched_requeue(kswapd_task, kswapd_thread);
+
+	print("reclaim: kswapd keeps %d to %d pages free\n", reclaim_low, reclaim_high);
+}
+
+void reclaim_get_stats(struct reclaim_stats *stats) {
+	*stats = reclaim_stats;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <mm/vmm.h>
+
+#define RECLAIM_LOW_SHIFT 7 // kswapd wakes once less than 1/128 of memory is free
+#define RECLAIM_HIGH_SHIFT 6 // and goes back to sleep past 1/64
+#define RECLAIM_TICK_INTERVAL 8 // bsp scheduler passes between watermark checks
+#define RECLAIM_SCAN_BATCH 4096 // ptes looked at per reclaim call
+#define RECLAIM_KSWAPD_BATCH 64
+#define RECLAIM_DIRECT_BATCH 32
+#define RECLAIM_DIRECT_TRIES 4
+
+struct reclaim_stats {
+	size_t scanned;
+	size_t activated;
+	size_t deactivated;
+	size_t file;
+	size_t anon;
+	size_t direct;
+	size_t kswapd_wakeups;
+};
+
+void reclaim_init();
+void reclaim_tick();
+size_t reclaim_pages(size_t cnt);
+uint64_t reclaim_alloc(int flags);
+void reclaim_page_table_release(struct page_table *page_table);
+void reclaim_get_stats(struct reclaim_stats *stats);
@@ -1,7 +1,9 @@
 #include <mm/pmm.h>
 #include <mm/slab.h>
+#include <mm/vmalloc.h>
 #include <cpu.h>
 #include <string.h>
+#include <debug.h>
 
 #define OBJECTS_PER_SLAB 256
 
@@ -14,6 +16,9 @@ struct cache {
 
 	const char *name;
 
+	int flags;
+	size_t percpu_index;
+
 	struct slab *slab_empty;
 	struct slab *slab_partial;
 	struct slab *slab_full;
@@ -26,8 +31,8 @@ struct cache {
 struct slab {
 	size_t available_objects;
 	size_t total_objects;
-	
-	uint8_t *bitmap;
+
+	void *free_list; // free objects are chained through their first qword
 	void *buffer;
 
 	struct cache *cache;
@@ -36,15 +41,34 @@ struct slab {
 };
 
 static struct cache *root_cache;
+static size_t percpu_cache_cnt;
+
+static void slab_init_free_list(struct slab *slab) {
+	slab->free_list = NULL;
+
+	for(size_t i = slab->total_objects; i > 0; i--) {
+		void *obj = slab->buffer + (i - 1) * slab->cache->object_size;
+		*(void**)obj = slab->free_list;
+		slab->free_list = obj;
+	}
+}
 
 static struct slab *cache_alloc_slab(struct cache *cache) {
 	struct slab *new_slab = (struct slab*)(pmm_alloc(cache->pages_per_slab, 1) + HIGH_VMA);
 
-	new_slab->bitmap = (uint8_t*)((uintptr_t)new_slab + sizeof(struct slab));
-	new_slab->buffer = (void*)(ALIGN_UP((uintptr_t)new_slab->bitmap + OBJECTS_PER_SLAB / 8 - HIGH_VMA, 16) + HIGH_VMA);
+	new_slab->buffer = (void*)(ALIGN_UP((uintptr_t)new_slab + sizeof(struct slab) - HIGH_VMA, 16) + HIGH_VMA);
 	new_slab->available_objects = OBJECTS_PER_SLAB;
 	new_slab->total_objects = OBJECTS_PER_SLAB;
 	new_slab->cache = cache;
+	new_slab->last = NULL;
+
+	cache->active_slabs++;
+
+	slab_init_free_list(new_slab);
+
+	for(size_t i = 0; i < cache->pages_per_slab; i++) {
+		pmm_frame((uintptr_t)new_slab - HIGH_VMA + i * PAGE_SIZE)->slab = new_slab;
+	}
 
 	if(cache->slab_empty)
 		cache->slab_empty->last = new_slab;
@@ -85,134 +109,158 @@ static int cache_move_slab(struct slab **dest_head, struct slab **src_head, stru
 	return 0;
 }
 
-static void *slab_alloc(struct slab *slab) {
-	for(size_t i = 0; i < slab->total_objects; i++) {
-		if(!BIT_TEST(slab->bitmap, i)) {
-			BIT_SET(slab->bitmap, i);
-			slab->available_objects--;
-			memset8(slab->buffer + (i * slab->cache->object_size), 0, slab->cache->object_size);
-			return slab->buffer + (i * slab->cache->object_size);
-		}
-	}
-
-	return NULL;
-}
-
-static void *cache_alloc_obj(struct cache *cache) {
-	struct slab *slab = NULL;
-
-	spinlock(&cache->lock);
+static void *cache_take_obj(struct cache *cache) {
+	struct slab **list = cache->slab_partial ? &cache->slab_partial : &cache->slab_empty;
 
-	if(cache->slab_partial) {
-		slab = cache->slab_partial;
-	} else if(cache->slab_empty) {
-		slab = cache->slab_empty;
+	if(*list == NULL) {
+		cache_alloc_slab(cache);
 	}
 
-	if(!slab) {
-		slab = cache_alloc_slab(cache);
-		cache->slab_empty = slab;
-	}
+	struct slab *slab = *list;
 
-	void *addr = slab_alloc(slab);
+	void *obj = slab->free_list;
+	slab->free_list = *(void**)obj;
+	slab->available_objects--;
 
 	if(slab->available_objects == 0) {
-		cache_move_slab(&cache->slab_full, &cache->slab_partial, slab);
-	} else if(slab->available_objects == (slab->total_objects - 1)) {
-		cache_move_slab(&cache->slab_partial, &cache->slab_empty, slab);
+		cache_move_slab(&cache->slab_full, list, slab);
+	} else if(list == &cache->slab_empty) {
+		cache_move_slab(&cache->slab_partial, list, slab);
 	}
 
-	spinrelease(&cache->lock);
-
-	return addr;
+	return obj;
 }
 
-static size_t slab_get_object_size(struct slab *slab, void *obj) {
-	if(!slab)
-		return 0;
-
-	spinlock(&slab->cache->lock);
+static void cache_put_obj(struct slab *slab, void *obj) {
+	struct cache *cache = slab->cache;
+	struct slab **list = slab->available_objects ? &cache->slab_partial : &cache->slab_full;
 
-	struct slab *root = slab;
+	*(void**)obj = slab->free_list;
+	slab->free_list = obj;
+	slab->available_objects++;
 
-	while(slab) {
-		if(slab->buffer <= obj && (slab->buffer + slab->cache->object_size * slab->total_objects) > obj) {
-			spinrelease(&root->cache->lock);
-			return slab->cache->object_size;
-		}
-		slab = slab->next;
+	if(slab->available_objects == slab->total_objects) {
+		cache_move_slab(&cache->slab_empty, list, slab);
+	} else if(list == &cache->slab_full) {
+		cache_move_slab(&cache->slab_partial, list, slab);
 	}
+}
 
-	spinrelease(&root->cache->lock);
+static struct slab *slab_lookup(void *obj) {
+	struct frame *frame = pmm_frame((uintptr_t)obj - HIGH_VMA);
+	if(frame == NULL) {
+		return NULL;
+	}
 
-	return 0;
+	return frame->slab;
 }
 
-static size_t cache_get_object_size(struct cache *cache, void *obj) {
-	size_t partial_object_size = slab_get_object_size(cache->slab_partial, obj);
-	if(partial_object_size) {
-		return partial_object_size;
+static struct slab_magazine *cache_magazine(struct cache *cache) {
+	if(!(cache->flags & SLAB_CACHE_PERCPU)) {
+		return NULL;
 	}
 
-	size_t full_object_size = slab_get_object_size(cache->slab_full, obj);
-	if(full_object_size) {
-		return full_object_size;
+	struct cpu_local *cpu_local = CORE_LOCAL;
+	if(cpu_local == NULL || cpu_local->slab_magazines == NULL) { // too early in boot
+		return NULL;
 	}
 
-	return 0;
+	return &cpu_local->slab_magazines[cache->percpu_index];
 }
 
-static int slab_free_object(struct slab *slab, void *obj) {
-	if(slab == NULL)
-		return 0;
+static void *cache_alloc_obj(struct cache *cache) {
+	uint64_t rflags = interrupts_save();
+
+	struct slab_magazine *magazine = cache_magazine(cache);
+	void *obj;
+
+	if(magazine == NULL) {
+		spinlock(&cache->lock);
+		obj = cache_take_obj(cache);
+		spinrelease(&cache->lock);
+	} else {
+		if(magazine->cnt == 0) {
+			spinlock(&cache->lock);
+			while(magazine->cnt < SLAB_MAGAZINE_BATCH) {
+				magazine->objects[magazine->cnt++] = cache_take_obj(cache);
+			}
+			spinrelease(&cache->lock);
+		}
 
-	spinlock(&slab->cache->lock);
+		obj = magazine->objects[--magazine->cnt];
+	}
 
-	struct slab *root = slab;
+	interrupts_restore(rflags);
 
-	while(slab) {
-		if(slab->buffer <= obj && (slab->buffer + slab->cache->object_size * slab->total_objects) > obj) {
-			size_t index = ((uintptr_t)obj - (uintptr_t)slab->buffer) / slab->cache->object_size;
-			BIT_CLEAR(slab->bitmap, index);
-			slab->available_objects++;
-			spinrelease(&root->cache->lock);
-			return 1;
-		}
+	memset8(obj, 0, cache->object_size);
 
-		slab = slab->next;
+	return obj;
+}
+
+static void cache_free_obj(struct slab *slab, void *obj) {
+	struct cache *cache = slab->cache;
+
+	if(obj < slab->buffer || obj >= slab->buffer + cache->object_size * slab->total_objects ||
+		((uintptr_t)obj - (uintptr_t)slab->buffer) % cache->object_size) {
+		return;
 	}
 
-	spinrelease(&root->cache->lock);
+	uint64_t rflags = interrupts_save();
 
-	return 0;
-}
+	struct slab_magazine *magazine = cache_magazine(cache);
+
+	if(magazine == NULL) {
+		spinlock(&cache->lock);
+		cache_put_obj(slab, obj);
+		spinrelease(&cache->lock);
+	} else {
+		if(magazine->cnt == SLAB_MAGAZINE_CAPACITY) { // give the coldest objects back to their slabs
+			spinlock(&cache->lock);
+			for(size_t i = 0; i < SLAB_MAGAZINE_BATCH; i++) {
+				cache_put_obj(slab_lookup(magazine->objects[i]), magazine->objects[i]);
+			}
+			spinrelease(&cache->lock);
+
+			memcpy64((uint64_t*)magazine->objects, (uint64_t*)magazine->objects + SLAB_MAGAZINE_BATCH, SLAB_MAGAZINE_CAPACITY - SLAB_MAGAZINE_BATCH);
+			magazine->cnt -= SLAB_MAGAZINE_BATCH;
+		}
 
-static int cache_free_object(struct cache *cache, void *obj) {
-	if(slab_free_object(cache->slab_partial, obj)) {
-		return 1;
-	} else if(slab_free_object(cache->slab_full, obj)) {
-		return 1;
+		magazine->objects[magazine->cnt++] = obj;
 	}
-	return 0;
+
+	interrupts_restore(rflags);
 }
 
-void slab_cache_create(const char *name, size_t object_size) {
+void slab_cache_create(const char *name, size_t object_size, int flags) {
 	struct cache cache = { 0 };
 
-	cache.pages_per_slab = DIV_ROUNDUP(object_size * OBJECTS_PER_SLAB + sizeof(struct slab) + OBJECTS_PER_SLAB / 8, PAGE_SIZE);
+	cache.pages_per_slab = DIV_ROUNDUP(object_size * OBJECTS_PER_SLAB + sizeof(struct slab) + 16, PAGE_SIZE);
 	cache.object_size = object_size;
 	cache.name = name;
 
+	if(flags & SLAB_CACHE_PERCPU) {
+		if(percpu_cache_cnt == SLAB_PERCPU_CACHES_MAX) {
+			print("slab: out of per-cpu magazine slots for %s\n", name);
+			flags &= ~SLAB_CACHE_PERCPU;
+		} else {
+			cache.percpu_index = percpu_cache_cnt++;
+		}
+	}
+
+	cache.flags = flags;
+
 	struct slab *root_slab = cache_alloc_slab(&cache);
 
 	*(struct cache*)root_slab->buffer = cache;
 	struct cache *new_cache = (struct cache*)root_slab->buffer;
 
 	root_slab->cache = new_cache;
-	root_slab->buffer += sizeof(struct cache);
-	root_slab->available_objects -= DIV_ROUNDUP(object_size, sizeof(struct cache));
+	root_slab->buffer += ALIGN_UP(sizeof(struct cache), 16);
+	root_slab->available_objects -= DIV_ROUNDUP(ALIGN_UP(sizeof(struct cache), 16), object_size);
 	root_slab->total_objects = root_slab->available_objects;
 
+	slab_init_free_list(root_slab);
+
 	new_cache->slab_empty = root_slab;
 	new_cache->next = root_cache;
 
@@ -223,7 +271,7 @@ void *alloc(size_t size) {
 	if(!size)
 		return NULL;
 
-	size_t round_size = pow2_roundup(size + 1);
+	size_t round_size = pow2_roundup(size);
 	if(round_size <= 16) {
 		round_size = 32;
 	}
@@ -237,21 +285,24 @@ void *alloc(size_t size) {
 		cache = cache->next;
 	}
 
-	return NULL;
+	return vmalloc(size); // too big for any cache
 }
 
 void free(void *obj) {
 	if(!obj)
 		return;
 
-	struct cache *cache = root_cache;
+	if(vmalloc_owns(obj)) {
+		vfree(obj);
+		return;
+	}
 
-	while(cache) {
-		if(cache_free_object(cache, obj)) {
-			return;
-		}
-		cache = cache->next;
+	struct slab *slab = slab_lookup(obj);
+	if(slab == NULL) {
+		return;
 	}
+
+	cache_free_obj(slab, obj);
 }
 
 void *realloc(void *obj, size_t size) {
@@ -259,14 +310,15 @@ void *realloc(void *obj, size_t size) {
 		return alloc(size);
 	}
 
-	struct cache *cache = root_cache;
 	size_t object_size = 0;
 
-	while(cache) {
-		object_size = cache_get_object_size(cache, obj);	
-		if(object_size)
-			break;
-		cache = cache->next;
+	if(vmalloc_owns(obj)) {
+		object_size = vmalloc_size(obj);
+	} else {
+		struct slab *slab = slab_lookup(obj);
+		if(slab) {
+			object_size = slab->cache->object_size;
+		}
 	}
 
 	if(object_size >= size) {
@@ -279,3 +331,129 @@ void *realloc(void *obj, size_t size) {
 
 	return ret;
 }
+
+static void slab_list_stats(struct slab *slab, struct slab_cache_stats *stats) {
+	for(; slab; slab = slab->next) {
+		stats->total_objects += slab->total_objects;
+		stats->active_objects += slab->total_objects - slab->available_objects;
+	}
+}
+
+size_t slab_get_stats(struct slab_cache_stats *stats, size_t cnt) {
+	size_t cache_cnt = 0;
+
+	for(struct cache *cache = root_cache; cache; cache = cache->next, cache_cnt++) {
+		if(cache_cnt >= cnt) {
+			continue;
+		}
+
+		struct slab_cache_stats *cache_stats = &stats[cache_cnt];
+
+		*cache_stats = (struct slab_cache_stats) {
+			.name = cache->name,
+			.object_size = cache->object_size,
+			.pages_per_slab = cache->pages_per_slab
+		};
+
+		spinlock(&cache->lock);
+
+		cache_stats->slabs = cache->active_slabs;
+
+		slab_list_stats(cache->slab_empty, cache_stats);
+		slab_list_stats(cache->slab_partial, cache_stats);
+		slab_list_stats(cache->slab_full, cache_stats);
+
+		spinrelease(&cache->lock);
+
+		if(cache->flags & SLAB_CACHE_PERCPU) {
+			for(size_t i = 0; i < cpu_local_list.length; i++) {
+				cache_stats->cached_objects += cpu_local_list.data[i]->slab_magazines[cache->percpu_index].cnt;
+			}
+		}
+
+		cache_stats->active_objects -= cache_stats->cached_objects;
+		cache_stats->overhead = cache_stats->slabs * cache->pages_per_slab * PAGE_SIZE - cache_stats->total_objects * cache->object_size;
+	}
+
+	return cache_cnt;
+}
+
+#ifdef SLAB_BENCHMARK
+
+#define SLAB_BENCHMARK_OBJECTS 100000
+
+static struct slab *slab_list_find(struct slab *slab, void *obj) {
+	for(; slab; slab = slab->next) {
+		if(slab->buffer <= obj && (slab->buffer + slab->cache->object_size * slab->total_objects) > obj) {
+			return slab;
+		}
+	}
+
+	return NULL;
+}
+
+// the lookup free() used to do: walk every slab of every cache
+static struct slab *slab_linear_lookup(void *obj) {
+	for(struct cache *cache = root_cache; cache; cache = cache->next) {
+		struct slab *slab = slab_list_find(cache->slab_partial, obj);
+		if(slab == NULL) {
+			slab = slab_list_find(cache->slab_full, obj);
+		}
+
+		if(slab) {
+			return slab;
+		}
+	}
+
+	return NULL;
+}
+
+void slab_benchmark() {
+	size_t table_pages = DIV_ROUNDUP(SLAB_BENCHMARK_OBJECTS * sizeof(void*), PAGE_SIZE);
+	void **objects = (void**)(pmm_alloc(table_pages, 1) + HIGH_VMA);
+	uint64_t seed = rdtsc() | 1;
+
+	for(size_t i = 0; i < SLAB_BENCHMARK_OBJECTS; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+
+		objects[i] = alloc(16 << (seed % 6));
+	}
+
+	uint64_t start = rdtsc();
+	for(size_t i = 0; i < SLAB_BENCHMARK_OBJECTS; i++) {
+		if(slab_linear_lookup(objects[i]) == NULL) {
+			panic("slab: benchmark lost object %x\n", objects[i]);
+		}
+	}
+	uint64_t linear_cycles = rdtsc() - start;
+
+	for(size_t i = 0; i < SLAB_BENCHMARK_OBJECTS; i++) {
+		if(slab_lookup(objects[i]) != slab_linear_lookup(objects[i])) {
+			panic("slab: reverse map disagrees for object %x\n", objects[i]);
+		}
+	}
+
+	start = rdtsc();
+	for(size_t i = 0; i < SLAB_BENCHMARK_OBJECTS; i++) {
+		slab_lookup(objects[i]);
+	}
+	uint64_t lookup_cycles = rdtsc() - start;
+
+	start = rdtsc();
+	for(size_t i = 0; i < SLAB_BENCHMARK_OBJECTS; i++) {
+		free(objects[i]);
+	}
+	uint64_t free_cycles = rdtsc() - start;
+
+	pmm_free((uintptr_t)objects - HIGH_VMA, table_pages);
+
+	print("slab: benchmark with %d live objects: linear lookup %d cycles/op, reverse map lookup %d cycles/op, free %d cycles/op\n",
+		SLAB_BENCHMARK_OBJECTS,
+		linear_cycles / SLAB_BENCHMARK_OBJECTS,
+		lookup_cycles / SLAB_BENCHMARK_OBJECTS,
+		free_cycles / SLAB_BENCHMARK_OBJECTS);
+}
+
+#endif
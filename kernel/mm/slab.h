@@ -3,7 +3,31 @@
 #include <stdint.h>
 #include <stddef.h>
 
-void slab_cache_create(const char *name, size_t object_size);
+#define SLAB_CACHE_PERCPU (1 << 0)
+
+#define SLAB_PERCPU_CACHES_MAX 8
+#define SLAB_MAGAZINE_CAPACITY 32
+#define SLAB_MAGAZINE_BATCH 16
+
+struct slab_magazine {
+	void *objects[SLAB_MAGAZINE_CAPACITY];
+	size_t cnt;
+};
+
+struct slab_cache_stats {
+	const char *name;
+	size_t object_size;
+	size_t pages_per_slab;
+	size_t slabs;
+	size_t total_objects;
+	size_t active_objects;
+	size_t cached_objects; // sitting in per-cpu magazines
+	size_t overhead; // slab bytes that never hold an object
+};
+
+void slab_cache_create(const char *name, size_t object_size, int flags);
+size_t slab_get_stats(struct slab_cache_stats *stats, size_t cnt);
 void *alloc(size_t cnt);
 void *realloc(void *obj, size_t size);
 void free(void *obj);
+void slab_benchmark();
@@ -0,0 +1,148 @@
+#include <mm/swap.h>
+#include <mm/reclaim.h>
+#include <mm/pmm.h>
+#include <fs/vfs.h>
+#include <string.h>
+#include <cpu.h>
+#include <debug.h>
+
+#define SWAP_STAT_ADD(FIELD, VALUE) __atomic_add_fetch(&swap_stats.FIELD, VALUE, __ATOMIC_RELAXED)
+
+static struct swap_area swap_area;
+static struct swap_stats swap_stats;
+
+// every page of the backing file is written once up front, swapping out must never need memory itself
+int swap_on(const char *path, size_t slots) {
+	struct vfs_node *node = vfs_search_absolute(NULL, path, true);
+	if(node == NULL || slots < 2) {
+		return -1;
+	}
+
+	struct asset *asset = node->asset;
+	if(asset->read == NULL || asset->write == NULL || swap_area.asset) {
+		return -1;
+	}
+
+	uint64_t zero = pmm_alloc(1, 1);
+	if(zero == (uint64_t)-1) {
+		return -1;
+	}
+
+	for(size_t i = 0; i < slots; i++) {
+		if(asset->write(asset, NULL, i * PAGE_SIZE, PAGE_SIZE, (void*)(zero + HIGH_VMA)) != PAGE_SIZE) {
+			pmm_free(zero, 1);
+			return -1;
+		}
+	}
+
+	pmm_free(zero, 1);
+
+	spinlock(&swap_area.lock);
+
+	swap_area.refcnt = alloc(sizeof(uint32_t) * slots);
+	swap_area.slots = slots;
+	swap_area.used = 0;
+	swap_area.hint = 1;
+	swap_area.asset = asset;
+
+	spinrelease(&swap_area.lock);
+
+	print("swap: %s holds %d pages\n", path, slots - 1);
+
+	return 0;
+}
+
+static uint64_t swap_alloc() {
+	spinlock(&swap_area.lock);
+
+	for(size_t i = 0; i < swap_area.slots - 1; i++) {
+		size_t slot = (swap_area.hint + i - 1) % (swap_area.slots - 1) + 1;
+
+		if(swap_area.refcnt[slot] == 0) {
+			swap_area.refcnt[slot] = 1;
+			swap_area.used++;
+			swap_area.hint = slot + 1;
+
+			spinrelease(&swap_area.lock);
+			return slot;
+		}
+	}
+
+	spinrelease(&swap_area.lock);
+
+	return -1;
+}
+
+// the caller has made sure nothing can store to the frame anymore
+uint64_t swap_out(uint64_t paddr) {
+	if(swap_area.asset == NULL) {
+		return -1;
+	}
+
+	uint64_t slot = swap_alloc();
+	if(slot == (uint64_t)-1) {
+		return -1;
+	}
+
+	struct asset *asset = swap_area.asset;
+
+	if(asset->write(asset, NULL, slot * PAGE_SIZE, PAGE_SIZE, (void*)(paddr + HIGH_VMA)) != PAGE_SIZE) {
+		swap_free(slot);
+		return -1;
+	}
+
+	SWAP_STAT_ADD(outs, 1);
+
+	return slot;
+}
+
+int swap_fault(uint64_t *entry, uintptr_t vaddr) {
+	uint64_t pte = *entry;
+	uint64_t slot = SWAP_SLOT(pte);
+
+	uint64_t paddr = reclaim_alloc(PMM_ALLOC_NOZERO);
+	if(paddr == (uint64_t)-1) {
+		return 0;
+	}
+
+	struct asset *asset = swap_area.asset;
+
+	if(asset->read(asset, NULL, slot * PAGE_SIZE, PAGE_SIZE, (void*)(paddr + HIGH_VMA)) != PAGE_SIZE) {
+		pmm_free(paddr, 1);
+		return 0;
+	}
+
+	*entry = paddr | (pte & ~(VMM_PADDR_MASK | VMM_SWAP_FLAG)) | VMM_FLAGS_P;
+	pmm_frame_map(paddr, FRAME_ANON);
+
+	invlpg(vaddr);
+
+	swap_free(slot);
+
+	SWAP_STAT_ADD(ins, 1);
+
+	return 1;
+}
+
+void swap_dup(uint64_t slot) {
+	spinlock(&swap_area.lock);
+	swap_area.refcnt[slot]++;
+	spinrelease(&swap_area.lock);
+}
+
+void swap_free(uint64_t slot) {
+	spinlock(&swap_area.lock);
+
+	if(--swap_area.refcnt[slot] == 0) {
+		swap_area.used--;
+	}
+
+	spinrelease(&swap_area.lock);
+}
+
+void swap_get_stats(struct swap_stats *stats) {
+	*stats = swap_stats;
+
+	stats->slots = swap_area.slots ? swap_area.slots - 1 : 0;
+	stats->used = swap_area.used;
+}
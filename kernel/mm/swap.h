@@ -0,0 +1,33 @@
+#pragma once
+
+#include <mm/vmm.h>
+
+#define SWAP_TEST_PAGES 0x4000 // 64 MiB ramfs swap file with SWAP_TEST
+
+// slot 0 is never handed out so a swap pte can not be mistaken for a pending file pte
+#define SWAP_SLOT(ENTRY) (((ENTRY) & VMM_PADDR_MASK) >> 12)
+#define SWAP_ENTRY(SLOT, ENTRY) (((uint64_t)(SLOT) << 12) | VMM_SWAP_FLAG | \
+	((ENTRY) & ~(VMM_PADDR_MASK | VMM_FLAGS_P | VMM_FLAGS_A | VMM_FLAGS_D | VMM_INACTIVE_FLAG)))
+
+struct swap_area {
+	struct asset *asset;
+	size_t slots;
+	uint32_t *refcnt; // ptes pointing at each slot, forks share them
+	size_t used;
+	size_t hint;
+	char lock;
+};
+
+struct swap_stats {
+	size_t slots;
+	size_t used;
+	size_t ins;
+	size_t outs;
+};
+
+int swap_on(const char *path, size_t slots);
+uint64_t swap_out(uint64_t paddr);
+int swap_fault(uint64_t *entry, uintptr_t vaddr);
+void swap_dup(uint64_t slot);
+void swap_free(uint64_t slot);
+void swap_get_stats(struct swap_stats *stats);
@@ -0,0 +1,343 @@
+#include <mm/thp.h>
+#include <mm/vmm.h>
+#include <mm/pmm.h>
+#include <mm/mmap.h>
+#include <mm/tlb.h>
+#include <sched/sched.h>
+#include <string.h>
+#include <cpu.h>
+#include <debug.h>
+
+#define THP_MASK (VMM_HUGE_PAGE_SIZE - 1)
+#define THP_STAT_ADD(FIELD, VALUE) __atomic_add_fetch(&thp_stats.FIELD, VALUE, __ATOMIC_RELAXED)
+#define THP_STAT_SUB(FIELD, VALUE) __atomic_sub_fetch(&thp_stats.FIELD, VALUE, __ATOMIC_RELAXED)
+
+static struct thp_stats thp_stats;
+static char thp_lock;
+
+static struct page_table *thp_cursor;
+
+static struct sched_task *khugepaged_task;
+static struct sched_thread *khugepaged_thread;
+static size_t khugepaged_ticks;
+
+static bool thp_region_eligible(struct mmap_region *region, uintptr_t base) {
+	if(region->node || (region->flags & MMAP_MAP_SHARED)) { // only private anonymous memory
+		return false;
+	}
+
+	return base >= region->base && base + VMM_HUGE_PAGE_SIZE <= region->base + region->limit;
+}
+
+static void thp_frames_map(uint64_t paddr) {
+	for(size_t i = 0; i < VMM_HUGE_PAGE_PAGES; i++) {
+		pmm_frame_map(paddr + i * PAGE_SIZE, FRAME_ANON);
+	}
+}
+
+static void thp_frames_unmap(uint64_t paddr) {
+	for(size_t i = 0; i < VMM_HUGE_PAGE_PAGES; i++) {
+		pmm_frame_unmap(paddr + i * PAGE_SIZE);
+	}
+}
+
+int thp_anon_fault(struct page_table *page_table, struct mmap_region *region, uintptr_t address, uint64_t flags) {
+	uintptr_t base = address & ~THP_MASK;
+
+	if((flags & VMM_FLAGS_P) == 0 || !thp_region_eligible(region, base)) {
+		return 0;
+	}
+
+	uint64_t *pml2_entry = vmm_pml2_entry(page_table, base);
+	if(pml2_entry && *pml2_entry) { // 4 KiB pages already live in this window, leave it to the collapse scan
+		return 0;
+	}
+
+	uint64_t paddr = pmm_alloc(VMM_HUGE_PAGE_PAGES, VMM_HUGE_PAGE_PAGES);
+	if(paddr == (uint64_t)-1) {
+		THP_STAT_ADD(fallbacks, 1);
+		return 0;
+	}
+
+	page_table->map_page(page_table, base, paddr, flags | VMM_FLAGS_PS);
+	thp_frames_map(paddr);
+
+	THP_STAT_ADD(faults, 1);
+	THP_STAT_ADD(mapped, 1);
+
+	return 1;
+}
+
+// returns 1 once split, 0 when there is no huge page and -1 when the pml1 table can not be allocated
+int thp_split(struct page_table *page_table, uintptr_t vaddr) {
+	uintptr_t base = vaddr & ~THP_MASK;
+
+	uint64_t *pml2_entry = vmm_pml2_entry(page_table, base);
+	if(pml2_entry == NULL || (*pml2_entry & VMM_FLAGS_PS) == 0) {
+		return 0;
+	}
+
+	uint64_t entry = *pml2_entry;
+	uint64_t paddr = entry & VMM_PADDR_MASK;
+	uint64_t flags = entry & ~(VMM_PADDR_MASK | VMM_FLAGS_PS);
+
+	uint64_t table = pmm_alloc(1, 1);
+	if(table == (uint64_t)-1) {
+		return -1;
+	}
+
+	uint64_t *pml1 = (uint64_t*)(table + HIGH_VMA);
+
+	for(size_t i = 0; i < VMM_HUGE_PAGE_PAGES; i++) { // the frames keep their counts, only the mapping changes shape
+		pml1[i] = (paddr + i * PAGE_SIZE) | flags;
+	}
+
+	*pml2_entry = table | VMM_FLAGS_P | VMM_FLAGS_RW | VMM_FLAGS_US;
+
+	tlb_invalidate(page_table, base);
+
+	THP_STAT_ADD(splits, 1);
+	THP_STAT_SUB(mapped, 1);
+
+	return 1;
+}
+
+// returns 0 when the page was split instead and the 4 KiB path has to copy it, -1 when even that failed
+int thp_cow(struct page_table *page_table, uint64_t *pml2_entry, uintptr_t address) {
+	uintptr_t base = address & ~THP_MASK;
+
+	uint64_t entry = *pml2_entry;
+	uint64_t original = entry & VMM_PADDR_MASK;
+	uint64_t flags = (entry & ~(VMM_PADDR_MASK | VMM_COW_FLAG)) | VMM_FLAGS_RW;
+
+	bool shared = false;
+
+	for(size_t i = 0; i < VMM_HUGE_PAGE_PAGES; i++) {
+		struct frame *frame = pmm_frame(original + i * PAGE_SIZE);
+		if(frame && frame->refcnt > 1) {
+			shared = true;
+			break;
+		}
+	}
+
+	if(shared == false) {
+		*pml2_entry = original | flags;
+		invlpg(base);
+		return 1;
+	}
+
+	uint64_t copy = pmm_alloc_flags(VMM_HUGE_PAGE_PAGES, VMM_HUGE_PAGE_PAGES, PMM_ALLOC_NOZERO);
+	if(copy == (uint64_t)-1) { // break it up and let the 4 KiB path copy just the one page
+		THP_STAT_ADD(fallbacks, 1);
+		return thp_split(page_table, base) == -1 ? -1 : 0;
+	}
+
+	memcpy64((uint64_t*)(copy + HIGH_VMA), (uint64_t*)(original + HIGH_VMA), VMM_HUGE_PAGE_SIZE / 8);
+	thp_frames_map(copy);
+
+	*pml2_entry = copy | flags;
+
+	tlb_invalidate(page_table, base);
+	thp_frames_unmap(original);
+
+	THP_STAT_ADD(copies, 1);
+
+	return 1;
+}
+
+int thp_unmap(struct page_table *page_table, uint64_t *pml2_entry, uintptr_t vaddr, uintptr_t base, size_t length, struct tlb_batch *batch) {
+	uintptr_t huge = vaddr & ~THP_MASK;
+
+	if(huge < base || huge + VMM_HUGE_PAGE_SIZE > base + length) { // partial unmap
+		return thp_split(page_table, vaddr) == -1 ? -1 : 0;
+	}
+
+	uint64_t paddr = *pml2_entry & VMM_PADDR_MASK;
+	*pml2_entry = 0;
+
+	tlb_batch_add(batch, huge);
+	tlb_batch_add_frames(batch, paddr, VMM_HUGE_PAGE_PAGES);
+
+	THP_STAT_SUB(mapped, 1);
+
+	return 1;
+}
+
+static int thp_collapse_window(struct page_table *page_table, uintptr_t base) {
+	uint64_t *pml2_entry = vmm_pml2_entry(page_table, base);
+	if(pml2_entry == NULL || (*pml2_entry & VMM_FLAGS_P) == 0 || (*pml2_entry & VMM_FLAGS_PS)) {
+		return 0;
+	}
+
+	uint64_t *pml1 = (uint64_t*)((*pml2_entry & VMM_PADDR_MASK) + HIGH_VMA);
+	uint64_t ignored = VMM_PADDR_MASK | VMM_FLAGS_A | VMM_FLAGS_D | VMM_INACTIVE_FLAG;
+	uint64_t flags = pml1[0] & ~ignored;
+
+	if((flags & VMM_FLAGS_P) == 0 || (flags & (VMM_COW_FLAG | VMM_FILE_FLAG | VMM_SHARE_FLAG))) {
+		return 0;
+	}
+
+	for(size_t i = 0; i < VMM_HUGE_PAGE_PAGES; i++) { // every page resident, same protection, owned by nobody else
+		if((pml1[i] & ~ignored) != flags) {
+			return 0;
+		}
+
+		struct frame *frame = pmm_frame(pml1[i] & VMM_PADDR_MASK);
+		if(frame == NULL || frame->refcnt != 1) {
+			return 0;
+		}
+	}
+
+	uint64_t huge = pmm_alloc_flags(VMM_HUGE_PAGE_PAGES, VMM_HUGE_PAGE_PAGES, PMM_ALLOC_NOZERO);
+	if(huge == (uint64_t)-1) {
+		return 0;
+	}
+
+	// the owner keeps running elsewhere, faults on the window wait on mm_lock and no stale tlb entry can write after the flush
+	uint64_t table = *pml2_entry & VMM_PADDR_MASK;
+	*pml2_entry = 0;
+
+	tlb_flush(page_table);
+
+	for(size_t i = 0; i < VMM_HUGE_PAGE_PAGES; i++) {
+		memcpy64((uint64_t*)(huge + i * PAGE_SIZE + HIGH_VMA), (uint64_t*)((pml1[i] & VMM_PADDR_MASK) + HIGH_VMA), PAGE_SIZE / 8);
+	}
+
+	thp_frames_map(huge);
+
+	*pml2_entry = huge | flags | VMM_FLAGS_PS | VMM_FLAGS_A | VMM_FLAGS_D;
+
+	for(size_t i = 0; i < VMM_HUGE_PAGE_PAGES; i++) {
+		pmm_frame_unmap(pml1[i] & VMM_PADDR_MASK);
+	}
+
+	pmm_free(table, 1);
+
+	THP_STAT_ADD(collapses, 1);
+	THP_STAT_ADD(mapped, 1);
+
+	return 1;
+}
+
+// in order walk from the cursor, returns 1 once the scan budget is used up
+static int thp_collapse_scan(struct page_table *page_table, struct mmap_region *region, size_t *budget) {
+	if(region == NULL) {
+		return 0;
+	}
+
+	if(region->base + region->limit > page_table->thp_scan_cursor && thp_collapse_scan(page_table, region->left, budget)) {
+		return 1;
+	}
+
+	uintptr_t base = region->base > page_table->thp_scan_cursor ? region->base : page_table->thp_scan_cursor;
+	base = ALIGN_UP(base, VMM_HUGE_PAGE_SIZE);
+
+	for(; thp_region_eligible(region, base); base += VMM_HUGE_PAGE_SIZE) {
+		page_table->thp_scan_cursor = base + VMM_HUGE_PAGE_SIZE;
+
+		if(thp_collapse_window(page_table, base) || --(*budget) == 0) { // one copy per batch is plenty
+			return 1;
+		}
+	}
+
+	return thp_collapse_scan(page_table, region->right, budget);
+}
+
+// walks every address space in turn, the per table cursor remembers where the last batch stopped
+static void thp_collapse(size_t budget) {
+	while(budget) {
+		if(thp_cursor == NULL) {
+			thp_cursor = vmm_page_table_next(NULL);
+			if(thp_cursor == NULL) {
+				break;
+			}
+		}
+
+		struct page_table *page_table = thp_cursor;
+
+		if(__atomic_test_and_set(&page_table->mm_lock, __ATOMIC_ACQUIRE)) { // its owner is faulting or mapping
+			thp_cursor = vmm_page_table_next(page_table);
+			budget--;
+			continue;
+		}
+
+		int stopped = thp_collapse_scan(page_table, page_table->mmap_region_root, &budget);
+
+		if(stopped == 0) {
+			page_table->thp_scan_cursor = 0; // wrapped around, the next lap starts over
+			thp_cursor = vmm_page_table_next(page_table);
+		}
+
+		spinrelease(&page_table->mm_lock);
+
+		if(stopped) { // out of budget or a window was copied
+			break;
+		}
+	}
+}
+
+void thp_page_table_release(struct page_table *page_table) {
+	uint64_t rflags = interrupts_save();
+	tlb_spinlock(&thp_lock);
+
+	if(thp_cursor == page_table) { // its neighbours could be gone as well, start over
+		thp_cursor = NULL;
+	}
+
+	spinrelease(&thp_lock);
+	interrupts_restore(rflags);
+}
+
+static void khugepaged() {
+	for(;;) {
+		asm volatile ("cli");
+		tlb_spinlock(&thp_lock);
+
+		thp_collapse(THP_COLLAPSE_SCAN);
+
+		spinrelease(&thp_lock);
+
+		sched_dequeue(khugepaged_task, khugepaged_thread);
+		khugepaged_task->event_waiting = 1;
+
+		asm volatile ("sti");
+
+		while(khugepaged_task->event_waiting) {
+			asm volatile ("hlt");
+		}
+	}
+}
+
+// called by the scheduler before it locks its run queue
+void thp_collapse_tick() {
+	if(khugepaged_thread == NULL || ++khugepaged_ticks < THP_COLLAPSE_INTERVAL) {
+		return;
+	}
+
+	khugepaged_ticks = 0;
+
+	if(khugepaged_thread->status == TASK_YIELD) {
+		sched_requeue(khugepaged_task, khugepaged_thread);
+	}
+}
+
+void thp_init() {
+	khugepaged_task = sched_default_task();
+	khugepaged_task->page_table = &kernel_mappings;
+
+	khugepaged_thread = sched_default_thread(khugepaged_task);
+
+	khugepaged_thread->regs.cs = 0x28;
+	khugepaged_thread->regs.ss = 0x30;
+	khugepaged_thread->regs.rip = (uintptr_t)khugepaged;
+	khugepaged_thread->regs.rflags = 0x202;
+	khugepaged_thread->regs.rsp = khugepaged_thread->kernel_stack;
+
+	sched_requeue(khugepaged_task, khugepaged_thread);
+
+	print("thp: khugepaged looks at %d windows every %d ticks\n", THP_COLLAPSE_SCAN, THP_COLLAPSE_INTERVAL);
+}
+
+void thp_get_stats(struct thp_stats *stats) {
+	*stats = thp_stats;
+}
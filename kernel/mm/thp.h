@@ -0,0 +1,25 @@
+#pragma once
+
+#include <mm/vmm.h>
+#include <mm/tlb.h>
+
+#define THP_COLLAPSE_INTERVAL 50 // bsp scheduler passes between khugepaged batches, none while it idles
+#define THP_COLLAPSE_SCAN 32 // windows looked at per batch
+
+struct thp_stats {
+	size_t mapped;
+	size_t faults;
+	size_t fallbacks;
+	size_t splits;
+	size_t collapses;
+	size_t copies;
+};
+
+int thp_anon_fault(struct page_table *page_table, struct mmap_region *region, uintptr_t address, uint64_t flags);
+int thp_cow(struct page_table *page_table, uint64_t *pml2_entry, uintptr_t address);
+int thp_split(struct page_table *page_table, uintptr_t vaddr);
+int thp_unmap(struct page_table *page_table, uint64_t *pml2_entry, uintptr_t vaddr, uintptr_t base, size_t length, struct tlb_batch *batch);
+void thp_init();
+void thp_collapse_tick();
+void thp_page_table_release(struct page_table *page_table);
+void thp_get_stats(struct thp_stats *stats);
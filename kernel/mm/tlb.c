@@ -0,0 +1,314 @@
+#include <mm/tlb.h>
+#include <mm/vmm.h>
+#include <mm/pmm.h>
+#include <sched/smp.h>
+#include <int/apic.h>
+#include <int/idt.h>
+#include <string.h>
+#include <cpu.h>
+#include <debug.h>
+
+struct tlb_shootdown {
+	struct tlb_batch *batch;
+	uint64_t pending;
+};
+
+static bool tlb_pcid;
+static int tlb_shootdown_vector = -1;
+
+static uint8_t tlb_pcid_map[TLB_PCID_CNT / 8];
+static size_t tlb_pcid_hint = 1;
+static char tlb_pcid_lock;
+
+static struct tlb_shootdown tlb_shootdown_request;
+static char tlb_shootdown_lock;
+
+static uint64_t tlb_online_cpus;
+
+static inline uint64_t tlb_cpu_bit() {
+	struct cpu_local *cpu_local = CORE_LOCAL;
+	return cpu_local ? 1ull << cpu_local->cpu_number : 0;
+}
+
+// page tables without a cpu_local (before boot_aps) are treated as loaded
+static inline bool tlb_loaded(struct page_table *page_table) {
+	struct cpu_local *cpu_local = CORE_LOCAL;
+	return cpu_local == NULL || cpu_local->tlb_page_table == page_table;
+}
+
+static void tlb_flush_local(struct tlb_batch *batch) {
+	if(batch->full == false) {
+		for(size_t i = 0; i < batch->cnt; i++) {
+			invlpg(batch->vaddrs[i]);
+		}
+		return;
+	}
+
+	if(batch->page_table == &kernel_mappings) { // global entries survive cr3 writes, toggling PGE drops everything
+		uint64_t cr4;
+		asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+		asm volatile ("mov %0, %%cr4" :: "r"(cr4 & ~(1ull << 7)) : "memory");
+		asm volatile ("mov %0, %%cr4" :: "r"(cr4) : "memory");
+		return;
+	}
+
+	uint64_t cr3;
+	asm volatile ("mov %%cr3, %0" : "=r"(cr3));
+	asm volatile ("mov %0, %%cr3" :: "r"(cr3) : "memory"); // bit 63 never reads back set so this flushes the current pcid
+}
+
+static void tlb_shootdown_service() {
+	uint64_t rflags = interrupts_save(); // the handler must not run in between the flush and the acknowledge
+
+	uint64_t bit = tlb_cpu_bit();
+
+	if(__atomic_load_n(&tlb_shootdown_request.pending, __ATOMIC_ACQUIRE) & bit) {
+		struct tlb_batch *batch = tlb_shootdown_request.batch;
+
+		if(batch->page_table == &kernel_mappings || tlb_loaded(batch->page_table)) {
+			tlb_flush_local(batch);
+		}
+
+		__atomic_and_fetch(&tlb_shootdown_request.pending, ~bit, __ATOMIC_RELEASE);
+	}
+
+	interrupts_restore(rflags);
+}
+
+static void tlb_shootdown_handler(struct registers*, void*) {
+	tlb_shootdown_service();
+}
+
+static void tlb_shootdown(struct tlb_batch *batch, uint64_t targets) {
+	if(tlb_shootdown_vector == -1) {
+		return;
+	}
+
+	// keep answering requests while waiting, the holder might be waiting on us with interrupts off
+	while(__atomic_test_and_set(&tlb_shootdown_lock, __ATOMIC_ACQUIRE)) {
+		tlb_shootdown_service();
+		asm volatile ("pause");
+	}
+
+	tlb_shootdown_request.batch = batch;
+	__atomic_store_n(&tlb_shootdown_request.pending, targets, __ATOMIC_RELEASE);
+
+	for(size_t i = 0; i < cpu_local_list.length && i < TLB_MAX_CPUS; i++) {
+		if(targets & (1ull << i)) {
+			xapic_send_ipi(cpu_local_list.data[i]->apic_id, tlb_shootdown_vector);
+		}
+	}
+
+	while(__atomic_load_n(&tlb_shootdown_request.pending, __ATOMIC_ACQUIRE)) {
+		asm volatile ("pause");
+	}
+
+	spinrelease(&tlb_shootdown_lock);
+}
+
+// for locks that are held across a shootdown, spinning with interrupts off must not leave the holder hanging
+void tlb_spinlock(char *lock) {
+	while(__atomic_test_and_set(lock, __ATOMIC_ACQUIRE)) {
+		tlb_shootdown_service();
+		asm volatile ("pause");
+	}
+}
+
+// dequeued threads drop the page table on their next switch, it can only go once every core has moved on
+void tlb_wait_inactive(struct page_table *page_table) {
+	while(__atomic_load_n(&page_table->active_cpus, __ATOMIC_SEQ_CST)) {
+		tlb_shootdown_service();
+		asm volatile ("pause");
+	}
+}
+
+void tlb_init() {
+	struct cpuid_state cpuid_state = cpuid(1, 0);
+	tlb_pcid = (cpuid_state.rcx & (1 << 17)) != 0;
+
+	tlb_shootdown_vector = idt_alloc_vector(tlb_shootdown_handler, NULL);
+
+	print("tlb: pcid %s, shootdown vector %x\n", tlb_pcid ? "enabled" : "unsupported", tlb_shootdown_vector);
+}
+
+void tlb_cpu_online() {
+	__atomic_or_fetch(&tlb_online_cpus, tlb_cpu_bit(), __ATOMIC_SEQ_CST);
+}
+
+void tlb_page_table_init(struct page_table *page_table) {
+	page_table->pcid = 0;
+	page_table->active_cpus = 0;
+	page_table->stale_cpus = ~0ull; // a recycled pcid can still have entries cached anywhere
+
+	spinlock(&tlb_pcid_lock);
+
+	for(size_t i = 0; i < TLB_PCID_CNT - 1; i++) {
+		size_t pcid = (tlb_pcid_hint + i - 1) % (TLB_PCID_CNT - 1) + 1; // pcid 0 is reserved for tables that ran out
+
+		if(BIT_TEST(tlb_pcid_map, pcid) == 0) {
+			BIT_SET(tlb_pcid_map, pcid);
+			page_table->pcid = pcid;
+			tlb_pcid_hint = pcid + 1;
+			break;
+		}
+	}
+
+	spinrelease(&tlb_pcid_lock);
+}
+
+void tlb_page_table_release(struct page_table *page_table) {
+	if(page_table->pcid == 0) {
+		return;
+	}
+
+	spinlock(&tlb_pcid_lock);
+	BIT_CLEAR(tlb_pcid_map, page_table->pcid);
+	spinrelease(&tlb_pcid_lock);
+
+	page_table->pcid = 0;
+}
+
+void tlb_switch(struct page_table *page_table) {
+	uint64_t cr3 = (uint64_t)page_table->pml_high - HIGH_VMA;
+	struct cpu_local *cpu_local = CORE_LOCAL;
+
+	if(cpu_local == NULL) {
+		asm volatile ("mov %0, %%cr3" :: "r"(cr3) : "memory");
+		return;
+	}
+
+	uint64_t bit = 1ull << cpu_local->cpu_number;
+	struct page_table *previous = cpu_local->tlb_page_table;
+
+	if(previous != page_table) {
+		if(previous) {
+			__atomic_and_fetch(&previous->active_cpus, ~bit, __ATOMIC_SEQ_CST);
+		}
+		__atomic_or_fetch(&page_table->active_cpus, bit, __ATOMIC_SEQ_CST);
+		cpu_local->tlb_page_table = page_table;
+	}
+
+	// active has to be visible before stale is consumed, invalidators mark stale first and then shoot down the active set
+	uint64_t stale = __atomic_fetch_and(&page_table->stale_cpus, ~bit, __ATOMIC_SEQ_CST);
+
+	if(tlb_pcid && page_table->pcid) {
+		cr3 |= page_table->pcid;
+		if((stale & bit) == 0) {
+			cr3 |= TLB_CR3_NOFLUSH;
+		}
+	}
+
+	asm volatile ("mov %0, %%cr3" :: "r"(cr3) : "memory");
+}
+
+// nothing but the calling core can be walking this address space right now
+bool tlb_exclusive(struct page_table *page_table) {
+	uint64_t bit = tlb_cpu_bit();
+	return bit && __atomic_load_n(&page_table->active_cpus, __ATOMIC_SEQ_CST) == bit;
+}
+
+void tlb_batch_init(struct tlb_batch *batch, struct page_table *page_table) {
+	batch->page_table = page_table;
+	batch->cnt = 0;
+	batch->full = false;
+	batch->frame_cnt = 0;
+}
+
+void tlb_batch_add(struct tlb_batch *batch, uintptr_t vaddr) {
+	if(batch->full) {
+		return;
+	}
+
+	if(batch->cnt == TLB_FLUSH_THRESHOLD) {
+		batch->full = true;
+		return;
+	}
+
+	batch->vaddrs[batch->cnt++] = vaddr;
+}
+
+void tlb_batch_add_frames(struct tlb_batch *batch, uint64_t paddr, size_t cnt) {
+	if(batch->frame_cnt == TLB_BATCH_FRAMES) {
+		tlb_batch_flush(batch);
+	}
+
+	batch->frames[batch->frame_cnt++] = (struct tlb_frame_range) {
+		.paddr = paddr,
+		.cnt = cnt
+	};
+}
+
+// paging structure caches can still walk through a detached table until the flush
+void tlb_batch_add_table(struct tlb_batch *batch, uint64_t paddr) {
+	if(batch->frame_cnt == TLB_BATCH_FRAMES) {
+		tlb_batch_flush(batch);
+	}
+
+	batch->frames[batch->frame_cnt++] = (struct tlb_frame_range) {
+		.paddr = paddr,
+		.cnt = 1,
+		.table = true
+	};
+}
+
+static void tlb_batch_invalidate(struct tlb_batch *batch) {
+	struct page_table *page_table = batch->page_table;
+	uint64_t self = tlb_cpu_bit();
+	uint64_t targets;
+
+	if(page_table == &kernel_mappings) { // vmalloc and the direct map are global, every core may hold them
+		tlb_flush_local(batch);
+		targets = __atomic_load_n(&tlb_online_cpus, __ATOMIC_SEQ_CST) & ~self;
+	} else {
+		bool loaded = tlb_loaded(page_table);
+
+		__atomic_or_fetch(&page_table->stale_cpus, loaded ? ~self : ~0ull, __ATOMIC_SEQ_CST);
+
+		if(loaded) {
+			tlb_flush_local(batch);
+		}
+
+		targets = __atomic_load_n(&page_table->active_cpus, __ATOMIC_SEQ_CST) & ~self;
+	}
+
+	if(targets) {
+		tlb_shootdown(batch, targets);
+	}
+}
+
+void tlb_batch_flush(struct tlb_batch *batch) {
+	if(batch->cnt || batch->full) {
+		tlb_batch_invalidate(batch);
+	}
+
+	for(size_t i = 0; i < batch->frame_cnt; i++) {
+		if(batch->frames[i].table) {
+			pmm_free(batch->frames[i].paddr, batch->frames[i].cnt);
+			continue;
+		}
+
+		for(size_t j = 0; j < batch->frames[i].cnt; j++) {
+			pmm_frame_unmap(batch->frames[i].paddr + j * PAGE_SIZE);
+		}
+	}
+
+	batch->cnt = 0;
+	batch->full = false;
+	batch->frame_cnt = 0;
+}
+
+void tlb_invalidate(struct page_table *page_table, uintptr_t vaddr) {
+	struct tlb_batch batch;
+
+	tlb_batch_init(&batch, page_table);
+	tlb_batch_add(&batch, vaddr);
+	tlb_batch_flush(&batch);
+}
+
+void tlb_flush(struct page_table *page_table) {
+	struct tlb_batch batch;
+
+	tlb_batch_init(&batch, page_table);
+	batch.full = true;
+	tlb_batch_flush(&batch);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <mm/vmm.h>
+#include <stdbool.h>
+
+#define TLB_FLUSH_THRESHOLD 32 // past this many pages a full flush beats a string of invlpg
+#define TLB_MAX_CPUS 64
+#define TLB_PCID_CNT 4096
+#define TLB_BATCH_FRAMES 64
+
+#define TLB_CR3_NOFLUSH (1ull << 63)
+
+struct tlb_frame_range {
+	uint64_t paddr;
+	size_t cnt;
+	bool table; // a page table frame, nothing maps it so it goes straight back to the pmm
+};
+
+struct tlb_batch {
+	struct page_table *page_table;
+	uintptr_t vaddrs[TLB_FLUSH_THRESHOLD];
+	size_t cnt;
+	bool full;
+
+	// frames unmapped under this batch, they are only dropped once no tlb can reach them
+	struct tlb_frame_range frames[TLB_BATCH_FRAMES];
+	size_t frame_cnt;
+};
+
+void tlb_init();
+void tlb_cpu_online();
+void tlb_page_table_init(struct page_table *page_table);
+void tlb_page_table_release(struct page_table *page_table);
+void tlb_switch(struct page_table *page_table);
+bool tlb_exclusive(struct page_table *page_table);
+
+void tlb_batch_init(struct tlb_batch *batch, struct page_table *page_table);
+void tlb_batch_add(struct tlb_batch *batch, uintptr_t vaddr);
+void tlb_batch_add_frames(struct tlb_batch *batch, uint64_t paddr, size_t cnt);
+void tlb_batch_add_table(struct tlb_batch *batch, uint64_t paddr);
+void tlb_batch_flush(struct tlb_batch *batch);
+
+void tlb_invalidate(struct page_table *page_table, uintptr_t vaddr);
+void tlb_flush(struct page_table *page_table);
+void tlb_spinlock(char *lock);
+void tlb_wait_inactive(struct page_table *page_table);
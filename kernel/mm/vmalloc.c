@@ -0,0 +1,236 @@
+#include <mm/vmalloc.h>
+#include <mm/vmm.h>
+#include <mm/tlb.h>
+#include <mm/pmm.h>
+#include <mm/slab.h>
+#include <cpu.h>
+#include <string.h>
+#include <hash.h>
+#include <debug.h>
+
+struct vmalloc_extent {
+	uintptr_t base;
+	size_t length;
+
+	struct vmalloc_extent *next;
+};
+
+struct vmalloc_area {
+	uintptr_t base;
+	size_t pages;
+	size_t size;
+};
+
+uintptr_t vmalloc_base;
+size_t vmalloc_length;
+
+static uintptr_t vmalloc_bump;
+static struct vmalloc_extent *vmalloc_free_list; // sorted by base, never adjacent
+static struct hash_table vmalloc_areas;
+static struct vmalloc_stats vmalloc_stats;
+static char vmalloc_lock;
+
+void vmalloc_init() {
+	struct cpuid_state cpuid_state = cpuid(7, 0);
+
+	if(cpuid_state.rcx & (1 << 16)) {
+		vmalloc_base = VMALLOC_BASE_PML5;
+		vmalloc_length = VMALLOC_LENGTH_PML5;
+	} else {
+		vmalloc_base = VMALLOC_BASE_PML4;
+		vmalloc_length = VMALLOC_LENGTH_PML4;
+	}
+
+	vmalloc_bump = vmalloc_base;
+}
+
+static uintptr_t vmalloc_reserve(size_t length) {
+	for(struct vmalloc_extent **link = &vmalloc_free_list; *link; link = &(*link)->next) {
+		struct vmalloc_extent *extent = *link;
+
+		if(extent->length < length) {
+			continue;
+		}
+
+		uintptr_t base = extent->base;
+
+		extent->base += length;
+		extent->length -= length;
+
+		if(extent->length == 0) {
+			*link = extent->next;
+			free(extent);
+		}
+
+		return base;
+	}
+
+	if(vmalloc_bump + length > vmalloc_base + vmalloc_length) {
+		return 0;
+	}
+
+	uintptr_t base = vmalloc_bump;
+	vmalloc_bump += length;
+
+	return base;
+}
+
+static void vmalloc_release(uintptr_t base, size_t length) {
+	struct vmalloc_extent *prev = NULL;
+	struct vmalloc_extent *next = vmalloc_free_list;
+
+	while(next && next->base < base) {
+		prev = next;
+		next = next->next;
+	}
+
+	if(prev && prev->base + prev->length == base) {
+		prev->length += length;
+	} else {
+		struct vmalloc_extent *extent = alloc(sizeof(struct vmalloc_extent));
+
+		*extent = (struct vmalloc_extent) {
+			.base = base,
+			.length = length,
+			.next = next
+		};
+
+		if(prev) {
+			prev->next = extent;
+		} else {
+			vmalloc_free_list = extent;
+		}
+
+		prev = extent;
+	}
+
+	if(next && prev->base + prev->length == next->base) {
+		prev->length += next->length;
+		prev->next = next->next;
+		free(next);
+	}
+
+	if(prev->next == NULL && prev->base + prev->length == vmalloc_bump) { // give the tail back to the bump
+		vmalloc_bump = prev->base;
+
+		struct vmalloc_extent **link = &vmalloc_free_list;
+		while(*link != prev) {
+			link = &(*link)->next;
+		}
+
+		*link = NULL;
+		free(prev);
+	}
+}
+
+void *vmalloc(size_t size) {
+	if(size == 0) {
+		return NULL;
+	}
+
+	size_t pages = DIV_ROUNDUP(size, PAGE_SIZE);
+
+	spinlock(&vmalloc_lock);
+
+	uintptr_t base = vmalloc_reserve((pages + 1) * PAGE_SIZE); // unmapped guard page after every area
+	if(base == 0) {
+		spinrelease(&vmalloc_lock);
+		print("vmalloc: out of address space for %x bytes\n", size);
+		return NULL;
+	}
+
+	struct vmalloc_area *area = alloc(sizeof(struct vmalloc_area));
+
+	*area = (struct vmalloc_area) {
+		.base = base,
+		.pages = pages,
+		.size = size
+	};
+
+	hash_table_push(&vmalloc_areas, &area->base, area, sizeof(area->base));
+
+	vmalloc_stats.areas++;
+	vmalloc_stats.pages += pages;
+
+	spinrelease(&vmalloc_lock);
+
+	for(size_t i = 0; i < pages; i++) {
+		uint64_t frame = pmm_alloc(1, 1);
+		if(frame == (uint64_t)-1) {
+			print("vmalloc: out of memory for %x bytes\n", size);
+			vfree((void*)base); // drops the pages mapped so far along with the area and its extent
+			return NULL;
+		}
+
+		kernel_mappings.map_page(&kernel_mappings, base + i * PAGE_SIZE, frame, VMM_FLAGS_P | VMM_FLAGS_RW | VMM_FLAGS_G);
+	}
+
+	return (void*)base;
+}
+
+void vfree(void *addr) {
+	uintptr_t base = (uintptr_t)addr;
+
+	spinlock(&vmalloc_lock);
+
+	struct vmalloc_area *area = hash_table_search(&vmalloc_areas, &base, sizeof(base));
+	if(area == NULL) {
+		spinrelease(&vmalloc_lock);
+		print("vmalloc: free of unknown area %x\n", base);
+		return;
+	}
+
+	hash_table_delete(&vmalloc_areas, &base, sizeof(base));
+
+	vmalloc_stats.areas--;
+	vmalloc_stats.pages -= area->pages;
+
+	spinrelease(&vmalloc_lock);
+
+	struct tlb_batch batch;
+	tlb_batch_init(&batch, &kernel_mappings);
+
+	for(size_t i = 0; i < area->pages; i++) {
+		uintptr_t vaddr = base + i * PAGE_SIZE;
+
+		if(kernel_mappings.unmap_page(&kernel_mappings, vaddr)) {
+			tlb_batch_add(&batch, vaddr);
+		}
+	}
+
+	tlb_batch_flush(&batch);
+
+	// unmap_page only drops P, the frames can go once no core can reach them anymore
+	for(size_t i = 0; i < area->pages; i++) {
+		uint64_t *entry = kernel_mappings.lowest_level(&kernel_mappings, base + i * PAGE_SIZE);
+		if(entry && (*entry & VMM_PADDR_MASK)) {
+			pmm_free(*entry & VMM_PADDR_MASK, 1);
+			*entry = 0;
+		}
+	}
+
+	spinlock(&vmalloc_lock);
+	vmalloc_release(base, (area->pages + 1) * PAGE_SIZE);
+	spinrelease(&vmalloc_lock);
+
+	free(area);
+}
+
+size_t vmalloc_size(void *addr) {
+	uintptr_t base = (uintptr_t)addr;
+
+	spinlock(&vmalloc_lock);
+
+	struct vmalloc_area *area = hash_table_search(&vmalloc_areas, &base, sizeof(base));
+	size_t size = area ? area->pages * PAGE_SIZE : 0;
+
+	spinrelease(&vmalloc_lock);
+
+	return size;
+}
+
+void vmalloc_get_stats(struct vmalloc_stats *stats) {
+	spinlock(&vmalloc_lock);
+	*stats = vmalloc_stats;
+	spinrelease(&vmalloc_lock);
+}
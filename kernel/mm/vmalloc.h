@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define VMALLOC_BASE_PML4 0xffffc00000000000
+#define VMALLOC_BASE_PML5 0xffc0000000000000
+#define VMALLOC_LENGTH_PML4 0x8000000000 // one pml4 entry
+#define VMALLOC_LENGTH_PML5 0x1000000000000 // one pml5 entry
+
+struct vmalloc_stats {
+	size_t areas;
+	size_t pages;
+};
+
+extern uintptr_t vmalloc_base;
+extern size_t vmalloc_length;
+
+void vmalloc_init();
+void *vmalloc(size_t size);
+void vfree(void *addr);
+size_t vmalloc_size(void *addr);
+void vmalloc_get_stats(struct vmalloc_stats *stats);
+
+static inline bool vmalloc_owns(void *addr) {
+	return (uintptr_t)addr >= vmalloc_base && (uintptr_t)addr < vmalloc_base + vmalloc_length;
+}
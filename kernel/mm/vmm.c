@@ -4,6 +4,14 @@
 #include <string.h>
 #include <sched/sched.h>
 #include <mm/mmap.h>
+#include <mm/vmalloc.h>
+#include <mm/tlb.h>
+#include <mm/thp.h>
+#include <mm/filemap.h>
+#include <mm/mmap_region.h>
+#include <mm/reclaim.h>
+#include <mm/ksm.h>
+#include <mm/swap.h>
 #include <debug.h>
 #include <limine.h>
 
@@ -24,6 +32,8 @@ struct vmm_cow_page {
 	VECTOR(struct sched_task*) task_list;
 };
 
+#define VMM_TABLE(ENTRY) ((uint64_t*)(((ENTRY) & VMM_PADDR_MASK) + HIGH_VMA))
+
 static struct pml_indices compute_table_indices(uintptr_t vaddr) {
 	struct pml_indices ret;
 
@@ -37,6 +47,13 @@ static struct pml_indices compute_table_indices(uintptr_t vaddr) {
 }
 
 struct page_table kernel_mappings;
+uint64_t vmm_zero_page;
+
+static uint64_t vmalloc_pml_entry; // shared by every page table so vmalloc mappings show up everywhere
+static int vmm_levels;
+
+static struct page_table *vmm_page_table_list;
+static char vmm_page_table_list_lock;
 
 static uint64_t *pml4_map_page(struct page_table *page_table, uintptr_t vaddr, uint64_t paddr, uint64_t flags) {
 	struct pml_indices pml_indices = compute_table_indices(vaddr);
@@ -94,7 +111,6 @@ static size_t pml4_unmap_page(struct page_table *page_table, uintptr_t vaddr) {
 
 	if((pml2[pml_indices.pml2_index] & 0xfff) & VMM_FLAGS_PS) {
 		pml2[pml_indices.pml2_index] &= ~(VMM_FLAGS_P);
-		invlpg(vaddr);
 		spinrelease(&page_table->lock);
 		return 0x200000;
 	}
@@ -107,7 +123,6 @@ static size_t pml4_unmap_page(struct page_table *page_table, uintptr_t vaddr) {
 	uint64_t *pml1 = (uint64_t*)((pml2[pml_indices.pml2_index] & ~(0xfff)) + HIGH_VMA);
 
 	pml1[pml_indices.pml1_index] &= ~(VMM_FLAGS_P);
-	invlpg(vaddr);
 
 	spinrelease(&page_table->lock);
 
@@ -240,12 +255,12 @@ static size_t pml5_unmap_page(struct page_table *page_table, uintptr_t vaddr) {
 
 	spinlock(&page_table->lock);
 
-	if((page_table->pml_high[pml_indices.pml4_index] & VMM_FLAGS_P) == 0) {
+	if((page_table->pml_high[pml_indices.pml5_index] & VMM_FLAGS_P) == 0) {
 		spinrelease(&page_table->lock);
 		return 0;
 	}
 
-	uint64_t *pml4 = (uint64_t*)((page_table->pml_high[pml_indices.pml4_index] & ~(0xfff)) + HIGH_VMA);
+	uint64_t *pml4 = (uint64_t*)((page_table->pml_high[pml_indices.pml5_index] & ~(0xfff)) + HIGH_VMA);
 
 	if((pml4[pml_indices.pml4_index] & VMM_FLAGS_P) == 0) {
 		spinrelease(&page_table->lock);
@@ -263,7 +278,6 @@ static size_t pml5_unmap_page(struct page_table *page_table, uintptr_t vaddr) {
 
 	if((pml2[pml_indices.pml2_index] & 0xfff) & VMM_FLAGS_PS) {
 		pml2[pml_indices.pml2_index] &= ~(VMM_FLAGS_P);
-		invlpg(vaddr);
 		spinrelease(&page_table->lock);
 		return 0x200000;
 	}
@@ -276,7 +290,6 @@ static size_t pml5_unmap_page(struct page_table *page_table, uintptr_t vaddr) {
 	uint64_t *pml1 = (uint64_t*)((pml2[pml_indices.pml2_index] & ~(0xfff)) + HIGH_VMA);
 
 	pml1[pml_indices.pml1_index] &= ~(VMM_FLAGS_P);
-	invlpg(vaddr);
 
 	spinrelease(&page_table->lock);
 
@@ -286,7 +299,7 @@ static size_t pml5_unmap_page(struct page_table *page_table, uintptr_t vaddr) {
 void vmm_map_range(struct page_table *page_table, uintptr_t vaddr, uint64_t cnt, uint64_t flags) {
 	if(flags & VMM_FLAGS_PS) {
 		for(size_t i = 0; i < cnt; i++) {
-			page_table->map_page(page_table, vaddr, pmm_alloc(1, 0x200), flags);
+			page_table->map_page(page_table, vaddr, pmm_alloc(0x200, 0x200), flags);
 			vaddr += 0x200000;
 		}
 	} else {
@@ -298,22 +311,109 @@ void vmm_map_range(struct page_table *page_table, uintptr_t vaddr, uint64_t cnt,
 }
 
 void vmm_unmap_range(struct page_table *page_table, uintptr_t vaddr, uint64_t cnt) {
+	struct tlb_batch batch;
+	tlb_batch_init(&batch, page_table);
+
 	for(size_t i = 0; i < cnt; i++) {
 		size_t page_size = page_table->unmap_page(page_table, vaddr);
 		if(page_size == 0) {
-			return;
+			break;
 		}
+		tlb_batch_add(&batch, vaddr);
 		vaddr += page_size;
 	}
+
+	tlb_batch_flush(&batch);
+}
+
+// NULL when no pml2 table covers vaddr yet
+uint64_t *vmm_pml2_entry(struct page_table *page_table, uintptr_t vaddr) {
+	uint64_t *table = page_table->pml_high;
+
+	spinlock(&page_table->lock);
+
+	for(int level = vmm_levels; level > 2; level--) {
+		uint64_t entry = table[(vaddr >> (12 + 9 * (level - 1))) & 0x1ff];
+
+		if((entry & VMM_FLAGS_P) == 0 || (entry & VMM_FLAGS_PS)) {
+			spinrelease(&page_table->lock);
+			return NULL;
+		}
+
+		table = VMM_TABLE(entry);
+	}
+
+	spinrelease(&page_table->lock);
+
+	return &table[(vaddr >> 21) & 0x1ff];
+}
+
+static bool vmm_table_empty(uint64_t *table) {
+	for(size_t i = 0; i < 512; i++) {
+		if(table[i]) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// tables can still sit in paging structure caches, so they are only freed once the batch is flushed
+static void vmm_prune_level(uint64_t *table, int level, uintptr_t table_base, uintptr_t base, uintptr_t end, struct tlb_batch *batch) {
+	uintptr_t span = 1ull << (12 + 9 * (level - 1));
+
+	size_t first = base > table_base ? (base - table_base) / span : 0;
+	size_t last = (end - 1 - table_base) / span;
+
+	if(last > 511) last = 511;
+
+	for(size_t i = first; i <= last; i++) {
+		uint64_t entry = table[i];
+		if((entry & VMM_FLAGS_P) == 0 || (entry & VMM_FLAGS_PS)) {
+			continue;
+		}
+
+		uint64_t *child = VMM_TABLE(entry);
+		uintptr_t vaddr = table_base + i * span;
+
+		if(level > 2) {
+			vmm_prune_level(child, level - 1, vaddr, base, end, batch);
+		}
+
+		if(vmm_table_empty(child)) {
+			table[i] = 0;
+
+			tlb_batch_add(batch, vaddr);
+			tlb_batch_add_table(batch, entry & VMM_PADDR_MASK);
+		}
+	}
+}
+
+// frees the userspace tables under [base, end) that nothing is mapped through anymore
+void vmm_prune_tables(struct page_table *page_table, uintptr_t base, uintptr_t end) {
+	uintptr_t lower_half = 256ull << (12 + 9 * (vmm_levels - 1)); // the upper half is shared with every other table
+
+	if(end > lower_half) end = lower_half;
+	if(base >= end) return;
+
+	struct tlb_batch batch;
+	tlb_batch_init(&batch, page_table);
+
+	vmm_prune_level(page_table->pml_high, vmm_levels, 0, base, end, &batch);
+
+	tlb_batch_flush(&batch);
 }
 
 void vmm_init_page_table(struct page_table *page_table) {
-	asm volatile ("mov %0, %%cr3" :: "r"((uint64_t)page_table->pml_high - HIGH_VMA) : "memory");
+	tlb_switch(page_table);
 }
 
 void vmm_init() {
 	vmm_default_table(&kernel_mappings);
 	vmm_init_page_table(&kernel_mappings);
+
+	vmm_zero_page = pmm_alloc(1, 1);
+	pmm_frame_get(vmm_zero_page); // never freed, however many ptes come and go
 }
 
 static volatile struct limine_kernel_address_request limine_kernel_address_request = {
@@ -323,19 +423,29 @@ static volatile struct limine_kernel_address_request limine_kernel_address_reque
 
 void vmm_default_table(struct page_table *page_table) {
 	struct cpuid_state cpuid_state = cpuid(7, 0);
+	size_t vmalloc_index;
 
 	if(cpuid_state.rcx & (1 << 16)) {
 		page_table->map_page = pml5_map_page;
 		page_table->unmap_page = pml5_unmap_page;
 		page_table->lowest_level = pml5_lowest_level;
+		vmalloc_index = compute_table_indices(vmalloc_base).pml5_index;
+		vmm_levels = 5;
 	} else {
 		page_table->map_page = pml4_map_page;
 		page_table->unmap_page = pml4_unmap_page;
 		page_table->lowest_level = pml4_lowest_level;
+		vmalloc_index = compute_table_indices(vmalloc_base).pml4_index;
+		vmm_levels = 4;
 	}
 
 	page_table->pml_high = (uint64_t*)(pmm_alloc(1, 1) + HIGH_VMA);
-	page_table->pages = alloc(sizeof(struct hash_table));
+
+	if(vmalloc_pml_entry == 0) {
+		vmalloc_pml_entry = pmm_alloc(1, 1) | VMM_FLAGS_P | VMM_FLAGS_RW;
+	}
+
+	page_table->pml_high[vmalloc_index] = vmalloc_pml_entry;
 
 	uintptr_t kernel_vaddr = limine_kernel_address_request.response->virtual_base;
 	uintptr_t kernel_paddr = limine_kernel_address_request.response->physical_base;
@@ -363,7 +473,28 @@ void vmm_default_table(struct page_table *page_table) {
 		}
 	}
 
-	page_table->mmap_bump_base = MMAP_MAP_MIN_ADDR;
+	page_table->mmap_base = MMAP_MAP_MAX_ADDR - PAGE_SIZE; // keeps the end of a stack at the top canonical
+	page_table->mmap_top_down = true;
+
+	tlb_page_table_init(page_table);
+
+	spinlock(&vmm_page_table_list_lock);
+
+	page_table->list_prev = NULL;
+	page_table->list_next = vmm_page_table_list;
+	if(vmm_page_table_list) vmm_page_table_list->list_prev = page_table;
+	vmm_page_table_list = page_table;
+
+	spinrelease(&vmm_page_table_list_lock);
+}
+
+// walks every address space, NULL starts over
+struct page_table *vmm_page_table_next(struct page_table *page_table) {
+	spinlock(&vmm_page_table_list_lock);
+	struct page_table *next = page_table ? page_table->list_next : vmm_page_table_list;
+	spinrelease(&vmm_page_table_list_lock);
+
+	return next;
 }
 
 struct mmap_region *vmm_copy_region_tree(struct mmap_region *root) {
@@ -374,138 +505,220 @@ struct mmap_region *vmm_copy_region_tree(struct mmap_region *root) {
 	struct mmap_region *region = alloc(sizeof(struct mmap_region));
 	*region = *root;
 
+	region->parent = NULL;
 	region->left = vmm_copy_region_tree(root->left);
 	region->right = vmm_copy_region_tree(root->right);
 
+	if(region->left) region->left->parent = region;
+	if(region->right) region->right->parent = region;
+
 	return region;
 }
 
+static uint64_t vmm_fork_leaf(uint64_t *entry, size_t pages) {
+	if(*entry & VMM_SWAP_FLAG) {
+		swap_dup(SWAP_SLOT(*entry));
+		return *entry;
+	}
+
+	if((*entry & VMM_PADDR_MASK) == 0) {
+		return *entry;
+	}
+
+	if(!(*entry & VMM_SHARE_FLAG)) {
+		*entry = (*entry & ~(VMM_FLAGS_RW)) | VMM_COW_FLAG;
+	}
+
+	for(size_t i = 0; i < pages; i++) { // huge pages are counted per 4 KiB frame so they can be split at will
+		pmm_frame_map((*entry & VMM_PADDR_MASK) + i * PAGE_SIZE, 0);
+	}
+
+	return *entry;
+}
+
+// stops at the first table it can not allocate, everything copied so far is released with the child
+static int vmm_fork_level(uint64_t *parent, uint64_t *child, int level, size_t entries) {
+	for(size_t i = 0; i < entries; i++) {
+		if(level == 1) {
+			child[i] = vmm_fork_leaf(&parent[i], 1);
+			continue;
+		}
+
+		if(parent[i] & VMM_FLAGS_PS) {
+			child[i] = vmm_fork_leaf(&parent[i], 1ull << (9 * (level - 1)));
+			continue;
+		}
+
+		if((parent[i] & VMM_FLAGS_P) == 0) {
+			continue;
+		}
+
+		uint64_t table = pmm_alloc(1, 1);
+		if(table == (uint64_t)-1) {
+			return -1;
+		}
+
+		child[i] = table | (parent[i] & ~VMM_PADDR_MASK);
+
+		if(vmm_fork_level(VMM_TABLE(parent[i]), VMM_TABLE(child[i]), level - 1, 512) == -1) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 struct page_table *vmm_fork_page_table(struct page_table *page_table) {
 	struct page_table *new_table = alloc(sizeof(struct page_table));
 
 	vmm_default_table(new_table);
 
-	for(size_t i = 0; i < page_table->pages->capacity; i++) {
-		struct page *page = page_table->pages->data[i];
+	uint64_t rflags = interrupts_save();
+	tlb_spinlock(&page_table->mm_lock);
 
-		if(page) {
-			if(!(*page->pml_entry & VMM_SHARE_FLAG)) {
-				*page->pml_entry &= ~(VMM_FLAGS_RW);
-				*page->pml_entry |= VMM_COW_FLAG;
+	spinlock(&page_table->lock);
+	int ret = vmm_fork_level(page_table->pml_high, new_table->pml_high, vmm_levels, 256); // the lower half is userspace
+	spinrelease(&page_table->lock);
 
-				page->flags = (page->flags & ~(VMM_FLAGS_RW)) | VMM_COW_FLAG;
-			}
+	tlb_flush(page_table); // the parent lost RW on everything it shares
 
-			(*page->reference)++;
+	if(ret == 0) {
+		new_table->mmap_region_root = vmm_copy_region_tree(page_table->mmap_region_root);
+		new_table->mmap_base = page_table->mmap_base;
+		new_table->mmap_top_down = page_table->mmap_top_down;
+	}
 
-			invlpg(page->vaddr);
+	spinrelease(&page_table->mm_lock);
+	interrupts_restore(rflags);
+
+	if(ret == -1) { // the shared leaves stay cow in the parent, its next write fault finds them unshared again
+		vmm_destroy_page_table(new_table);
+		return NULL;
+	}
 
-			struct page *new_page = alloc(sizeof(struct page));
-			*new_page = *page;
+	return new_table;
+}
 
-			new_page->pml_entry = new_table->map_page(new_table, page->vaddr, page->paddr, page->flags);
+// user leaves still holding a frame give up their reference, the kernel half only owns its tables
+static void vmm_release_level(uint64_t *table, int level, size_t first, size_t last, bool user) {
+	for(size_t i = first; i < last; i++) {
+		uint64_t entry = table[i];
+		uint64_t paddr = entry & VMM_PADDR_MASK;
 
-			hash_table_push(new_table->pages, &new_page->vaddr, new_page, sizeof(new_page->vaddr));
+		if((entry & VMM_FLAGS_P) == 0 || paddr == 0) {
+			if(user && (entry & VMM_SWAP_FLAG)) swap_free(SWAP_SLOT(entry));
+			table[i] = 0;
+			continue;
 		}
-	}
 
-	uint64_t cr3;
-	asm volatile ("mov %%cr3, %0" : "=a"(cr3));
-	asm volatile ("mov %0, %%cr3" :: "r"(cr3) : "memory");
+		if(level == 1 || (entry & VMM_FLAGS_PS)) {
+			size_t pages = level == 1 ? 1 : 1ull << (9 * (level - 1));
 
-	new_table->mmap_region_root = vmm_copy_region_tree(page_table->mmap_region_root);
+			for(size_t j = 0; user && j < pages; j++) {
+				pmm_frame_unmap(paddr + j * PAGE_SIZE);
+			}
+		} else {
+			vmm_release_level(VMM_TABLE(entry), level - 1, 0, 512, user);
+			pmm_free(paddr, 1);
+		}
 
-	return new_table;
+		table[i] = 0;
+	}
 }
 
-int vmm_file_map(struct page_table *page_table, uintptr_t address) {
-	struct mmap_region *root = page_table->mmap_region_root;
-	if(root == NULL) {
-		return 0;
+// no core may have the table loaded, the caller switches away first
+void vmm_destroy_page_table(struct page_table *page_table) {
+	if(__atomic_load_n(&page_table->active_cpus, __ATOMIC_SEQ_CST)) {
+		panic("vmm: destroying a page table that is still loaded");
 	}
 
-	uint64_t faulting_page = address & ~(0xfff);
-	uint64_t *lowest_level = page_table->lowest_level(page_table, faulting_page);
+	spinlock(&vmm_page_table_list_lock);
 
-	while(root) {
-		if(root->base <= address && (root->base + root->limit) >= address) {
-			struct page *page = hash_table_search(page_table->pages, &faulting_page, sizeof(faulting_page));
-			if(page == NULL) {
-				return 0;
-			}
+	if(page_table->list_prev) page_table->list_prev->list_next = page_table->list_next;
+	else vmm_page_table_list = page_table->list_next;
+	if(page_table->list_next) page_table->list_next->list_prev = page_table->list_prev;
 
-			struct vfs_node *node = page->node;
-			if(node == NULL) {
-				return 0;
-			}
+	spinrelease(&vmm_page_table_list_lock);
 
-			invlpg(address);
+	// scanners on other cores may still be inside, these wait them out
+	reclaim_page_table_release(page_table);
+	ksm_page_table_release(page_table);
+	thp_page_table_release(page_table);
 
-			int ret = node->asset->read(node->asset, NULL, page->offset, PAGE_SIZE, (void*)(page->paddr + HIGH_VMA)) == -1 ? 0 : 1;
-			if(ret) {
-				*lowest_level = *lowest_level | VMM_FLAGS_P;
-			}
+	mmap_release(page_table);
 
-			return ret;
-		}
+	uint64_t *pml_high = page_table->pml_high;
 
-		if(root->base > address) {
-			root = root->left;
-		} else {
-			root = root->right;
+	vmm_release_level(pml_high, vmm_levels, 0, 256, true);
+
+	for(size_t i = 256; i < 512; i++) {
+		// shared by every page table, the accessed bit may differ between the copies
+		if((pml_high[i] & VMM_PADDR_MASK) == (vmalloc_pml_entry & VMM_PADDR_MASK)) {
+			pml_high[i] = 0;
+			continue;
 		}
+
+		vmm_release_level(pml_high, vmm_levels, i, i + 1, false);
 	}
 
-	return 0;
+	pmm_free((uintptr_t)pml_high - HIGH_VMA, 1);
+
+	tlb_page_table_release(page_table);
+
+	free(page_table);
 }
 
-int vmm_anon_map(struct page_table *page_table, uintptr_t address) {
-	struct mmap_region *root = page_table->mmap_region_root;
-	if(root == NULL) {
+int vmm_file_map(struct page_table *page_table, uintptr_t address) {
+	struct mmap_region *region = mmap_region_find(page_table, address);
+	if(region == NULL || region->node == NULL) {
 		return 0;
 	}
 
-	while(root) {
-		if(root->base <= address && (root->base + root->limit) >= address) {
-			uint64_t flags = VMM_FLAGS_P | VMM_FLAGS_NX;
+	return filemap_fault(page_table, region, address);
+}
 
-			if(root->prot & MMAP_PROT_WRITE) flags |= VMM_FLAGS_RW;
-			if(root->prot & MMAP_PROT_USER) flags |= VMM_FLAGS_US;
-			if(root->prot & MMAP_PROT_EXEC) flags &= ~(VMM_FLAGS_NX);
-			if(root->prot & MMAP_PROT_NONE) flags &= ~(VMM_FLAGS_P);
+int vmm_anon_map(struct page_table *page_table, uintptr_t address, bool write) {
+	struct mmap_region *region = mmap_region_find(page_table, address);
+	if(region == NULL) {
+		return 0;
+	}
 
-			size_t misalignment = address & (PAGE_SIZE - 1);
+	uint64_t flags = VMM_FLAGS_P | VMM_FLAGS_NX;
 
-			uint64_t paddr = pmm_alloc(1, 1);
-			uint64_t vaddr = address - misalignment;
+	if(region->prot & MMAP_PROT_WRITE) flags |= VMM_FLAGS_RW;
+	if(region->prot & MMAP_PROT_USER) flags |= VMM_FLAGS_US;
+	if(region->prot & MMAP_PROT_EXEC) flags &= ~(VMM_FLAGS_NX);
+	if(region->prot & MMAP_PROT_NONE) flags &= ~(VMM_FLAGS_P);
 
-			invlpg(address);
+	uint64_t vaddr = address & ~(PAGE_SIZE - 1);
 
-			struct page *new_page = alloc(sizeof(struct page));
-			*new_page = (struct page) {
-				.vaddr = vaddr,
-				.paddr = paddr,
-				.size = PAGE_SIZE,
-				.flags = flags,
-				.pml_entry = page_table->map_page(page_table, vaddr, paddr, flags),
-				.reference = alloc(sizeof(int))
-			};
+	// reads of private memory share the zero page until the first write copies it out
+	if(!write && (flags & VMM_FLAGS_P) && !(region->flags & MMAP_MAP_SHARED)) {
+		if(flags & VMM_FLAGS_RW) flags = (flags & ~(VMM_FLAGS_RW)) | VMM_COW_FLAG;
 
-			(*new_page->reference) = 1;
+		invlpg(address);
 
-			hash_table_push(page_table->pages, &new_page->vaddr, new_page, sizeof(new_page->vaddr));
+		page_table->map_page(page_table, vaddr, vmm_zero_page, flags);
+		pmm_frame_map(vmm_zero_page, 0);
 
-			return 1;
-		}
+		return 1;
+	}
 
-		if(root->base > address) {
-			root = root->left;
-		} else {
-			root = root->right;
-		}
+	if(thp_anon_fault(page_table, region, address, flags)) {
+		return 1;
 	}
 
-	return 0;
+	uint64_t paddr = reclaim_alloc(0);
+	if(paddr == (uint64_t)-1) {
+		return 0;
+	}
+
+	invlpg(address);
+
+	page_table->map_page(page_table, vaddr, paddr, flags);
+	pmm_frame_map(paddr, FRAME_ANON);
+
+	return 1;
 }
 
 #define EXIT_PF(STATUS) ({ \
@@ -513,12 +726,7 @@ int vmm_anon_map(struct page_table *page_table, uintptr_t address) {
 	return; \
 })
 
-void vmm_pf_handler(struct registers *regs, void *status) {
-	struct sched_task *task = CURRENT_TASK;
-	if(task == NULL) {
-		EXIT_PF(0);
-	}
-
+static void vmm_fault(struct sched_task *task, struct registers *regs, void *status) {
 	uint64_t faulting_address;
 	asm volatile ("mov %%cr2, %0" : "=a"(faulting_address));
 
@@ -527,42 +735,253 @@ void vmm_pf_handler(struct registers *regs, void *status) {
 	uint64_t pmll_entry = lowest_level == NULL ? 0 : *lowest_level;
 
 	if((regs->error_code & VMM_FLAGS_P) == 0) {
+		if(pmll_entry & VMM_FLAGS_P) { // mapped while this fault waited on mm_lock, by khugepaged or another thread
+			EXIT_PF(1);
+		}
+		if(pmll_entry & VMM_SWAP_FLAG) {
+			EXIT_PF(swap_fault(lowest_level, faulting_page));
+		}
 		if(pmll_entry & VMM_FILE_FLAG) {
 			EXIT_PF(vmm_file_map(task->page_table, faulting_address));
 		}
-		EXIT_PF(vmm_anon_map(task->page_table, faulting_address));
+		EXIT_PF(vmm_anon_map(task->page_table, faulting_address, regs->error_code & VMM_FLAGS_RW));
 	}
 
-	if(pmll_entry & VMM_COW_FLAG) {
-		struct page *page = hash_table_search(task->page_table->pages, &faulting_page, sizeof(faulting_page));
-		if(page == NULL) {
-			EXIT_PF(0);
+	// the zero page and ksm frames sit read-only in read-only regions too, nothing may upgrade those
+	struct mmap_region *region = mmap_region_find(task->page_table, faulting_address);
+	if((regs->error_code & VMM_FLAGS_RW) && (region == NULL || (region->prot & MMAP_PROT_WRITE) == 0)) {
+		EXIT_PF(0);
+	}
+
+	if((pmll_entry & VMM_COW_FLAG) && (pmll_entry & VMM_FLAGS_PS)) {
+		int ret = thp_cow(task->page_table, lowest_level, faulting_address);
+		if(ret) {
+			EXIT_PF(ret == 1);
 		}
 
-		uint64_t original_frame = pmll_entry & ~(0xfff) & 0xffffffffff;
-		uint64_t new_frame;
+		lowest_level = task->page_table->lowest_level(task->page_table, faulting_page); // split, copy just this page
+		pmll_entry = *lowest_level;
+	}
 
-		if((*page->reference) <= 1) {
-			new_frame = original_frame;
-		} else {
-			new_frame = pmm_alloc(1, 1);
-			memcpy64((uint64_t*)(new_frame + HIGH_VMA), (uint64_t*)(original_frame + HIGH_VMA), PAGE_SIZE / 8);
-		}
+	if(pmll_entry & VMM_COW_FLAG) {
+		uint64_t original_frame = pmll_entry & VMM_PADDR_MASK;
+		uint64_t new_frame = original_frame;
 
-		(*page->reference)--;
+		struct frame *frame = pmm_frame(original_frame);
 
-		uint64_t entry = new_frame | ((pmll_entry & 0x1ff) | (VMM_FLAGS_RW));
-		*lowest_level = entry;
+		if(frame && frame->refcnt > 1) {
+			bool zero = original_frame == vmm_zero_page; // a zeroed frame from the pmm is as good as a copy
+
+			new_frame = reclaim_alloc(zero ? 0 : PMM_ALLOC_NOZERO);
+			if(new_frame == (uint64_t)-1) {
+				EXIT_PF(0);
+			}
 
-		invlpg(faulting_address);
+			if(!zero) {
+				memcpy64((uint64_t*)(new_frame + HIGH_VMA), (uint64_t*)(original_frame + HIGH_VMA), PAGE_SIZE / 8);
+			}
 
-		page->paddr = new_frame;
-		page->reference = alloc(sizeof(int));
-		(*page->reference) = 1;
+			pmm_frame_map(new_frame, FRAME_ANON);
+			pmm_frame_unmap(original_frame);
+		}
+
+		uint64_t entry = new_frame | (pmll_entry & (0x1ff | VMM_FLAGS_NX)) | VMM_FLAGS_RW;
+		*lowest_level = entry;
+
+		if(new_frame != original_frame) { // other threads could still read through the old frame
+			tlb_invalidate(task->page_table, faulting_page);
+		} else {
+			invlpg(faulting_address);
+		}
 
 		EXIT_PF(1);
 	}
 
+	if(pmll_entry & VMM_FILE_FLAG) { // a page cache frame the mapping may not write to
+		EXIT_PF(0);
+	}
+
 	*lowest_level = *lowest_level | VMM_FLAGS_RW;
 	EXIT_PF(1);
 }
+
+void vmm_pf_handler(struct registers *regs, void *status) {
+	struct sched_task *task = CURRENT_TASK;
+	if(task == NULL) {
+		EXIT_PF(0);
+	}
+
+	struct page_table *page_table = task->page_table;
+
+	tlb_spinlock(&page_table->mm_lock);
+	vmm_fault(task, regs, status);
+	spinrelease(&page_table->mm_lock);
+}
+
+#ifdef VMM_FORK_BENCHMARK
+
+static void vmm_fork_benchmark_run(size_t resident) {
+	struct page_table *page_table = alloc(sizeof(struct page_table));
+	vmm_default_table(page_table);
+
+	size_t pages = resident / PAGE_SIZE;
+	uintptr_t base = (uintptr_t)mmap(page_table, NULL, resident, MMAP_PROT_READ | MMAP_PROT_WRITE | MMAP_PROT_USER,
+		MMAP_MAP_PRIVATE | MMAP_MAP_ANONYMOUS, -1, 0);
+
+	for(size_t i = 0; i < pages; i++) {
+		uint64_t frame = pmm_alloc_flags(1, 1, PMM_ALLOC_NOZERO);
+
+		page_table->map_page(page_table, base + i * PAGE_SIZE, frame, VMM_FLAGS_P | VMM_FLAGS_RW | VMM_FLAGS_US | VMM_FLAGS_NX);
+		pmm_frame_map(frame, FRAME_ANON);
+	}
+
+	uint64_t start = rdtsc();
+	struct page_table *child = vmm_fork_page_table(page_table);
+	uint64_t cycles = rdtsc() - start;
+
+	if(child == NULL) {
+		panic("vmm: fork benchmark ran out of memory");
+	}
+
+	print("vmm: fork of a %d MiB resident process took %d cycles, %d cycles/page\n", resident >> 20, cycles, cycles / pages);
+
+	vmm_destroy_page_table(child);
+	vmm_destroy_page_table(page_table);
+}
+
+void vmm_fork_benchmark() {
+	vmm_fork_benchmark_run(64ull << 20);
+	vmm_fork_benchmark_run(1ull << 30);
+}
+
+#endif
+
+#ifdef VMM_REGION_BENCHMARK
+
+#define VMM_REGION_BENCHMARK_CNT 100000
+
+void vmm_region_benchmark() {
+	struct page_table *page_table = alloc(sizeof(struct page_table));
+	vmm_default_table(page_table);
+
+	uintptr_t *bases = alloc(sizeof(uintptr_t) * VMM_REGION_BENCHMARK_CNT);
+
+	uint64_t start = rdtsc();
+
+	for(size_t i = 0; i < VMM_REGION_BENCHMARK_CNT; i++) { // alternate the protection so neighbours do not merge
+		int prot = MMAP_PROT_READ | MMAP_PROT_USER | ((i & 1) ? MMAP_PROT_WRITE : 0);
+		bases[i] = (uintptr_t)mmap(page_table, NULL, PAGE_SIZE, prot, MMAP_MAP_PRIVATE | MMAP_MAP_ANONYMOUS, -1, 0);
+	}
+
+	uint64_t map_cycles = rdtsc() - start;
+
+	start = rdtsc();
+
+	for(size_t i = 0; i < VMM_REGION_BENCHMARK_CNT; i++) {
+		vmm_anon_map(page_table, bases[i], true);
+	}
+
+	uint64_t fault_cycles = rdtsc() - start;
+
+	print("vmm: %d regions, tree depth %d\n", VMM_REGION_BENCHMARK_CNT, mmap_region_depth(page_table->mmap_region_root));
+	print("vmm: mmap %d cycles/region, fault %d cycles/page\n", map_cycles / VMM_REGION_BENCHMARK_CNT,
+		fault_cycles / VMM_REGION_BENCHMARK_CNT);
+
+	start = rdtsc();
+
+	for(size_t i = 0; i < VMM_REGION_BENCHMARK_CNT; i++) {
+		munmap(page_table, (void*)bases[i], PAGE_SIZE);
+	}
+
+	print("vmm: munmap %d cycles/region\n", (rdtsc() - start) / VMM_REGION_BENCHMARK_CNT);
+
+	free(bases);
+
+	vmm_destroy_page_table(page_table);
+}
+
+#endif
+
+#ifdef VMM_SELF_TEST
+
+#define VMM_SELF_TEST_ITERATIONS 100000
+#define VMM_SELF_TEST_PAGES 16
+#define VMM_SELF_TEST_FAR 0x100000000000 // a pml4 slot of its own, nothing else lands there
+
+static void vmm_self_test_touch(struct page_table *page_table, uintptr_t base, size_t pages) {
+	for(size_t i = 0; i < pages; i++) {
+		vmm_anon_map(page_table, base + i * PAGE_SIZE, true);
+	}
+}
+
+static uintptr_t vmm_self_test_map(struct page_table *page_table, uintptr_t hint, size_t length) {
+	uintptr_t base = (uintptr_t)mmap(page_table, (void*)hint, length, MMAP_PROT_READ | MMAP_PROT_WRITE | MMAP_PROT_USER,
+		MMAP_MAP_PRIVATE | MMAP_MAP_ANONYMOUS, -1, 0);
+	if(base == (uintptr_t)-1) {
+		panic("vmm: self test mmap failed");
+	}
+
+	vmm_self_test_touch(page_table, base, length / PAGE_SIZE);
+
+	return base;
+}
+
+// what a shell does for every command: fork, exec over the child, exit
+static void vmm_self_test_round(struct page_table *parent) {
+	struct page_table *child = vmm_fork_page_table(parent);
+	if(child == NULL) {
+		panic("vmm: self test fork ran out of memory");
+	}
+
+	struct page_table *image = alloc(sizeof(struct page_table));
+	vmm_default_table(image);
+
+	vmm_destroy_page_table(child);
+
+	uintptr_t base = vmm_self_test_map(image, 0, VMM_SELF_TEST_PAGES * PAGE_SIZE);
+	uintptr_t far = vmm_self_test_map(image, VMM_SELF_TEST_FAR, VMM_SELF_TEST_PAGES * PAGE_SIZE);
+
+	munmap(image, (void*)base, VMM_SELF_TEST_PAGES / 2 * PAGE_SIZE);
+	munmap(image, (void*)far, VMM_SELF_TEST_PAGES * PAGE_SIZE);
+
+	if(vmm_pml2_entry(image, far)) {
+		panic("vmm: self test munmap kept the tables of an empty range");
+	}
+
+	vmm_destroy_page_table(image);
+}
+
+void vmm_self_test() {
+	size_t before = pmm_free_page_cnt();
+
+	struct page_table *parent = alloc(sizeof(struct page_table));
+	vmm_default_table(parent);
+
+	vmm_self_test_map(parent, 0, VMM_SELF_TEST_PAGES * PAGE_SIZE);
+	vmm_self_test_map(parent, 0, VMM_HUGE_PAGE_SIZE);
+
+	vmm_self_test_round(parent); // the heap grows to its working set on the first round
+
+	size_t baseline = pmm_free_page_cnt();
+
+	print("vmm: self test, %d fork/exec/exit rounds\n", VMM_SELF_TEST_ITERATIONS);
+
+	uint64_t start = rdtsc();
+
+	for(size_t i = 0; i < VMM_SELF_TEST_ITERATIONS; i++) {
+		vmm_self_test_round(parent);
+
+		if(pmm_free_page_cnt() != baseline) {
+			panic("vmm: self test round %d leaked %d pages", i, baseline - pmm_free_page_cnt());
+		}
+	}
+
+	uint64_t cycles = rdtsc() - start;
+
+	vmm_destroy_page_table(parent);
+
+	print("vmm: self test passed: %d cycles/round, %d pages held by the heap afterwards\n",
+		cycles / VMM_SELF_TEST_ITERATIONS, before - pmm_free_page_cnt());
+}
+
+#endif
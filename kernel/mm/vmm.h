@@ -21,23 +21,17 @@
 #define VMM_PAT_WB 6
 #define VMM_PAT_UCM 7
 
+#define VMM_PADDR_MASK 0x000ffffffffff000ull
+
+#define VMM_HUGE_PAGE_SIZE 0x200000ull
+#define VMM_PML2_SPAN 0x40000000ull // mapped through one pml2 table
+#define VMM_HUGE_PAGE_PAGES 512
+
 #define VMM_COW_FLAG (1 << 9)
 #define VMM_FILE_FLAG (1 << 10)
 #define VMM_SHARE_FLAG (1 << 11)
-
-struct page {
-	uint64_t paddr;
-	uint64_t vaddr;
-	uint64_t size;
-	uint64_t flags;
-
-	struct vfs_node *node;
-	off_t offset;
-
-	uint64_t *pml_entry;
-
-	int *reference;
-};
+#define VMM_INACTIVE_FLAG (1ull << 52) // reclaim found the page unreferenced once already
+#define VMM_SWAP_FLAG (1ull << 53) // not present, the paddr bits hold a swap slot
 
 struct mmap_region {
 	uintptr_t base;
@@ -47,6 +41,15 @@ struct mmap_region {
 	int fd;
 	off_t offset;
 
+	struct vfs_node *node;
+
+	uintptr_t ra_next; // where a sequential reader faults next
+	size_t ra_window;
+
+	size_t gap; // free space between the previous region and this one
+	size_t max_gap; // largest gap in this subtree
+	bool red;
+
 	struct mmap_region *left;
 	struct mmap_region *right;
 	struct mmap_region *parent;
@@ -58,21 +61,39 @@ struct page_table {
 	uint64_t *(*lowest_level)(struct page_table *page_table, uintptr_t vaddr);
 
 	struct mmap_region *mmap_region_root;
-	uint64_t mmap_bump_base;
-
-	struct hash_table *pages;
+	uint64_t mmap_base; // top down allocations start below this
+	bool mmap_top_down;
 
 	uint64_t *pml_high;
 
+	uint16_t pcid;
+	uint64_t active_cpus;
+	uint64_t stale_cpus;
+
+	uintptr_t thp_scan_cursor;
+
+	struct page_table *list_next;
+	struct page_table *list_prev;
+
 	char lock;
+	char mm_lock; // faults, mmap and munmap against the reclaim, ksm and thp scanners on other cores
 };
 
 extern struct page_table kernel_mappings;
+extern uint64_t vmm_zero_page;
 
 void vmm_init();
 void vmm_init_page_table(struct page_table *page_table);
 void vmm_map_range(struct page_table *page_table, uintptr_t vaddr, uint64_t cnt, uint64_t flags);
 void vmm_unmap_range(struct page_table *page_table, uintptr_t vaddr, uint64_t cnt);
 void vmm_default_table(struct page_table *page_table);
+uint64_t *vmm_pml2_entry(struct page_table *page_table, uintptr_t vaddr);
+
+struct page_table *vmm_page_table_next(struct page_table *page_table);
+void vmm_prune_tables(struct page_table *page_table, uintptr_t base, uintptr_t end);
 
 struct page_table *vmm_fork_page_table(struct page_table *page_table);
+void vmm_destroy_page_table(struct page_table *page_table);
+void vmm_fork_benchmark();
+void vmm_region_benchmark();
+void vmm_self_test();
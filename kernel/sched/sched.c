@@ -7,11 +7,16 @@
 #include <debug.h>
 #include <elf.h>
 #include <mm/mmap.h>
+#include <mm/thp.h>
+#include <mm/reclaim.h>
+#include <mm/ksm.h>
+#include <mm/tlb.h>
 #include <types.h>
 #include <errno.h>
 #include <fs/fd.h>
 #include <drivers/terminal.h>
 #include <time.h>
+#include <drivers/hpet.h>
 
 static struct hash_table task_list;
 static struct hash_table session_list;
@@ -30,6 +35,21 @@ static struct bitmap sid_bitmap = {
 
 char sched_lock;
 
+// the flag and the lock change together with interrupts off, reschedule can never catch one without the other
+static void sched_lock_acquire() {
+	uint64_t rflags = interrupts_save();
+	spinlock(&sched_lock);
+	CORE_LOCAL->run_queue->sched_lock_held = true;
+	interrupts_restore(rflags);
+}
+
+static void sched_lock_release() {
+	uint64_t rflags = interrupts_save();
+	CORE_LOCAL->run_queue->sched_lock_held = false;
+	spinrelease(&sched_lock);
+	interrupts_restore(rflags);
+}
+
 // does not lock **remember**
 struct sched_task *sched_translate_pid(pid_t pid) {
 	return hash_table_search(&task_list, &pid, sizeof(pid));
@@ -45,99 +65,656 @@ struct sched_thread *sched_translate_tid(pid_t pid, tid_t tid) {
 	return hash_table_search(&task->thread_list, &tid, sizeof(tid));
 }
 
-struct sched_thread *find_next_thread(struct sched_task *task) {
-	struct sched_thread *ret = NULL;
+// nice 0 is 1024, every level apart is worth about 10% of cpu time
+static const uint32_t sched_nice_weight[40] = {
+	88761, 71755, 56483, 46273, 36291,
+	29154, 23254, 18705, 14949, 11916,
+	9548, 7620, 6100, 4904, 3906,
+	3121, 2501, 1991, 1586, 1277,
+	1024, 820, 655, 526, 423,
+	335, 272, 215, 172, 137,
+	110, 87, 70, 56, 45,
+	36, 29, 23, 18, 15
+};
+
+// runnable threads sit in a red-black tree ordered by vruntime, the leftmost one runs next
+
+static inline bool sched_thread_red(struct sched_thread *thread) {
+	return thread && thread->rb_red;
+}
+
+static void sched_queue_replace_child(struct sched_queue *queue, struct sched_thread *parent,
+	struct sched_thread *old, struct sched_thread *new) {
+	if(parent == NULL) {
+		queue->root = new;
+	} else if(parent->rb_left == old) {
+		parent->rb_left = new;
+	} else {
+		parent->rb_right = new;
+	}
 
-	for(size_t i = 0, cnt = 0; i < task->thread_list.capacity; i++) {
-		if(task->thread_list.data[i] == NULL) {
-			continue;
+	if(new) {
+		new->rb_parent = parent;
+	}
+}
+
+static void sched_queue_rotate_left(struct sched_queue *queue, struct sched_thread *thread) {
+	struct sched_thread *pivot = thread->rb_right;
+
+	thread->rb_right = pivot->rb_left;
+	if(pivot->rb_left) pivot->rb_left->rb_parent = thread;
+
+	sched_queue_replace_child(queue, thread->rb_parent, thread, pivot);
+
+	pivot->rb_left = thread;
+	thread->rb_parent = pivot;
+}
+
+static void sched_queue_rotate_right(struct sched_queue *queue, struct sched_thread *thread) {
+	struct sched_thread *pivot = thread->rb_left;
+
+	thread->rb_left = pivot->rb_right;
+	if(pivot->rb_right) pivot->rb_right->rb_parent = thread;
+
+	sched_queue_replace_child(queue, thread->rb_parent, thread, pivot);
+
+	pivot->rb_right = thread;
+	thread->rb_parent = pivot;
+}
+
+static struct sched_thread *sched_queue_next(struct sched_thread *thread) {
+	if(thread->rb_right) {
+		thread = thread->rb_right;
+		while(thread->rb_left) thread = thread->rb_left;
+		return thread;
+	}
+
+	while(thread->rb_parent && thread == thread->rb_parent->rb_right) {
+		thread = thread->rb_parent;
+	}
+
+	return thread->rb_parent;
+}
+
+static struct sched_thread *sched_queue_prev(struct sched_thread *thread) {
+	if(thread->rb_left) {
+		thread = thread->rb_left;
+		while(thread->rb_right) thread = thread->rb_right;
+		return thread;
+	}
+
+	while(thread->rb_parent && thread == thread->rb_parent->rb_left) {
+		thread = thread->rb_parent;
+	}
+
+	return thread->rb_parent;
+}
+
+static struct sched_thread *sched_queue_last(struct sched_queue *queue) {
+	struct sched_thread *thread = queue->root;
+
+	while(thread && thread->rb_right) {
+		thread = thread->rb_right;
+	}
+
+	return thread;
+}
+
+static void sched_queue_insert_fixup(struct sched_queue *queue, struct sched_thread *thread) {
+	while(sched_thread_red(thread->rb_parent)) {
+		struct sched_thread *parent = thread->rb_parent;
+		struct sched_thread *grandparent = parent->rb_parent;
+
+		if(parent == grandparent->rb_left) {
+			struct sched_thread *uncle = grandparent->rb_right;
+
+			if(sched_thread_red(uncle)) {
+				parent->rb_red = false;
+				uncle->rb_red = false;
+				grandparent->rb_red = true;
+				thread = grandparent;
+				continue;
+			}
+
+			if(thread == parent->rb_right) {
+				thread = parent;
+				sched_queue_rotate_left(queue, thread);
+				parent = thread->rb_parent;
+			}
+
+			parent->rb_red = false;
+			grandparent->rb_red = true;
+			sched_queue_rotate_right(queue, grandparent);
+		} else {
+			struct sched_thread *uncle = grandparent->rb_left;
+
+			if(sched_thread_red(uncle)) {
+				parent->rb_red = false;
+				uncle->rb_red = false;
+				grandparent->rb_red = true;
+				thread = grandparent;
+				continue;
+			}
+
+			if(thread == parent->rb_left) {
+				thread = parent;
+				sched_queue_rotate_right(queue, thread);
+				parent = thread->rb_parent;
+			}
+
+			parent->rb_red = false;
+			grandparent->rb_red = true;
+			sched_queue_rotate_left(queue, grandparent);
+		}
+	}
+
+	queue->root->rb_red = false;
+}
+
+static void sched_queue_remove_fixup(struct sched_queue *queue, struct sched_thread *thread, struct sched_thread *parent) {
+	while(thread != queue->root && !sched_thread_red(thread)) {
+		if(thread == parent->rb_left) {
+			struct sched_thread *sibling = parent->rb_right;
+
+			if(sched_thread_red(sibling)) {
+				sibling->rb_red = false;
+				parent->rb_red = true;
+				sched_queue_rotate_left(queue, parent);
+				sibling = parent->rb_right;
+			}
+
+			if(!sched_thread_red(sibling->rb_left) && !sched_thread_red(sibling->rb_right)) {
+				sibling->rb_red = true;
+				thread = parent;
+				parent = thread->rb_parent;
+				continue;
+			}
+
+			if(!sched_thread_red(sibling->rb_right)) {
+				sibling->rb_left->rb_red = false;
+				sibling->rb_red = true;
+				sched_queue_rotate_right(queue, sibling);
+				sibling = parent->rb_right;
+			}
+
+			sibling->rb_red = parent->rb_red;
+			parent->rb_red = false;
+			sibling->rb_right->rb_red = false;
+			sched_queue_rotate_left(queue, parent);
+		} else {
+			struct sched_thread *sibling = parent->rb_left;
+
+			if(sched_thread_red(sibling)) {
+				sibling->rb_red = false;
+				parent->rb_red = true;
+				sched_queue_rotate_right(queue, parent);
+				sibling = parent->rb_left;
+			}
+
+			if(!sched_thread_red(sibling->rb_left) && !sched_thread_red(sibling->rb_right)) {
+				sibling->rb_red = true;
+				thread = parent;
+				parent = thread->rb_parent;
+				continue;
+			}
+
+			if(!sched_thread_red(sibling->rb_left)) {
+				sibling->rb_right->rb_red = false;
+				sibling->rb_red = true;
+				sched_queue_rotate_left(queue, sibling);
+				sibling = parent->rb_left;
+			}
+
+			sibling->rb_red = parent->rb_red;
+			parent->rb_red = false;
+			sibling->rb_left->rb_red = false;
+			sched_queue_rotate_right(queue, parent);
+		}
+
+		thread = queue->root;
+	}
+
+	if(thread) {
+		thread->rb_red = false;
+	}
+}
+
+static uint32_t sched_thread_weight(struct sched_thread *thread) {
+	return sched_nice_weight[thread->task->nice - SCHED_NICE_MIN];
+}
+
+// equal vruntimes go right so threads that were waiting already stay ahead
+static void sched_queue_insert(struct sched_queue *queue, struct sched_thread *thread) {
+	struct sched_thread **link = &queue->root;
+	struct sched_thread *parent = NULL;
+	bool leftmost = true;
+
+	while(*link) {
+		parent = *link;
+
+		if((int64_t)(thread->vruntime - parent->vruntime) < 0) {
+			link = &parent->rb_left;
+		} else {
+			link = &parent->rb_right;
+			leftmost = false;
+		}
+	}
+
+	thread->rb_parent = parent;
+	thread->rb_left = NULL;
+	thread->rb_right = NULL;
+	thread->rb_red = true;
+
+	*link = thread;
+
+	if(leftmost) {
+		queue->leftmost = thread;
+	}
+
+	sched_queue_insert_fixup(queue, thread);
+
+	thread->queue = queue;
+	thread->queued = true;
+	thread->weight = sched_thread_weight(thread);
+
+	queue->cnt++;
+	queue->weight += thread->weight;
+}
+
+static void sched_queue_remove(struct sched_queue *queue, struct sched_thread *thread) {
+	if(queue->leftmost == thread) {
+		queue->leftmost = sched_queue_next(thread);
+	}
+
+	struct sched_thread *child;
+	struct sched_thread *parent;
+	bool removed_red = thread->rb_red;
+
+	if(thread->rb_left == NULL || thread->rb_right == NULL) {
+		child = thread->rb_left ? thread->rb_left : thread->rb_right;
+		parent = thread->rb_parent;
+
+		sched_queue_replace_child(queue, thread->rb_parent, thread, child);
+	} else { // the successor takes over the slot of the thread
+		struct sched_thread *successor = thread->rb_right;
+		while(successor->rb_left) successor = successor->rb_left;
+
+		removed_red = successor->rb_red;
+		child = successor->rb_right;
+
+		if(successor->rb_parent == thread) {
+			parent = successor;
+		} else {
+			parent = successor->rb_parent;
+
+			sched_queue_replace_child(queue, successor->rb_parent, successor, successor->rb_right);
+
+			successor->rb_right = thread->rb_right;
+			successor->rb_right->rb_parent = successor;
 		}
 
-		struct sched_thread *next_thread = task->thread_list.data[i];
-		next_thread->idle_cnt++;
+		sched_queue_replace_child(queue, thread->rb_parent, thread, successor);
 
-		if(next_thread->status == TASK_WAITING && cnt < next_thread->idle_cnt) {
-			cnt = next_thread->idle_cnt;
-			ret = next_thread;
+		successor->rb_left = thread->rb_left;
+		successor->rb_left->rb_parent = successor;
+		successor->rb_red = thread->rb_red;
+	}
+
+	if(!removed_red) {
+		sched_queue_remove_fixup(queue, child, parent);
+	}
+
+	thread->rb_parent = NULL;
+	thread->rb_left = NULL;
+	thread->rb_right = NULL;
+	thread->queued = false;
+
+	queue->cnt--;
+	queue->weight -= thread->weight;
+}
+
+// never moves backwards, sleepers and migrated threads are placed relative to it
+static void sched_queue_update_min_vruntime(struct sched_queue *queue) {
+	struct sched_thread *current = queue->current;
+	uint64_t vruntime = queue->min_vruntime;
+
+	if(current && current->running) {
+		vruntime = current->vruntime;
+	}
+
+	if(queue->leftmost && (current == NULL || !current->running || (int64_t)(queue->leftmost->vruntime - vruntime) < 0)) {
+		vruntime = queue->leftmost->vruntime;
+	}
+
+	if((int64_t)(vruntime - queue->min_vruntime) > 0) {
+		queue->min_vruntime = vruntime;
+	}
+}
+
+// charge the running thread for the time since it was last accounted, scaled by its weight
+static void sched_queue_update_current(struct sched_queue *queue, struct sched_thread *thread, uint64_t now) {
+	uint64_t delta = now - thread->exec_start;
+
+	thread->exec_start = now;
+	thread->vruntime += delta * SCHED_NICE_0_WEIGHT / sched_thread_weight(thread);
+
+	sched_queue_update_min_vruntime(queue);
+}
+
+// every runnable thread gets a turn within the latency target, in proportion to its weight
+static uint64_t sched_queue_slice(struct sched_queue *queue, struct sched_thread *thread) {
+	uint64_t weight = sched_thread_weight(thread);
+	uint64_t slice = SCHED_LATENCY_NS * weight / (queue->weight + weight);
+
+	return slice < SCHED_MIN_GRANULARITY_NS ? SCHED_MIN_GRANULARITY_NS : slice;
+}
+
+// a thread that slept keeps half a latency period of credit, enough to run ahead of cpu hogs but not to starve them,
+// one that never ran gets none so forking can not be used to jump the queue
+static void sched_queue_place(struct sched_queue *queue, struct sched_thread *thread) {
+	uint64_t vruntime = queue->min_vruntime - SCHED_LATENCY_NS / 2;
+
+	if(thread->exec_start == 0) {
+		vruntime = queue->min_vruntime;
+	} else if(queue->min_vruntime < SCHED_LATENCY_NS / 2) {
+		vruntime = 0;
+	}
+
+	if((int64_t)(thread->vruntime - vruntime) < 0) {
+		thread->vruntime = vruntime;
+	}
+}
+
+static size_t sched_queue_load(struct sched_queue *queue) {
+	return __atomic_load_n(&queue->cnt, __ATOMIC_RELAXED) + !__atomic_load_n(&queue->idle, __ATOMIC_RELAXED);
+}
+
+// new threads go to the least loaded core, after that a thread stays with the core it last ran on
+static struct sched_queue *sched_thread_queue(struct sched_thread *thread) {
+	if(thread->queue) {
+		return thread->queue;
+	}
+
+	struct sched_queue *queue = CORE_LOCAL->run_queue;
+
+	for(size_t i = 0; i < cpu_local_list.length; i++) {
+		struct sched_queue *candidate = cpu_local_list.data[i]->run_queue;
+
+		if(sched_queue_load(candidate) < sched_queue_load(queue)) {
+			queue = candidate;
 		}
 	}
 
-	return ret;
+	thread->queue = queue;
+
+	return queue;
 }
 
-struct sched_task *find_next_task() {
-	struct sched_task *ret = NULL;
+// the balancer may move a queued thread between looking up its queue and locking it
+static struct sched_queue *sched_thread_lock(struct sched_thread *thread) {
+	for(;;) {
+		struct sched_queue *queue = sched_thread_queue(thread);
+
+		spinlock(&queue->lock);
 
-	for(size_t i = 0, cnt = 0; i < task_list.capacity; i++) {
-		if(task_list.data[i] == NULL) {
+		if(thread->queue == queue) {
+			return queue;
+		}
+
+		spinrelease(&queue->lock);
+	}
+}
+
+static void sched_lock_pair(struct sched_queue *a, struct sched_queue *b) {
+	if(a < b) {
+		spinlock(&a->lock);
+		spinlock(&b->lock);
+	} else {
+		spinlock(&b->lock);
+		spinlock(&a->lock);
+	}
+}
+
+// only threads preempted in userspace move, kernel code may hold on to per-core state
+static bool sched_can_migrate(struct sched_queue *src, struct sched_thread *thread, bool idle) {
+	if((thread->regs.cs & 0x3) == 0) {
+		return false;
+	}
+
+	return idle || src->ticks - thread->last_ran >= SCHED_CACHE_HOT_TICKS;
+}
+
+// an idle core takes whatever it can get, the periodic pass only evens out a real imbalance
+static void sched_balance(struct sched_queue *queue, bool idle) {
+	struct sched_queue *busiest = NULL;
+
+	if(!idle && __atomic_load_n(&queue->cnt, __ATOMIC_RELAXED)) { // idle cores do not tick, wake one to steal from here
+		for(size_t i = 0; i < cpu_local_list.length; i++) {
+			struct sched_queue *candidate = cpu_local_list.data[i]->run_queue;
+
+			if(candidate != queue && __atomic_load_n(&candidate->idle, __ATOMIC_RELAXED)) {
+				xapic_send_ipi(candidate->apic_id, 32);
+				break;
+			}
+		}
+	}
+
+	for(size_t i = 0; i < cpu_local_list.length; i++) {
+		struct sched_queue *candidate = cpu_local_list.data[i]->run_queue;
+
+		if(candidate != queue && __atomic_load_n(&candidate->cnt, __ATOMIC_RELAXED) &&
+			(busiest == NULL || sched_queue_load(candidate) > sched_queue_load(busiest))) {
+			busiest = candidate;
+		}
+	}
+
+	if(busiest == NULL || (!idle && sched_queue_load(busiest) < sched_queue_load(queue) + SCHED_BALANCE_IMBALANCE)) {
+		return;
+	}
+
+	sched_lock_pair(queue, busiest);
+
+	// from the right, the threads that would wait longest there, preferring one that last ran here
+	struct sched_thread *thread = NULL;
+
+	for(struct sched_thread *next = sched_queue_last(busiest); next; next = sched_queue_prev(next)) {
+		if(!sched_can_migrate(busiest, next, idle)) {
 			continue;
 		}
 
-		struct sched_task *next_task = task_list.data[i];
-		next_task->idle_cnt++;
+		if(thread == NULL || next->last_cpu == queue->cpu) {
+			thread = next;
+		}
 
-		if(next_task->status == TASK_WAITING && cnt < next_task->idle_cnt) {
-			cnt = next_task->idle_cnt;
-			ret = next_task;
+		if(thread->last_cpu == queue->cpu) {
+			break;
 		}
 	}
 
-	return ret;
+	if(thread) {
+		sched_queue_remove(busiest, thread);
+
+		// vruntime only means something relative to the queue it was earned on
+		thread->vruntime = thread->vruntime - busiest->min_vruntime + queue->min_vruntime;
+
+		sched_queue_insert(queue, thread);
+		thread->last_ran = queue->ticks; // hot on its new core so it does not bounce straight back
+
+		busiest->migrations_out++;
+
+		if(idle) queue->idle_steals++;
+		else queue->balance_pulls++;
+	}
+
+	spinrelease(&busiest->lock);
+	spinrelease(&queue->lock);
 }
 
-void sched_idle() {
-	xapic_write(XAPIC_EOI_OFF, 0);
-	spinrelease(&sched_lock);
+// an idle core sleeps until it is kicked, a busy one is preempted when the woken thread is owed enough
+static void sched_kick(struct sched_queue *queue, struct sched_thread *thread) {
+	struct sched_thread *current = queue->current;
 
+	if(queue->idle) {
+		xapic_send_ipi(queue->apic_id, 32);
+	} else if(current && current->running && (int64_t)(thread->vruntime + SCHED_WAKEUP_GRANULARITY_NS - current->vruntime) < 0) {
+		queue->wakeup_preemptions++;
+		xapic_send_ipi(queue->apic_id, 32);
+	}
+}
+
+struct sched_queue *sched_queue_create(int cpu, int apic_id) {
+	struct sched_queue *queue = alloc(sizeof(struct sched_queue));
+
+	queue->cpu = cpu;
+	queue->apic_id = apic_id;
+	queue->idle = true;
+	queue->deadline = -1;
+	queue->idle_stack = pmm_alloc(DIV_ROUNDUP(THREAD_KERNEL_STACK_SIZE, PAGE_SIZE), 1) + THREAD_KERNEL_STACK_SIZE + HIGH_VMA;
+
+	return queue;
+}
+
+static void sched_idle_loop() {
 	asm volatile ("sti");
 
 	for(;;) {
+		pmm_zero_idle();
 		asm volatile ("hlt");
 	}
 }
 
+// the next event of the core: the end of the running slice, a tick so a busy core still balances and keeps
+// the housekeeping going, and on the bsp the first timer. an idle core with no timers is only woken by a kick
+static void sched_arm_timer(struct sched_queue *queue, uint64_t now) {
+	struct sched_thread *current = queue->current;
+	uint64_t deadline = -1;
+
+	if(!queue->idle && current) {
+		deadline = now + SCHED_TICK_NS;
+
+		if(queue->cnt) {
+			uint64_t slice_end = current->slice_start + sched_queue_slice(queue, current);
+
+			if(slice_end < deadline) {
+				deadline = slice_end;
+			}
+		}
+	}
+
+	if(queue->cpu == 0 && timer_next_deadline() < deadline) {
+		deadline = timer_next_deadline();
+	}
+
+	queue->deadline = deadline;
+
+	if(deadline == (uint64_t)-1) {
+		apic_timer_stop();
+	} else {
+		apic_timer_oneshot(deadline > now ? deadline - now : 0);
+	}
+}
+
+// the interrupted context is dropped, idling from the top of the idle stack keeps wakeups from piling up frames
+static void sched_idle(struct sched_queue *queue, uint64_t now) {
+	queue->current = NULL;
+	queue->idle = true;
+
+	CORE_LOCAL->pid = -1;
+	CORE_LOCAL->tid = -1;
+	CORE_LOCAL->task = NULL;
+	CORE_LOCAL->thread = NULL;
+
+	// the last address space may go away while the core sleeps
+	CORE_LOCAL->page_table = &kernel_mappings;
+	vmm_init_page_table(&kernel_mappings);
+
+	sched_arm_timer(queue, now);
+
+	xapic_write(XAPIC_EOI_OFF, 0);
+	spinrelease(&queue->lock);
+
+	asm volatile (
+		"mov %0, %%rsp\n\t"
+		"call *%1\n\t"
+		:: "r" (queue->idle_stack), "r" (sched_idle_loop)
+	);
+
+	__builtin_unreachable();
+}
+
 void reschedule(struct registers *regs, void*) {
-	if(__atomic_test_and_set(&sched_lock, __ATOMIC_ACQUIRE)) {
+	struct sched_queue *queue = CORE_LOCAL->run_queue;
+
+	uint64_t now = hpet_nanoseconds();
+
+	queue->interrupts++;
+
+	if(queue->idle) queue->idle_wakeups++;
+	if(now >= queue->deadline) queue->timer_expiries++;
+
+	if(queue->sched_lock_held) { // never switch away from whoever is changing the task list
+		queue->deadline = now + SCHED_MIN_GRANULARITY_NS; // and come back soon, whatever woke the core may still be waiting
+		apic_timer_oneshot(SCHED_MIN_GRANULARITY_NS);
 		return;
 	}
 
-	struct sched_task *next_task = find_next_task();
-	if(next_task == NULL) {
-		if(CORE_LOCAL->tid != -1 && CORE_LOCAL->pid != -1) {
-			spinrelease(&sched_lock);
-			return;
-		}
-		sched_idle();
+	clock_update(now);
+
+	if(CORE_LOCAL->cpu_number == 0) { // their intervals count ticks of one core
+		timer_expire(now);
+		reclaim_tick();
+		ksm_tick();
+		thp_collapse_tick();
 	}
 
-	struct sched_thread *next_thread = find_next_thread(next_task);
-	if(next_thread == NULL) {
-		if(CORE_LOCAL->tid != -1 && CORE_LOCAL->pid != -1) {
-			spinrelease(&sched_lock);
-			return;
-		}
-		sched_idle();
+	bool runnable = CORE_LOCAL->pid != -1 && CORE_LOCAL->tid != -1 && queue->current && queue->current->status != TASK_YIELD;
+
+	if(++queue->ticks % SCHED_BALANCE_INTERVAL == 0 || (queue->cnt == 0 && !runnable)) {
+		sched_balance(queue, queue->cnt == 0 && !runnable);
 	}
 
+	spinlock(&queue->lock);
+
+	now = hpet_nanoseconds();
+
+	struct sched_thread *last_thread = NULL;
 	if(CORE_LOCAL->tid != -1 && CORE_LOCAL->pid != -1) {
-		struct sched_task *last_task = sched_translate_pid(CORE_LOCAL->pid);
-		if(last_task == NULL) {
-			sched_idle();
-		}
+		last_thread = queue->current;
+	}
 
-		struct sched_thread *last_thread = sched_translate_tid(CORE_LOCAL->pid, CORE_LOCAL->tid);
-		if(last_thread == NULL) {
-			sched_idle();
-		}
+	if(last_thread) {
+		sched_queue_update_current(queue, last_thread, now);
+	}
+
+	struct sched_thread *next_thread = queue->leftmost;
+
+	// a runnable thread keeps the core until its slice is used up or the leftmost one is owed more than the granularity
+	if(last_thread && last_thread->status != TASK_YIELD && (next_thread == NULL ||
+		(now - last_thread->slice_start < sched_queue_slice(queue, last_thread) &&
+		(int64_t)(last_thread->vruntime - next_thread->vruntime) <= (int64_t)SCHED_WAKEUP_GRANULARITY_NS))) {
+		last_thread->task->event_waiting = 0; // woken before it was switched out
+
+		sched_arm_timer(queue, now);
+		spinrelease(&queue->lock);
+		return;
+	}
+
+	// a blocked thread is switched out even with nothing to run, the core idles instead of spinning on it
+	if(last_thread) {
+		struct sched_task *last_task = last_thread->task;
 
 		if(last_thread->status != TASK_YIELD) {
 			last_thread->status = TASK_WAITING;
+			sched_queue_insert(queue, last_thread);
 		}
 
 		if(last_task->status != TASK_YIELD) {
 			last_task->status = TASK_WAITING;
 		}
 
+		last_thread->running = false;
+		last_thread->last_ran = queue->ticks;
+
 		last_thread->errno = CORE_LOCAL->errno;
 		last_thread->regs = *regs;
 		last_thread->user_fs_base = get_user_fs();
@@ -145,8 +722,18 @@ void reschedule(struct registers *regs, void*) {
 		last_thread->user_stack = CORE_LOCAL->user_stack;
 	}
 
+	if(next_thread == NULL) {
+		sched_idle(queue, now);
+	}
+
+	sched_queue_remove(queue, next_thread);
+
+	struct sched_task *next_task = next_thread->task;
+
 	CORE_LOCAL->pid = next_task->pid;
 	CORE_LOCAL->tid = next_thread->tid;
+	CORE_LOCAL->task = next_task;
+	CORE_LOCAL->thread = next_thread;
 	CORE_LOCAL->errno = next_thread->errno;
 	CORE_LOCAL->kernel_stack = next_thread->kernel_stack;
 	CORE_LOCAL->user_stack = next_thread->user_stack;
@@ -155,10 +742,19 @@ void reschedule(struct registers *regs, void*) {
 
 	vmm_init_page_table(CORE_LOCAL->page_table);
 
-	next_thread->idle_cnt = 0;
-	next_task->idle_cnt = 0;
+	queue->current = next_thread;
+	queue->idle = false;
+	queue->switches++;
+
+	next_thread->last_cpu = queue->cpu;
+	next_thread->exec_start = now;
+	next_thread->slice_start = now;
+
 	next_task->status = TASK_RUNNING;
 	next_thread->status = TASK_RUNNING;
+	next_thread->running = true;
+
+	sched_queue_update_min_vruntime(queue);
 
 	set_user_fs(next_thread->user_fs_base);
 	set_user_gs(next_thread->user_gs_base);
@@ -200,8 +796,10 @@ void reschedule(struct registers *regs, void*) {
 		swapgs();
 	}
 
+	sched_arm_timer(queue, now);
+
 	xapic_write(XAPIC_EOI_OFF, 0);
-	spinrelease(&sched_lock);
+	spinrelease(&queue->lock);
 
 	asm volatile (
 		"mov %0, %%rsp\n\t"
@@ -227,12 +825,22 @@ void reschedule(struct registers *regs, void*) {
 }
 
 void sched_dequeue(struct sched_task *task, struct sched_thread *thread) {
-	spinlock(&sched_lock);
+	uint64_t rflags = interrupts_save();
+	struct sched_queue *queue = sched_thread_lock(thread);
 
 	task->status = TASK_YIELD;
 	thread->status = TASK_YIELD;
 
-	spinrelease(&sched_lock);
+	if(thread->queued) {
+		sched_queue_remove(queue, thread);
+	}
+
+	if(thread->running) { // without a periodic tick its core would keep running it until the slice ends
+		xapic_send_ipi(queue->apic_id, 32);
+	}
+
+	spinrelease(&queue->lock);
+	interrupts_restore(rflags);
 }
 
 
@@ -241,8 +849,7 @@ void sched_dequeue_and_yield(struct sched_task *task, struct sched_thread *threa
 
 	sched_dequeue(task, thread);
 
-	xapic_write(XAPIC_ICR_OFF + 0x10, CORE_LOCAL->apic_id << 24);
-	xapic_write(XAPIC_ICR_OFF, 32);
+	xapic_send_ipi(CORE_LOCAL->apic_id, 32);
 
 	asm volatile ("sti");
 
@@ -251,16 +858,22 @@ void sched_dequeue_and_yield(struct sched_task *task, struct sched_thread *threa
 	}
 }
 
+// a thread still on its core is queued by reschedule once it is switched out
 void sched_requeue(struct sched_task *task, struct sched_thread *thread) {
-	spinlock(&sched_lock);
+	uint64_t rflags = interrupts_save();
+	struct sched_queue *queue = sched_thread_lock(thread);
 
 	task->status = TASK_WAITING;
-	task->idle_cnt = TASK_MAX_PRIORITY;
-
 	thread->status = TASK_WAITING;
-	thread->idle_cnt = TASK_MAX_PRIORITY;
 
-	spinrelease(&sched_lock);
+	if(!thread->queued && !thread->running) {
+		sched_queue_place(queue, thread);
+		sched_queue_insert(queue, thread);
+		sched_kick(queue, thread);
+	}
+
+	spinrelease(&queue->lock);
+	interrupts_restore(rflags);
 }
 
 void sched_requeue_and_yield(struct sched_task *task, struct sched_thread *thread) {
@@ -268,8 +881,7 @@ void sched_requeue_and_yield(struct sched_task *task, struct sched_thread *threa
 
 	sched_requeue(task, thread);
 
-	xapic_write(XAPIC_ICR_OFF + 0x10, CORE_LOCAL->apic_id << 24);
-	xapic_write(XAPIC_ICR_OFF, 32);
+	xapic_send_ipi(CORE_LOCAL->apic_id, 32);
 
 	asm volatile ("sti");
 
@@ -278,9 +890,35 @@ void sched_requeue_and_yield(struct sched_task *task, struct sched_thread *threa
 	}
 }
 
+size_t sched_get_stats(struct sched_queue_stats *stats, size_t cnt) {
+	size_t i = 0;
+
+	for(; i < cpu_local_list.length && i < cnt; i++) {
+		struct sched_queue *queue = cpu_local_list.data[i]->run_queue;
+
+		stats[i] = (struct sched_queue_stats) {
+			.cpu = queue->cpu,
+			.apic_id = queue->apic_id,
+			.queued = queue->cnt,
+			.idle = queue->idle,
+			.ticks = queue->ticks,
+			.switches = queue->switches,
+			.interrupts = queue->interrupts,
+			.idle_wakeups = queue->idle_wakeups,
+			.timer_expiries = queue->timer_expiries,
+			.wakeup_preemptions = queue->wakeup_preemptions,
+			.min_vruntime = queue->min_vruntime,
+			.idle_steals = queue->idle_steals,
+			.balance_pulls = queue->balance_pulls,
+			.migrations_out = queue->migrations_out
+		};
+	}
+
+	return stats == NULL ? cpu_local_list.length : i;
+}
+
 void sched_yield() {
-	xapic_write(XAPIC_ICR_OFF + 0x10, CORE_LOCAL->apic_id << 24);
-	xapic_write(XAPIC_ICR_OFF, 32);
+	xapic_send_ipi(CORE_LOCAL->apic_id, 32);
 
 	for(;;) {
 		asm volatile ("hlt");
@@ -329,9 +967,10 @@ struct sched_thread *sched_default_thread(struct sched_task *task) {
 
 	thread->pid = task->pid;
 	thread->tid = bitmap_alloc(&task->tid_bitmap);
+	thread->task = task;
 	thread->status = TASK_YIELD;
 
-	thread->kernel_stack = pmm_alloc(DIV_ROUNDUP(THREAD_KERNEL_STACK_SIZE, PAGE_SIZE), 1) + THREAD_KERNEL_STACK_SIZE + HIGH_VMA;
+	thread->kernel_stack = pmm_alloc_flags(DIV_ROUNDUP(THREAD_KERNEL_STACK_SIZE, PAGE_SIZE), 1, PMM_ALLOC_NOZERO) + THREAD_KERNEL_STACK_SIZE + HIGH_VMA;
 
 	hash_table_push(&task->thread_list, &thread->tid, thread, sizeof(thread->tid));
 
@@ -418,7 +1057,7 @@ struct sched_thread *sched_thread_exec(struct sched_task *task, uint64_t rip, ui
 }
 
 struct sched_task *sched_task_exec(const char *path, uint16_t cs, struct sched_arguments *arguments, int status) {
-	spinlock(&sched_lock);
+	sched_lock_acquire();
 
 	struct sched_task *task = sched_default_task();
 
@@ -431,12 +1070,14 @@ struct sched_task *sched_task_exec(const char *path, uint16_t cs, struct sched_a
 	struct sched_thread *current_thread = CURRENT_THREAD;
 
 	CORE_LOCAL->pid = task->pid;
+	CORE_LOCAL->task = task;
 
 	int fd = fd_openat(AT_FDCWD, path, O_RDONLY, 0);
 	if(fd == -1) {
 		fd_close(fd);
 		CORE_LOCAL->pid = current_task->pid;
-		spinrelease(&sched_lock);
+		CORE_LOCAL->task = current_task;
+		sched_lock_release();
 		return NULL;
 	}
 
@@ -446,7 +1087,8 @@ struct sched_task *sched_task_exec(const char *path, uint16_t cs, struct sched_a
 	if(elf_load(task->page_table, &aux, fd, 0, &ld_path) == -1) {
 		fd_close(fd);
 		CORE_LOCAL->pid = current_task->pid;
-		spinrelease(&sched_lock);
+		CORE_LOCAL->task = current_task;
+		sched_lock_release();
 		return NULL;
 	}
 
@@ -459,7 +1101,8 @@ struct sched_task *sched_task_exec(const char *path, uint16_t cs, struct sched_a
 		if(ld_fd == -1) {
 			fd_close(ld_fd);
 			CORE_LOCAL->pid = current_task->pid;
-			spinrelease(&sched_lock);
+			CORE_LOCAL->task = current_task;
+			sched_lock_release();
 			return NULL;
 		}
 
@@ -467,7 +1110,8 @@ struct sched_task *sched_task_exec(const char *path, uint16_t cs, struct sched_a
 		if(elf_load(task->page_table, &ld_aux, ld_fd, 0x40000000, NULL) == -1) {
 			fd_close(ld_fd);
 			CORE_LOCAL->pid = current_task->pid;
-			spinrelease(&sched_lock);
+			CORE_LOCAL->task = current_task;
+			sched_lock_release();
 			return NULL;
 		}
 
@@ -480,11 +1124,13 @@ struct sched_task *sched_task_exec(const char *path, uint16_t cs, struct sched_a
 
 	if(thread == NULL) {
 		CORE_LOCAL->pid = current_task->pid;
-		spinrelease(&sched_lock);
+		CORE_LOCAL->task = current_task;
+		sched_lock_release();
 		return NULL;
 	}
 
 	CORE_LOCAL->pid = current_task->pid;
+	CORE_LOCAL->task = current_task;
 
 	vmm_init_page_table(current_task->page_table);
 
@@ -499,10 +1145,13 @@ struct sched_task *sched_task_exec(const char *path, uint16_t cs, struct sched_a
 	task->exit_trigger->event->task = current_task;
 	task->exit_trigger->event->thread = current_thread;
 
-	spinrelease(&sched_lock);
+	sched_lock_release();
 
-	task->status = status;
-	thread->status = TASK_WAITING;
+	if(status == TASK_WAITING) {
+		sched_requeue(task, thread);
+	} else {
+		task->status = status;
+	}
 
 	return task;
 }
@@ -563,7 +1212,7 @@ int event_fire(struct event_trigger *trigger) {
 	struct event *event = trigger->event;
 	struct sched_task *task = event->task;
 
-	asm volatile ("cli");
+	uint64_t rflags = interrupts_save(); // timers fire from inside the scheduler
 
 	spinlock(&event->lock);
 
@@ -573,7 +1222,7 @@ int event_fire(struct event_trigger *trigger) {
 
 	spinrelease(&event->lock);
 
-	asm volatile ("sti");
+	interrupts_restore(rflags);
 
 	return 0;
 }
@@ -589,7 +1238,7 @@ int event_create_timer(struct event *event, struct timespec *timespec) {
 	timer->timespec = *timespec;
 
 	VECTOR_PUSH(timer->triggers, event->timer_trigger);
-	VECTOR_PUSH(timer_list, timer);
+	timer_add(timer, timespec);
 
 	return 0;
 }
@@ -739,28 +1388,20 @@ void syscall_exit(struct registers *regs) {
 		struct sched_thread *thread = task->thread_list.data[i];
 
 		if(thread) {
-			thread->status = TASK_YIELD;
+			sched_dequeue(task, thread);
 			hash_table_delete(&task->thread_list, &thread->tid, sizeof(thread->tid));
 		}
 	}
 
 	struct page_table *page_table = task->page_table;
 
-	/* TODO leaks inner pt levels */
-	for(size_t i = 0; i < page_table->pages->capacity; i++) {
-		struct page *page = page_table->pages->data[i];
+	CORE_LOCAL->page_table = &kernel_mappings; // get off the tables before tearing them down
+	vmm_init_page_table(&kernel_mappings);
 
-		if(page) {
-			hash_table_delete(page_table->pages, &page->vaddr, sizeof(page->vaddr));
+	tlb_wait_inactive(page_table); // other threads may still be running on it until their cores switch them out
 
-			if((*page->reference) <= 1) { // shared page
-				(*page->reference)--;
-				continue;
-			}
-
-			pmm_free(page->paddr, 1);
-		}
-	}
+	vmm_destroy_page_table(page_table);
+	task->page_table = NULL;
 
 	int status = regs->rdi;
 
@@ -783,6 +1424,8 @@ void syscall_exit(struct registers *regs) {
 
 	CORE_LOCAL->pid = -1;
 	CORE_LOCAL->tid = -1;
+	CORE_LOCAL->task = NULL;
+	CORE_LOCAL->thread = NULL;
 
 	asm volatile ("sti");
 
@@ -815,12 +1458,12 @@ void syscall_execve(struct registers *regs) {
 	strcpy(path, _path);
 
 	for(size_t i = 0; i < envp_cnt; i++) {
-		envp[i] = alloc(strlen(_envp[i]));
+		envp[i] = alloc(strlen(_envp[i]) + 1);
 		strcpy(envp[i], _envp[i]);
 	}
 
 	for(size_t i = 0; i < argv_cnt; i++) {
-		argv[i] = alloc(strlen(_argv[i]));
+		argv[i] = alloc(strlen(_argv[i]) + 1);
 		strcpy(argv[i], _argv[i]);
 	}
 
@@ -904,19 +1547,42 @@ void syscall_execve(struct registers *regs) {
 	task->session = current_task->session;
 
 	task->umask = current_task->umask;
+	task->nice = current_task->nice;
 
 	task->has_execved = 1;
 
+	asm volatile ("cli"); // switching back onto the old tables now would keep them alive forever
+
+	for(size_t i = 0; i < current_task->thread_list.capacity; i++) {
+		struct sched_thread *sibling = current_task->thread_list.data[i];
+
+		if(sibling && sibling->tid != CORE_LOCAL->tid) {
+			sched_dequeue(current_task, sibling);
+		}
+	}
+
+	CORE_LOCAL->page_table = &kernel_mappings; // the old image is gone for good
+	vmm_init_page_table(&kernel_mappings);
+
+	tlb_wait_inactive(current_task->page_table);
+
+	vmm_destroy_page_table(current_task->page_table);
+	current_task->page_table = NULL;
+
 	CORE_LOCAL->pid = -1;
 	CORE_LOCAL->tid = -1;
+	CORE_LOCAL->task = NULL;
+	CORE_LOCAL->thread = NULL;
 
 	hash_table_push(&task_list, &task->pid, task, sizeof(task->pid));
 
+	asm volatile ("sti");
+
 	sched_yield();
 }
 
 void syscall_fork(struct registers *regs) {
-	spinlock(&sched_lock);
+	sched_lock_acquire();
 
 #ifndef SYSCALL_DEBUG
 	print("syscall: [pid %x] fork\n", CORE_LOCAL->pid);
@@ -932,13 +1598,20 @@ void syscall_fork(struct registers *regs) {
 		panic("");
 	}
 
+	struct page_table *page_table = vmm_fork_page_table(current_task->page_table);
+	if(page_table == NULL) {
+		sched_lock_release();
+		set_errno(ENOMEM);
+		regs->rax = -1;
+		return;
+	}
+
 	struct sched_task *task = alloc(sizeof(struct sched_task));
 	struct sched_thread *thread = alloc(sizeof(struct sched_thread));
 
 	task->pid = bitmap_alloc(&pid_bitmap);
 	task->ppid = current_task->pid;
-	task->status = TASK_WAITING;
-	task->page_table = vmm_fork_page_table(current_task->page_table);
+	task->page_table = page_table;
 	task->cwd = current_task->cwd;
 
 	task->real_uid = current_task->real_uid;
@@ -950,6 +1623,7 @@ void syscall_fork(struct registers *regs) {
 	task->saved_gid = current_task->saved_gid;
 
 	task->umask = current_task->umask;
+	task->nice = current_task->nice;
 
 	task->pgid = current_task->pgid;
 	task->group = current_task->group;
@@ -990,11 +1664,11 @@ void syscall_fork(struct registers *regs) {
 	thread->regs = *regs;
 	thread->user_gs_base = current_thread->user_gs_base;
 	thread->user_fs_base = current_thread->user_fs_base;
-	thread->kernel_stack = pmm_alloc(DIV_ROUNDUP(THREAD_KERNEL_STACK_SIZE, PAGE_SIZE), 1) + THREAD_KERNEL_STACK_SIZE + HIGH_VMA;
+	thread->kernel_stack = pmm_alloc_flags(DIV_ROUNDUP(THREAD_KERNEL_STACK_SIZE, PAGE_SIZE), 1, PMM_ALLOC_NOZERO) + THREAD_KERNEL_STACK_SIZE + HIGH_VMA;
 	thread->user_stack = current_thread->user_stack;
-	thread->status = TASK_WAITING;
 	thread->tid = bitmap_alloc(&task->tid_bitmap);
 	thread->pid = task->pid;
+	thread->task = task;
 
 	hash_table_push(&task_list, &task->pid, task, sizeof(task->pid));
 	hash_table_push(&task->thread_list, &thread->tid, thread, sizeof(thread->tid));
@@ -1004,7 +1678,9 @@ void syscall_fork(struct registers *regs) {
 
 	VECTOR_PUSH(current_task->children, task);
 
-	spinrelease(&sched_lock);
+	sched_requeue(task, thread);
+
+	sched_lock_release();
 }
 
 void syscall_getpid(struct registers *regs) {
@@ -1190,3 +1866,271 @@ void syscall_getsid(struct registers *regs) {
 
 	regs->rax = CURRENT_TASK->sid;
 }
+
+static bool sched_priority_match(struct sched_task *task, struct sched_task *current_task, int which, int who) {
+	switch(which) {
+		case PRIO_PROCESS:
+			return task->pid == (who ? who : current_task->pid);
+		case PRIO_PGRP:
+			return task->pgid == (who ? who : current_task->pgid);
+		case PRIO_USER:
+			return task->real_uid == (who ? who : current_task->real_uid);
+	}
+
+	return false;
+}
+
+// only root may raise a priority or touch processes of other users, the new weight applies from the next switch
+void syscall_setpriority(struct registers *regs) {
+	int which = regs->rdi;
+	int who = regs->rsi;
+	int nice = regs->rdx;
+
+#ifndef SYSCALL_DEBUG
+	print("syscall: [pid %x] setpriority: which {%x}, who {%x}, prio {%d}\n", CORE_LOCAL->pid, which, who, nice);
+#endif
+
+	if(which != PRIO_PROCESS && which != PRIO_PGRP && which != PRIO_USER) {
+		set_errno(EINVAL);
+		regs->rax = -1;
+		return;
+	}
+
+	if(nice < SCHED_NICE_MIN) nice = SCHED_NICE_MIN;
+	if(nice > SCHED_NICE_MAX) nice = SCHED_NICE_MAX;
+
+	struct sched_task *current_task = CURRENT_TASK;
+	int error = ESRCH;
+
+	sched_lock_acquire();
+
+	for(size_t i = 0; i < task_list.capacity; i++) {
+		struct sched_task *task = task_list.data[i];
+		if(task == NULL || !sched_priority_match(task, current_task, which, who)) {
+			continue;
+		}
+
+		if(current_task->effective_uid != 0 && current_task->effective_uid != task->real_uid &&
+			current_task->effective_uid != task->effective_uid) {
+			error = EPERM;
+			continue;
+		}
+
+		if(current_task->effective_uid != 0 && nice < task->nice) {
+			error = EACCES;
+			continue;
+		}
+
+		task->nice = nice;
+
+		if(error == ESRCH) {
+			error = 0;
+		}
+	}
+
+	sched_lock_release();
+
+	if(error) {
+		set_errno(error);
+		regs->rax = -1;
+		return;
+	}
+
+	regs->rax = 0;
+}
+
+// like linux the value is 20 - nice so a successful call never looks like -1
+void syscall_getpriority(struct registers *regs) {
+	int which = regs->rdi;
+	int who = regs->rsi;
+
+#ifndef SYSCALL_DEBUG
+	print("syscall: [pid %x] getpriority: which {%x}, who {%x}\n", CORE_LOCAL->pid, which, who);
+#endif
+
+	if(which != PRIO_PROCESS && which != PRIO_PGRP && which != PRIO_USER) {
+		set_errno(EINVAL);
+		regs->rax = -1;
+		return;
+	}
+
+	struct sched_task *current_task = CURRENT_TASK;
+	int nice = SCHED_NICE_MAX + 1;
+
+	sched_lock_acquire();
+
+	for(size_t i = 0; i < task_list.capacity; i++) {
+		struct sched_task *task = task_list.data[i];
+
+		if(task && sched_priority_match(task, current_task, which, who) && task->nice < nice) {
+			nice = task->nice;
+		}
+	}
+
+	sched_lock_release();
+
+	if(nice > SCHED_NICE_MAX) {
+		set_errno(ESRCH);
+		regs->rax = -1;
+		return;
+	}
+
+	regs->rax = 20 - nice;
+}
+
+#ifdef SCHED_BENCHMARK
+
+#define SCHED_BENCHMARK_UNITS 256 // independent jobs per round, like the objects of a parallel build
+#define SCHED_BENCHMARK_WORDS 4096 // 32 KiB of working set per worker
+#define SCHED_BENCHMARK_PASSES 64
+
+static struct sched_task *sched_benchmark_task;
+static struct sched_thread *sched_benchmark_thread;
+
+static struct sched_task **sched_benchmark_worker_tasks;
+static struct sched_thread **sched_benchmark_worker_threads;
+
+static size_t sched_benchmark_next;
+static size_t sched_benchmark_workers;
+static size_t sched_benchmark_finished;
+static uint64_t sched_benchmark_sink;
+
+// sleeping and waking happen under this lock so a wakeup can not slip in before the sleep
+static char sched_benchmark_lock;
+
+static uint64_t sched_benchmark_unit(uint64_t *buffer, size_t unit) {
+	uint64_t state = unit * 0x9e3779b97f4a7c15ull + 1;
+
+	for(size_t i = 0; i < SCHED_BENCHMARK_WORDS; i++) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		buffer[i] = state;
+	}
+
+	uint64_t hash = 0xcbf29ce484222325ull;
+
+	for(size_t pass = 0; pass < SCHED_BENCHMARK_PASSES; pass++) {
+		for(size_t i = 0; i < SCHED_BENCHMARK_WORDS; i++) {
+			hash = (hash ^ buffer[i]) * 0x100000001b3ull;
+		}
+	}
+
+	return hash;
+}
+
+// lock held with interrupts off, the thread goes back to sleep once its core switches it out
+static void sched_benchmark_sleep(struct sched_task *task, struct sched_thread *thread) {
+	sched_dequeue(task, thread);
+	task->event_waiting = 1;
+
+	spinrelease(&sched_benchmark_lock);
+	asm volatile ("sti");
+
+	while(task->event_waiting) {
+		asm volatile ("hlt");
+	}
+}
+
+static void sched_benchmark_worker() {
+	struct sched_task *task = CURRENT_TASK;
+	struct sched_thread *thread = CURRENT_THREAD;
+
+	uint64_t *buffer = alloc(SCHED_BENCHMARK_WORDS * sizeof(uint64_t));
+
+	for(;;) {
+		size_t unit;
+
+		while((unit = __atomic_fetch_add(&sched_benchmark_next, 1, __ATOMIC_RELAXED)) < SCHED_BENCHMARK_UNITS) {
+			__atomic_xor_fetch(&sched_benchmark_sink, sched_benchmark_unit(buffer, unit), __ATOMIC_RELAXED);
+		}
+
+		asm volatile ("cli");
+		spinlock(&sched_benchmark_lock);
+
+		if(++sched_benchmark_finished == sched_benchmark_workers) {
+			sched_requeue(sched_benchmark_task, sched_benchmark_thread);
+		}
+
+		sched_benchmark_sleep(task, thread);
+	}
+}
+
+static uint64_t sched_benchmark_round(size_t workers) {
+	sched_benchmark_next = 0;
+	sched_benchmark_finished = 0;
+	sched_benchmark_workers = workers;
+
+	uint64_t start = hpet_nanoseconds();
+
+	asm volatile ("cli");
+	spinlock(&sched_benchmark_lock);
+
+	for(size_t i = 0; i < workers; i++) {
+		sched_requeue(sched_benchmark_worker_tasks[i], sched_benchmark_worker_threads[i]);
+	}
+
+	for(;;) {
+		if(sched_benchmark_finished == workers) {
+			spinrelease(&sched_benchmark_lock);
+			asm volatile ("sti");
+			break;
+		}
+
+		sched_benchmark_sleep(sched_benchmark_task, sched_benchmark_thread);
+
+		asm volatile ("cli");
+		spinlock(&sched_benchmark_lock);
+	}
+
+	return hpet_nanoseconds() - start;
+}
+
+// the same batch of jobs on 1, 2, 4 ... workers up to one per core, the caller sleeps while they run
+void sched_benchmark() {
+	size_t cpus = cpu_local_list.length;
+
+	sched_benchmark_task = CURRENT_TASK;
+	sched_benchmark_thread = CURRENT_THREAD;
+
+	sched_benchmark_worker_tasks = alloc(sizeof(struct sched_task*) * cpus);
+	sched_benchmark_worker_threads = alloc(sizeof(struct sched_thread*) * cpus);
+
+	for(size_t i = 0; i < cpus; i++) {
+		struct sched_task *task = sched_default_task();
+		task->page_table = &kernel_mappings;
+
+		struct sched_thread *thread = sched_default_thread(task);
+
+		thread->regs.cs = 0x28;
+		thread->regs.ss = 0x30;
+		thread->regs.rip = (uintptr_t)sched_benchmark_worker;
+		thread->regs.rflags = 0x202;
+		thread->regs.rsp = thread->kernel_stack;
+
+		sched_benchmark_worker_tasks[i] = task;
+		sched_benchmark_worker_threads[i] = thread;
+	}
+
+	print("sched: benchmark, %d jobs per round on up to %d cores\n", SCHED_BENCHMARK_UNITS, cpus);
+
+	uint64_t single = 0;
+
+	for(size_t workers = 1;; workers = workers * 2 < cpus ? workers * 2 : cpus) {
+		uint64_t elapsed = sched_benchmark_round(workers);
+		if(workers == 1) single = elapsed;
+
+		size_t speedup = single * 100 / (elapsed ? elapsed : 1);
+
+		print("sched: %d workers took %d ms, speedup %d.%d%d, %d percent of linear\n", workers, elapsed / 1000000,
+			speedup / 100, speedup / 10 % 10, speedup % 10, speedup / workers);
+
+		if(workers == cpus) {
+			break;
+		}
+	}
+
+	print("sched: benchmark done, checksum %x\n", sched_benchmark_sink);
+}
+
+#endif
@@ -42,8 +42,9 @@ struct sched_thread {
 	tid_t tid;
 	pid_t pid;
 
+	struct sched_task *task;
+
 	size_t status;
-	size_t idle_cnt;
 	size_t user_stack;
 	size_t kernel_stack;
 	size_t user_gs_base;
@@ -58,6 +59,68 @@ struct sched_thread {
 	struct signal_queue signal_queue;
 
 	struct registers regs;
+
+	struct sched_queue *queue; // the run queue it last ran from
+	int last_cpu;
+	size_t last_ran; // in ticks of that queue
+	uint64_t vruntime; // weighted nanoseconds of cpu time
+	uint64_t exec_start; // when it was last charged
+	uint64_t slice_start; // when it was last switched in
+	uint32_t weight; // of its nice level when it was queued
+	struct sched_thread *rb_parent;
+	struct sched_thread *rb_left;
+	struct sched_thread *rb_right;
+	bool rb_red;
+	bool queued;
+	bool running;
+};
+
+// runnable threads of one core, blocked ones are on none
+struct sched_queue {
+	struct sched_thread *root;
+	struct sched_thread *leftmost;
+	size_t cnt;
+	uint64_t weight; // of the queued threads, the current one is not counted
+	uint64_t min_vruntime;
+
+	struct sched_thread *current;
+
+	int cpu;
+	int apic_id;
+	bool idle;
+	uintptr_t idle_stack;
+
+	size_t ticks;
+	size_t switches;
+	size_t wakeup_preemptions;
+	uint64_t deadline; // of the armed one-shot timer, -1 when none is
+	size_t interrupts; // scheduler passes, timer and kicks alike
+	size_t idle_wakeups;
+	size_t timer_expiries;
+	size_t idle_steals;
+	size_t balance_pulls;
+	size_t migrations_out;
+
+	bool sched_lock_held; // by this core, its current thread must not be switched away from
+
+	char lock;
+};
+
+struct sched_queue_stats {
+	int cpu;
+	int apic_id;
+	size_t queued;
+	bool idle;
+	size_t ticks;
+	size_t switches;
+	size_t interrupts;
+	size_t idle_wakeups;
+	size_t timer_expiries;
+	size_t wakeup_preemptions;
+	uint64_t min_vruntime;
+	size_t idle_steals;
+	size_t balance_pulls;
+	size_t migrations_out;
 };
 
 struct process_group;
@@ -90,7 +153,6 @@ struct sched_task {
 
 	int has_execved;
 
-	size_t idle_cnt;
 	size_t status;
 	int process_status;
 
@@ -103,6 +165,7 @@ struct sched_task {
 	gid_t saved_gid;
 
 	mode_t umask;
+	int nice;
 
 	char sig_lock;
 	struct sigaction sigactions[SIGNAL_MAX];
@@ -146,12 +209,16 @@ struct sched_thread *sched_default_thread(struct sched_task *task);
 struct sched_task *sched_task_exec(const char *path, uint16_t cs, struct sched_arguments *arguments, int status);
 struct sched_thread *sched_thread_exec(struct sched_task *task, uint64_t rip, uint16_t cs, struct aux *aux, struct sched_arguments *arguments);
 
+struct sched_queue *sched_queue_create(int cpu, int apic_id);
+size_t sched_get_stats(struct sched_queue_stats *stats, size_t cnt);
+
 void reschedule(struct registers *regs, void *ptr);
 void sched_dequeue(struct sched_task *task, struct sched_thread *thread);
 void sched_dequeue_and_yield(struct sched_task *task, struct sched_thread *thread);
 void sched_requeue(struct sched_task *task, struct sched_thread *thread);
 void sched_requeue_and_yield(struct sched_task *task, struct sched_thread *thread);
 void sched_yield();
+void sched_benchmark();
 
 int event_append_trigger(struct event *event, struct event_trigger *trigger);
 int event_wait(struct event *event, int event_type);
@@ -163,19 +230,32 @@ int task_create_session(struct sched_task *task);
 extern char sched_lock;
 
 #define CURRENT_TASK ({ \
-	sched_translate_pid(CORE_LOCAL->pid); \
+	CORE_LOCAL->task; \
 })
 
 #define CURRENT_THREAD ({ \
-	sched_translate_tid(CORE_LOCAL->pid, CORE_LOCAL->tid); \
+	CORE_LOCAL->thread; \
 })
 
 #define TASK_RUNNING 0
 #define TASK_WAITING 1
 #define TASK_YIELD 2
 
+#define SCHED_TICK_NS 20000000 // longest a busy core goes without a scheduler pass, idle ones have none
+#define SCHED_LATENCY_NS 24000000 // every runnable thread of a queue runs once within this
+#define SCHED_MIN_GRANULARITY_NS 3000000 // shortest slice however many threads share the queue
+#define SCHED_WAKEUP_GRANULARITY_NS 4000000 // vruntime lead a woken thread needs to preempt
+#define SCHED_NICE_0_WEIGHT 1024
+#define SCHED_NICE_MIN -20
+#define SCHED_NICE_MAX 19
+
+#define PRIO_PROCESS 0
+#define PRIO_PGRP 1
+#define PRIO_USER 2
+
+#define SCHED_BALANCE_INTERVAL 4 // ticks between periodic balancing passes of a core
+#define SCHED_BALANCE_IMBALANCE 2 // load difference worth a migration
+#define SCHED_CACHE_HOT_TICKS 2 // a thread switched out more recently is left with its cache
+
 #define THREAD_KERNEL_STACK_SIZE 0x4000
 #define THREAD_USER_STACK_SIZE 0x10000
-
-#define TASK_MAX_PRIORITY ~(0ull)
-#define TASK_MIN_PRIORITY ~(0)
@@ -2,6 +2,8 @@
 #include <int/apic.h>
 #include <mm/pmm.h>
 #include <mm/vmm.h>
+#include <mm/tlb.h>
+#include <sched/sched.h>
 #include <acpi/madt.h>
 #include <int/idt.h>
 #include <int/gdt.h>
@@ -12,6 +14,7 @@
 static char core_init_lock;
 
 size_t logical_processor_cnt;
+typeof(cpu_local_list) cpu_local_list;
 
 static void core_bootstrap(struct cpu_local *cpu_local) {
 	init_cpu_features();
@@ -22,15 +25,17 @@ static void core_bootstrap(struct cpu_local *cpu_local) {
 	spinrelease(&core_init_lock);
 
 	wrmsr(MSR_GS_BASE, (uintptr_t)cpu_local);
+	tlb_cpu_online();
 
 	xapic_write(XAPIC_TPR_OFF, 0);
 	xapic_write(XAPIC_SINT_OFF, xapic_read(XAPIC_SINT_OFF) | 0x1ff);
 
-	//apic_timer_init(20);
+	apic_timer_init();
 
 	asm volatile ("mov %0, %%cr8\nsti" :: "r"(0ull));
 
-	for(;;) {
+	for(;;) { // idle until a kick hands it work
+		pmm_zero_idle();
 		asm ("hlt");
 	}
 };
@@ -61,6 +66,11 @@ void boot_aps() {
 			continue;
 		}
 
+		if(cpu_local_list.length == TLB_MAX_CPUS) { // cpu masks are a single qword
+			print("smp: ignoring apic_id %x, too many cores\n", madt0->apic_id);
+			continue;
+		}
+
 		struct cpu_local *cpu_local = alloc(sizeof(struct cpu_local));
 
 		*cpu_local = (struct cpu_local) {
@@ -68,11 +78,19 @@ void boot_aps() {
 			.apic_id = madt0->apic_id,
 			.pid = -1,
 			.tid = -1,
-			.page_table = &kernel_mappings
+			.page_table = &kernel_mappings,
+			.pmm_cache = alloc(sizeof(struct pmm_cache)),
+			.slab_magazines = alloc(sizeof(struct slab_magazine) * SLAB_PERCPU_CACHES_MAX),
+			.cpu_number = cpu_local_list.length,
+			.tlb_page_table = &kernel_mappings,
+			.run_queue = sched_queue_create(cpu_local_list.length, madt0->apic_id)
 		};
 
+		VECTOR_PUSH(cpu_local_list, cpu_local);
+
 		if(cpu_local->apic_id == (xapic_read(XAPIC_ID_REG_OFF) >> 24)) {
 			wrmsr(MSR_GS_BASE, (uintptr_t)cpu_local);
+			tlb_cpu_online();
 			continue;
 		}
 
@@ -104,4 +122,5 @@ void boot_aps() {
 	spinlock(&core_init_lock);
 
 	kernel_mappings.unmap_page(&kernel_mappings, 0);
+	invlpg(0);
 }
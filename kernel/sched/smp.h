@@ -1,8 +1,13 @@
 #pragma once
 
 #include <mm/vmm.h>
+#include <mm/pmm.h>
+#include <mm/slab.h>
+#include <vector.h>
 #include <types.h>
 
+struct sched_queue;
+
 struct cpu_local {
 	uintptr_t kernel_stack;
 	uintptr_t user_stack;
@@ -11,8 +16,16 @@ struct cpu_local {
 	tid_t tid;
 	int apic_id;
 	struct page_table *page_table;
+	struct pmm_cache *pmm_cache;
+	struct slab_magazine *slab_magazines;
+	int cpu_number;
+	struct page_table *tlb_page_table;
+	struct sched_queue *run_queue;
+	struct sched_task *task; // set on every switch, the task list can be resized under a lookup by pid
+	struct sched_thread *thread;
 } __attribute__((packed));
 
 extern size_t logical_processor_cnt;
+extern VECTOR(struct cpu_local*) cpu_local_list;
 
 void boot_aps();